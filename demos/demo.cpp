@@ -19,6 +19,7 @@
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 
 #include <libsitu.h>
 
@@ -34,21 +35,34 @@ void alarm(const char *name,
          data);
 }
 
-int main(int UNUSED(argc), char *UNUSED(argv[]))
+int main(int argc, char *argv[])
 {
   const int sleep_us = 500000;
   const int poll_us = 2000000;
-  libsitu::Gps gps("localhost", "gpsd", poll_us, sleep_us);
-
-  /* N.B. Maps onto FGW route code 0387 */
-  gps.add_watch("NEWBURY", 51.398, -1.323, 500, &alarm, NULL);
-  gps.add_watch("NEWBRYR", 51.398, -1.308, 500, &alarm, NULL);
-  gps.add_watch("THATCHM", 51.394, -1.243, 500, &alarm, NULL);
-  gps.add_watch("MIDGHAM", 51.396, -1.178, 500, &alarm, NULL);
-  gps.add_watch("ALDMSTN", 51.402, -1.139, 500, &alarm, NULL);
-  gps.add_watch( "THEALE", 51.433, -1.075, 500, &alarm, NULL);
-  gps.add_watch("REDGWST", 51.455, -0.990, 500, &alarm, NULL);
-  gps.add_watch("RDNGSTN", 51.459, -0.972, 500, &alarm, NULL);
+  /* N.B. "demo shm" reads from shared memory; see shmwriter */
+  const libsitu::Transport transport =
+    argc > 1 && 0 == strcmp(argv[1], "shm") ?
+    libsitu::TRANSPORT_SHM : libsitu::TRANSPORT_SOCKET;
+  libsitu::Gps gps("localhost", "gpsd", poll_us, sleep_us, transport);
+
+  /* N.B. Sleep for between 0.2s and 30s, depending on speed and the
+   * distance to the nearest station */
+  libsitu::Schedule schedule = { 200000, 30000000, 60, 2 };
+  gps.set_schedule(schedule);
+
+  /* N.B. Maps onto FGW route code 0387; only the next stations along it
+   * are evaluated */
+  const libsitu::WatchId route[] = {
+    gps.add_watch("NEWBURY", 51.398, -1.323, 500, &alarm, NULL),
+    gps.add_watch("NEWBRYR", 51.398, -1.308, 500, &alarm, NULL),
+    gps.add_watch("THATCHM", 51.394, -1.243, 500, &alarm, NULL),
+    gps.add_watch("MIDGHAM", 51.396, -1.178, 500, &alarm, NULL),
+    gps.add_watch("ALDMSTN", 51.402, -1.139, 500, &alarm, NULL),
+    gps.add_watch( "THEALE", 51.433, -1.075, 500, &alarm, NULL),
+    gps.add_watch("REDGWST", 51.455, -0.990, 500, &alarm, NULL),
+    gps.add_watch("RDNGSTN", 51.459, -0.972, 500, &alarm, NULL)
+  };
+  gps.add_route(route, sizeof(route) / sizeof(route[0]));
 
   sleep(10);
 
@@ -56,5 +70,9 @@ int main(int UNUSED(argc), char *UNUSED(argv[]))
   gps.get_last_fix(fix);
   libsitu::Util::dump_fix_json(fix);
 
+  libsitu::Stats stats;
+  gps.get_stats(stats);
+  libsitu::Util::dump_stats_json(stats);
+
 	return EXIT_SUCCESS;
 }
@@ -0,0 +1,124 @@
+/*
+  Copyright 2013-2014 Simon Dawson
+
+  This file is part of libsitu.
+
+  libsitu is free software: you can redistribute it and/or modify
+  it under the terms of the GNU Lesser General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  libsitu is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU Lesser General Public License for more details.
+
+  You should have received a copy of the GNU Lesser General Public License
+  along with libsitu.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+/* A stand-in for gpsd, for the demos that check the library end to end
+ *
+ * Listens on an ephemeral port of the loopback interface, accepts one
+ * client, ignores its commands, and writes TPV reports to it, as gpsd
+ * would, so that fixes can be fed to a Gps without a receiver.
+ */
+
+#ifndef _LIBSITU_FAKEGPSD_H_
+#define _LIBSITU_FAKEGPSD_H_
+
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+
+class FakeGpsd {
+public:
+  FakeGpsd()
+    : m_listener(socket(AF_INET, SOCK_STREAM, 0)),
+      m_client(-1),
+      m_port()
+  {
+    struct sockaddr_in address;
+    memset(&address, 0, sizeof(address));
+    address.sin_family = AF_INET;
+    address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    socklen_t length = sizeof(address);
+    if (-1 == m_listener ||
+        0 != bind(m_listener, reinterpret_cast<struct sockaddr*>(&address),
+                  sizeof(address)) ||
+        0 != listen(m_listener, 1) ||
+        0 != getsockname(m_listener,
+                         reinterpret_cast<struct sockaddr*>(&address),
+                         &length)) {
+      perror("Failed to listen");
+      return;
+    }
+    snprintf(m_port, sizeof(m_port), "%u", ntohs(address.sin_port));
+  }
+
+  ~FakeGpsd()
+  {
+    if (-1 != m_client) {
+      close(m_client);
+    }
+    if (-1 != m_listener) {
+      close(m_listener);
+    }
+  }
+
+  /* N.B. The port to connect to, on localhost */
+  const char* get_port() const
+  {
+    return m_port;
+  }
+
+  /* N.B. Waits for the client to connect */
+  bool accept_client()
+  {
+    m_client = accept(m_listener, NULL, NULL);
+    return -1 != m_client;
+  }
+
+  /* N.B. A 3D fix, with a horizontal error of err_m in each axis */
+  bool send_fix(double time_s, double lat, double lon, double speed,
+                double track, double err_m)
+  {
+    const time_t seconds = static_cast<time_t>(time_s);
+    struct tm utc;
+    char stamp[32];
+    if (NULL == gmtime_r(&seconds, &utc) ||
+        0 == strftime(stamp, sizeof(stamp), "%Y-%m-%dT%H:%M:%S", &utc)) {
+      return false;
+    }
+
+    char report[512];
+    const int length =
+      snprintf(report, sizeof(report),
+               "{\"class\":\"TPV\",\"device\":\"fake\",\"status\":1,"
+               "\"mode\":3,\"time\":\"%s.%03dZ\",\"ept\":0.005,"
+               "\"lat\":%.9f,\"lon\":%.9f,\"alt\":0.0,"
+               "\"epx\":%.3f,\"epy\":%.3f,\"epv\":%.3f,"
+               "\"track\":%.4f,\"speed\":%.3f,\"climb\":0.0,"
+               "\"eps\":0.1}\n",
+               stamp, static_cast<int>((time_s - seconds) * 1000),
+               lat, lon, err_m, err_m, err_m, track, speed);
+    /* N.B. A client that has gone away is not worth a SIGPIPE */
+    return length > 0 && length < static_cast<int>(sizeof(report)) &&
+      length == send(m_client, report, length, MSG_NOSIGNAL);
+  }
+
+private:
+  FakeGpsd(const FakeGpsd&);
+  FakeGpsd& operator=(const FakeGpsd&);
+
+  int m_listener;
+  int m_client;
+  char m_port[8];
+};
+
+#endif
@@ -0,0 +1,247 @@
+/*
+  Copyright 2013-2014 Simon Dawson
+
+  This file is part of libsitu.
+
+  libsitu is free software: you can redistribute it and/or modify
+  it under the terms of the GNU Lesser General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  libsitu is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU Lesser General Public License for more details.
+
+  You should have received a copy of the GNU Lesser General Public License
+  along with libsitu.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+
+/* Check that the steady-state fix path does not touch the heap
+ *
+ * Sets up a stable watch set of every kind (named watches, some with
+ * windows, the rest on a route; a watch too large for the local tangent
+ * plane, evaluated at the default precision, which is GNU MPFR where
+ * available; compact watches; a compiled database), a subscription and a prediction lead time, then counts the calls to
+ * malloc, calloc, realloc and free, in any thread, while 100k fixes are
+ * read from a stand-in for gpsd (see fakegpsd.h), evaluated and
+ * published, with POLLING_EXTERNAL. The receiver drives back and forth
+ * through the watches, so that events are raised throughout, and an
+ * invalid call now and then logs a warning. Exits with failure if there
+ * was any allocation.
+ *
+ * N.B. The allocator is interposed via the glibc __libc_ entry points.
+ */
+
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <string>
+#include <vector>
+
+#include <libsitu.h>
+#include <gpsdb.h>
+
+#include "fakegpsd.h"
+
+extern "C" {
+  void* __libc_malloc(size_t size);
+  void* __libc_calloc(size_t count, size_t size);
+  void* __libc_realloc(void *ptr, size_t size);
+  void __libc_free(void *ptr);
+}
+
+namespace {
+
+  volatile bool armed = false;
+  unsigned long allocations = 0;
+  unsigned long frees = 0;
+  unsigned long events = 0;
+
+  const double base_lat = 51.398;
+  const double base_lon = -1.323;
+  const size_t watch_count = 60;
+  const double watch_spacing = 0.0005; /* Degrees of longitude */
+  const double watch_rad_m = 15;
+  const double wide_rad_m = 5000;
+  const double row_offset = 0.00005; /* Degrees of latitude */
+  const double speed = 20;
+  const unsigned fix_count = 100000;
+  const unsigned warn_interval = 10000;
+
+  void count_allocation()
+  {
+    if (armed) {
+      __sync_fetch_and_add(&allocations, 1);
+    }
+  }
+
+  void alarm(const char *UNUSED(name), double UNUSED(distance),
+             libsitu::Event UNUSED(event), void *UNUSED(data))
+  {
+    ++events;
+  }
+
+  void handler(libsitu::WatchId UNUSED(id), double UNUSED(distance),
+               libsitu::Event UNUSED(event), void *UNUSED(data))
+  {
+    ++events;
+  }
+
+  double meters_per_degree()
+  /* Meters per degree of longitude along the row of watches */
+  {
+    return 111320 * cos(base_lat * acos(-1.0) / 180);
+  }
+
+  /* Longitude of the receiver at a step, driving back and forth along
+   * the row of watches, one step per second */
+  double track_lon(unsigned step, double &track)
+  {
+    const double span = watch_spacing * (watch_count + 1);
+    const double leg_steps = span * meters_per_degree() / speed;
+    const double phase = fmod(step / leg_steps, 2.0);
+    track = phase < 1 ? 90 : 270;
+    return base_lon - watch_spacing +
+      span * (phase < 1 ? phase : 2 - phase);
+  }
+
+}
+
+extern "C" {
+
+  void* malloc(size_t size)
+  {
+    count_allocation();
+    return __libc_malloc(size);
+  }
+
+  void* calloc(size_t count, size_t size)
+  {
+    count_allocation();
+    return __libc_calloc(count, size);
+  }
+
+  void* realloc(void *ptr, size_t size)
+  {
+    count_allocation();
+    return __libc_realloc(ptr, size);
+  }
+
+  void free(void *ptr)
+  {
+    if (armed && NULL != ptr) {
+      __sync_fetch_and_add(&frees, 1);
+    }
+    __libc_free(ptr);
+  }
+
+}
+
+int main(int UNUSED(argc), char *UNUSED(argv[]))
+{
+  char path[] = "/tmp/noallocXXXXXX";
+  const int fd = mkstemp(path);
+  if (-1 == fd) {
+    perror("Failed to create database");
+    return EXIT_FAILURE;
+  }
+  close(fd);
+
+  std::vector<libsitu::Database::Source> sources(watch_count);
+  for (size_t i = 0; i < watch_count; ++i) {
+    char name[16];
+    snprintf(name, sizeof(name), "DB%03u", static_cast<unsigned>(i));
+    sources[i].name = name;
+    sources[i].lat = base_lat - row_offset;
+    sources[i].lon = base_lon + i * watch_spacing;
+    sources[i].rad = watch_rad_m;
+  }
+  if (!libsitu::Database::compile(path, 1, sources)) {
+    fprintf(stderr, "Failed to compile database\n");
+    unlink(path);
+    return EXIT_FAILURE;
+  }
+
+  FakeGpsd gpsd;
+  bool ok = false;
+  {
+    libsitu::Gps gps("localhost", gpsd.get_port(), 1000000, 0,
+                     libsitu::TRANSPORT_SOCKET, libsitu::POLLING_EXTERNAL);
+    gps.set_prediction(2);
+
+    std::vector<libsitu::WatchId> route;
+    route.reserve(watch_count);
+    for (size_t i = 0; i < watch_count; ++i) {
+      const double lon = base_lon + i * watch_spacing;
+      char name[16];
+      snprintf(name, sizeof(name), "W%03u", static_cast<unsigned>(i));
+      const libsitu::WatchId id = 0 == i % 4 ?
+        gps.add_watch(base_lat, lon, watch_rad_m, &handler, NULL) :
+        gps.add_watch(name, base_lat, lon, watch_rad_m, &alarm, NULL);
+      if (0 == i % 3) {
+        /* N.B. Open in either half of the day, so that one is closed */
+        const libsitu::Window window = {
+          0 == i % 2 ? 0 : 43200, 0 == i % 2 ? 43200 : 0, 0
+        };
+        gps.set_window(id, window);
+      } else {
+        /* N.B. A windowed watch cannot be on a route */
+        route.push_back(id);
+      }
+      gps.add_compact_watch(base_lat + row_offset, lon, watch_rad_m,
+                            &handler, NULL);
+    }
+    gps.add_route(&route[0], route.size());
+
+    /* N.B. Centred so that the receiver crosses its boundary on each leg */
+    gps.add_watch(base_lat,
+                  base_lon + watch_spacing * watch_count / 2 -
+                  wide_rad_m / meters_per_degree(),
+                  wide_rad_m, &handler, NULL);
+    gps.open_database(path, &handler, NULL);
+
+    libsitu::Subscription subscription(gps, 64,
+                                       libsitu::OVERFLOW_DROP_OLDEST);
+    if (-1 == gps.get_fd() || !gpsd.accept_client()) {
+      fprintf(stderr, "Failed to connect\n");
+      unlink(path);
+      return EXIT_FAILURE;
+    }
+
+    const double start_s = time(NULL);
+    libsitu::Notification notification;
+    unsigned long notifications = 0;
+    unsigned step = 0;
+
+    armed = true;
+    for (; step < fix_count; ++step) {
+      double track = 0;
+      const double lon = track_lon(step, track);
+      if (!gpsd.send_fix(start_s + step, base_lat, lon, speed, track, 1) ||
+          !gps.process_ready()) {
+        break;
+      }
+      while (subscription.pop(notification)) {
+        ++notifications;
+      }
+      if (0 == step % warn_interval) {
+        /* N.B. Logs a warning */
+        gps.set_prediction(-1);
+      }
+    }
+    armed = false;
+
+    printf("%u fixes, %lu events, %lu notifications, "
+           "%lu allocations, %lu frees\n",
+           step, events, notifications, allocations, frees);
+    ok = fix_count == step && 0 == allocations && 0 == frees;
+  }
+
+  unlink(path);
+  return ok ? EXIT_SUCCESS : EXIT_FAILURE;
+}
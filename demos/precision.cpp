@@ -0,0 +1,309 @@
+/*
+  Copyright 2013-2014 Simon Dawson
+
+  This file is part of libsitu.
+
+  libsitu is free software: you can redistribute it and/or modify
+  it under the terms of the GNU Lesser General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  libsitu is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU Lesser General Public License for more details.
+
+  You should have received a copy of the GNU Lesser General Public License
+  along with libsitu.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+/* Compare each numeric policy against the MPFR reference
+ *
+ * For each policy, report the worst absolute distance error over a range
+ * of watch offsets, the number of NEAR/FAR classifications that disagree
+ * with the reference, and the mean time per distance calculation. The
+ * reference is the same haversine computed in MPFR, so that the error
+ * reported is due to precision alone. Where MPFR is not available, long
+ * double is used as the reference.
+ *
+ * The local tangent plane and integer fixed-point paths are timed per
+ * classification, since they do not compute a distance unless the state
+ * changes.
+ *
+ * Exits with failure if any policy exceeds its tolerance. No offset lies
+ * within 10m of a zone boundary, so no policy may misclassify; the
+ * tolerances on the distance error are given with each policy.
+ */
+
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include <libsitu.h>
+#include <gpsmath.h>
+
+namespace {
+
+  /* N.B. A float rounds each coordinate, in radians, to a 24-bit
+   * significand: up to 0.76m on the ground at these watches, and the
+   * haversine takes a few such roundings. The wider types are within a
+   * micron. */
+  const struct {
+    libsitu::Precision precision;
+    const char *name;
+    double tolerance_m;
+  } policies[] = {
+    { libsitu::PRECISION_MPFR, "mpfr", 1e-6 },
+    { libsitu::PRECISION_LONG_DOUBLE, "long double", 1e-6 },
+    { libsitu::PRECISION_DOUBLE, "double", 1e-6 },
+    { libsitu::PRECISION_FLOAT, "float", 2 }
+  };
+  const size_t policy_count = sizeof(policies) / sizeof(policies[0]);
+
+  /* The local tangent plane is only used where it is accurate to 0.25m
+   * (LIBSITU_PLANE_MAX_ERROR_m), out to twice the watch radius */
+  const double plane_tolerance_m = 0.25;
+
+  /* The fixed-point projection agrees with the great circle distance to
+   * within 0.1%, or 1m out to twice the watch radius, on top of the 1cm
+   * resolution of its coordinates */
+  const double fixed_tolerance_m = 1.01;
+
+  /* Watch positions: Newbury, Reading, Edinburgh, Quito, Svalbard */
+  const double bases[][2] = {
+    { 51.398, -1.323 },
+    { 51.459, -0.972 },
+    { 55.952, -3.189 },
+    { -0.180, -78.468 },
+    { 78.223, 15.646 }
+  };
+  const size_t base_count = sizeof(bases) / sizeof(bases[0]);
+
+  /* Offsets of the fix from the watch, in meters */
+  const double offsets_m[] = {
+    0.5, 2, 10, 50, 100, 250, 490, 510, 1000, 5000, 50000
+  };
+  const size_t offset_count = sizeof(offsets_m) / sizeof(offsets_m[0]);
+
+  const unsigned bearing_count = 16;
+  const double watch_rad_m = 500;
+  const unsigned timing_repeats = 2000;
+
+  double now_s()
+  {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+  }
+
+  bool report(const char *name, double max_error, unsigned misclassified,
+              double tolerance_m, double ns_per_call)
+  /* Print the results for a policy, and check them against its tolerance */
+  {
+    const bool ok = max_error <= tolerance_m && 0 == misclassified;
+    printf("%-12s %14.6f %14.6f %10u %12.1f%s\n", name, max_error,
+           tolerance_m, misclassified, ns_per_call, ok ? "" : "  FAIL");
+    return ok;
+  }
+
+  /* Offset a position by a distance along a bearing, on the sphere */
+  void offset(double lat, double lon, double dist_m, double bearing,
+              double &out_lat, double &out_lon)
+  {
+    const double pi = acos(-1.0);
+    const double delta = dist_m / 6378137.0;
+    const double phi1 = lat * pi / 180;
+    const double lambda1 = lon * pi / 180;
+    const double phi2 = asin(sin(phi1) * cos(delta) +
+                             cos(phi1) * sin(delta) * cos(bearing));
+    const double lambda2 = lambda1 +
+      atan2(sin(bearing) * sin(delta) * cos(phi1),
+            cos(delta) - sin(phi1) * sin(phi2));
+    out_lat = phi2 * 180 / pi;
+    out_lon = lambda2 * 180 / pi;
+  }
+
+}
+
+int main(int UNUSED(argc), char *UNUSED(argv[]))
+{
+  const libsitu::Precision reference_precision =
+    libsitu::Math::has_precision(libsitu::PRECISION_MPFR) ?
+    libsitu::PRECISION_MPFR : libsitu::PRECISION_LONG_DOUBLE;
+  const libsitu::Math::DistanceFunction reference =
+    libsitu::Math::distance_function(reference_precision);
+
+  printf("%-12s %14s %14s %10s %12s\n",
+         "policy", "max error (m)", "tolerance (m)", "misclass", "ns/call");
+  bool ok = true;
+
+  for (size_t p = 0; p < policy_count; ++p) {
+    if (!libsitu::Math::has_precision(policies[p].precision)) {
+      printf("%-12s %14s %14s %10s %12s\n", policies[p].name,
+             "-", "-", "-", "-");
+      continue;
+    }
+    const libsitu::Math::DistanceFunction distance =
+      libsitu::Math::distance_function(policies[p].precision);
+
+    double max_error = 0;
+    unsigned misclassified = 0;
+    unsigned calls = 0;
+    double elapsed = 0;
+    volatile double sink = 0;
+
+    for (size_t b = 0; b < base_count; ++b) {
+      for (size_t o = 0; o < offset_count; ++o) {
+        for (unsigned i = 0; i < bearing_count; ++i) {
+          const double bearing = 2 * acos(-1.0) * i / bearing_count;
+          libsitu::Fix fix = libsitu::Fix();
+          fix.valid = true;
+          fix.eph = 0;
+          offset(bases[b][0], bases[b][1], offsets_m[o], bearing,
+                 fix.latitude, fix.longitude);
+
+          libsitu::Math::State reference_state = libsitu::Math::STATE_UNKNOWN;
+          libsitu::Math::State state = libsitu::Math::STATE_UNKNOWN;
+          const double expected = (*reference)(
+            fix, bases[b][0], bases[b][1], watch_rad_m, reference_state);
+
+          const double start = now_s();
+          double actual = 0;
+          for (unsigned r = 0; r < timing_repeats; ++r) {
+            actual = (*distance)(fix, bases[b][0], bases[b][1],
+                                 watch_rad_m, state);
+            sink = sink + actual;
+          }
+          elapsed += now_s() - start;
+          calls += timing_repeats;
+
+          const double error = fabs(actual - expected);
+          if (!(error <= max_error)) {
+            max_error = error;
+          }
+          if (state != reference_state) {
+            ++misclassified;
+          }
+        }
+      }
+    }
+
+    ok = report(policies[p].name, max_error, misclassified,
+                policies[p].tolerance_m, 1e9 * elapsed / calls) && ok;
+  }
+
+  {
+    double max_error = 0;
+    unsigned misclassified = 0;
+    unsigned calls = 0;
+    double elapsed = 0;
+    volatile int sink = 0;
+
+    for (size_t b = 0; b < base_count; ++b) {
+      libsitu::Math::Plane there;
+      if (!libsitu::Math::plane_init(there, bases[b][0], bases[b][1],
+                                     watch_rad_m)) {
+        /* N.B. The watch would use great circle distance */
+        continue;
+      }
+      for (size_t o = 0; o < offset_count; ++o) {
+        for (unsigned i = 0; i < bearing_count; ++i) {
+          const double bearing = 2 * acos(-1.0) * i / bearing_count;
+          libsitu::Fix fix = libsitu::Fix();
+          fix.valid = true;
+          fix.eph = 0;
+          offset(bases[b][0], bases[b][1], offsets_m[o], bearing,
+                 fix.latitude, fix.longitude);
+
+          libsitu::Math::State reference_state = libsitu::Math::STATE_UNKNOWN;
+          const double expected = (*reference)(
+            fix, bases[b][0], bases[b][1], watch_rad_m, reference_state);
+
+          libsitu::Math::Here here;
+          libsitu::Math::here_init(here, fix);
+
+          const double start = now_s();
+          libsitu::Math::State state = libsitu::Math::STATE_UNKNOWN;
+          double distance_sq = 0;
+          for (unsigned r = 0; r < timing_repeats; ++r) {
+            state = libsitu::Math::plane_classify(fix, here, there,
+                                                  watch_rad_m, distance_sq);
+            sink = sink + state;
+          }
+          elapsed += now_s() - start;
+          calls += timing_repeats;
+
+          const double error = fabs(sqrt(distance_sq) - expected);
+          /* N.B. The local projection is only meaningful near the watch */
+          if (offsets_m[o] <= 2 * watch_rad_m && !(error <= max_error)) {
+            max_error = error;
+          }
+          if (state != reference_state) {
+            ++misclassified;
+          }
+        }
+      }
+    }
+
+    ok = report("plane", max_error, misclassified, plane_tolerance_m,
+                1e9 * elapsed / calls) && ok;
+  }
+
+  {
+    double max_error = 0;
+    unsigned misclassified = 0;
+    unsigned calls = 0;
+    double elapsed = 0;
+    volatile int sink = 0;
+
+    for (size_t b = 0; b < base_count; ++b) {
+      libsitu::Math::FixedThere there;
+      libsitu::Math::fixed_init(there, bases[b][0], bases[b][1],
+                                watch_rad_m);
+      for (size_t o = 0; o < offset_count; ++o) {
+        for (unsigned i = 0; i < bearing_count; ++i) {
+          const double bearing = 2 * acos(-1.0) * i / bearing_count;
+          libsitu::Fix fix = libsitu::Fix();
+          fix.valid = true;
+          fix.eph = 0;
+          offset(bases[b][0], bases[b][1], offsets_m[o], bearing,
+                 fix.latitude, fix.longitude);
+
+          libsitu::Math::State reference_state = libsitu::Math::STATE_UNKNOWN;
+          const double expected = (*reference)(
+            fix, bases[b][0], bases[b][1], watch_rad_m, reference_state);
+
+          libsitu::Math::Here here;
+          libsitu::Math::here_init(here, fix);
+
+          const double start = now_s();
+          libsitu::Math::State state = libsitu::Math::STATE_UNKNOWN;
+          int64_t distance_sq = 0;
+          for (unsigned r = 0; r < timing_repeats; ++r) {
+            state = libsitu::Math::fixed_classify(here.fixed, there,
+                                                  distance_sq);
+            sink = sink + state;
+          }
+          elapsed += now_s() - start;
+          calls += timing_repeats;
+
+          const double error =
+            fabs(libsitu::Math::fixed_distance(here.fixed, there) - expected);
+          /* N.B. The local projection is only meaningful near the watch */
+          if (offsets_m[o] <= 2 * watch_rad_m && !(error <= max_error)) {
+            max_error = error;
+          }
+          if (state != reference_state) {
+            ++misclassified;
+          }
+        }
+      }
+    }
+
+    ok = report("fixed", max_error, misclassified, fixed_tolerance_m,
+                1e9 * elapsed / calls) && ok;
+  }
+
+  return ok ? EXIT_SUCCESS : EXIT_FAILURE;
+}
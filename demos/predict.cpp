@@ -0,0 +1,140 @@
+/*
+  Copyright 2013-2014 Simon Dawson
+
+  This file is part of libsitu.
+
+  libsitu is free software: you can redistribute it and/or modify
+  it under the terms of the GNU Lesser General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  libsitu is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU Lesser General Public License for more details.
+
+  You should have received a copy of the GNU Lesser General Public License
+  along with libsitu.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+
+/* Check that a PREDICT event is raised ahead of ARRIVE with a poll schedule
+ *
+ * Drives a receiver at constant speed straight through a watch, with a
+ * poll schedule and a prediction lead time set, and checks that the
+ * PREDICT event is dispatched at least half the lead time before the
+ * ARRIVE event: a schedule that slept until just short of the boundary
+ * would raise both on successive wakeups. Fixes come from a stand-in for
+ * gpsd; see fakegpsd.h. Exits with failure if the check fails.
+ */
+
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <libsitu.h>
+
+#include "fakegpsd.h"
+
+namespace {
+
+  const double watch_lat = 51.398;
+  const double watch_lon = -1.323;
+  const double watch_rad_m = 50;
+  const double start_m = 300; /* South of the watch */
+  const double speed = 50;
+  const double lead_s = 1;
+  const double run_s = 8;
+  const int fix_interval_us = 20000;
+  const double meters_per_degree = 111320;
+
+  double now_s(clockid_t clock)
+  {
+    struct timespec ts;
+    clock_gettime(clock, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+  }
+
+  /* N.B. Times of the first event of each type, on the monotonic clock */
+  struct Arrivals {
+    double predict_s;
+    double arrive_s;
+  };
+
+  class Handler {
+  public:
+    explicit Handler(Arrivals *arrivals = NULL)
+      : m_arrivals(arrivals)
+    {
+    }
+
+    Handler(const Handler &handler)
+      : m_arrivals(handler.m_arrivals)
+    {
+    }
+
+    Handler& operator=(const Handler &handler)
+    {
+      m_arrivals = handler.m_arrivals;
+      return *this;
+    }
+
+    void operator()(const libsitu::WatchEvent &event)
+    {
+      double *first_s =
+        libsitu::EVENT_PREDICT == event.event ? &m_arrivals->predict_s :
+        libsitu::EVENT_ARRIVE == event.event ? &m_arrivals->arrive_s :
+        NULL;
+      if (NULL != first_s && 0 == *first_s) {
+        *first_s = now_s(CLOCK_MONOTONIC);
+      }
+    }
+
+  private:
+    Arrivals *m_arrivals;
+  };
+
+}
+
+int main(int UNUSED(argc), char *UNUSED(argv[]))
+{
+  FakeGpsd gpsd;
+  Arrivals arrivals = { 0, 0 };
+  double start_s = 0;
+  {
+    libsitu::BasicGps<Handler> gps("localhost", gpsd.get_port(),
+                                   1000000, fix_interval_us,
+                                   Handler(&arrivals));
+    const libsitu::Schedule schedule = { fix_interval_us, 10000000, 100, 0 };
+    gps.set_schedule(schedule);
+    gps.set_prediction(lead_s);
+    gps.add_watch(watch_lat, watch_lon, watch_rad_m);
+
+    if (!gpsd.accept_client()) {
+      perror("Failed to accept");
+      return EXIT_FAILURE;
+    }
+
+    start_s = now_s(CLOCK_MONOTONIC);
+    for (double elapsed_s = 0; elapsed_s < run_s;
+         elapsed_s = now_s(CLOCK_MONOTONIC) - start_s) {
+      const double north_m = speed * elapsed_s - start_m;
+      gpsd.send_fix(now_s(CLOCK_REALTIME),
+                    watch_lat + north_m / meters_per_degree, watch_lon,
+                    speed, 0, 1);
+      usleep(fix_interval_us);
+    }
+  }
+
+  printf("predict %.3fs, arrive %.3fs (boundary at %.3fs)\n",
+         arrivals.predict_s - start_s, arrivals.arrive_s - start_s,
+         (start_m - watch_rad_m) / speed);
+  if (0 == arrivals.predict_s || 0 == arrivals.arrive_s ||
+      arrivals.arrive_s - arrivals.predict_s < lead_s / 2) {
+    printf("FAIL: PREDICT was not raised ahead of ARRIVE\n");
+    return EXIT_FAILURE;
+  }
+  return EXIT_SUCCESS;
+}
@@ -0,0 +1,179 @@
+/*
+  Copyright 2013-2014 Simon Dawson
+
+  This file is part of libsitu.
+
+  libsitu is free software: you can redistribute it and/or modify
+  it under the terms of the GNU Lesser General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  libsitu is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU Lesser General Public License for more details.
+
+  You should have received a copy of the GNU Lesser General Public License
+  along with libsitu.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+/* Write simulated fixes to a gpsd shared memory segment
+ *
+ * Stands in for gpsd's shared memory export, so that TRANSPORT_SHM can be
+ * exercised without a receiver: e.g. run "shmwriter" alongside
+ * "demo shm". The receiver runs back and forth along the demo route, from
+ * Newbury to Reading, at 30m/s.
+ *
+ * Usage: shmwriter [interval_ms]
+ *
+ * As with libgps, the segment key may be overridden with the
+ * GPSD_SHM_KEY environment variable. The segment is left in place on
+ * exit, as gpsd leaves it.
+ */
+
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include <sys/ipc.h>
+#include <sys/shm.h>
+
+#include <gps.h>
+
+#include <libsitu.h>
+
+namespace {
+
+  /* N.B. The layout of gpsd's shared memory export (struct shmexport_t,
+   * private to gpsd): the data, between two copies of an update count */
+  struct Segment {
+    volatile int bookend1;
+    struct gps_data_t gpsdata;
+    volatile int bookend2;
+  };
+
+  /* N.B. As in the demo */
+  const double route[][2] = {
+    { 51.398, -1.323 },
+    { 51.398, -1.308 },
+    { 51.394, -1.243 },
+    { 51.396, -1.178 },
+    { 51.402, -1.139 },
+    { 51.433, -1.075 },
+    { 51.455, -0.990 },
+    { 51.459, -0.972 }
+  };
+  const size_t route_count = sizeof(route) / sizeof(route[0]);
+
+  const double speed_mps = 30;
+  const double meters_per_degree = 111195;
+
+  double leg_m(size_t leg, double &track)
+  /* Length of a leg of the route, in meters, in an equirectangular
+   * projection */
+  {
+    const double pi = acos(-1.0);
+    const double dy = (route[leg + 1][0] - route[leg][0]) * meters_per_degree;
+    const double dx = (route[leg + 1][1] - route[leg][1]) * meters_per_degree *
+      cos(route[leg][0] * pi / 180);
+    track = fmod(atan2(dx, dy) * 180 / pi + 360, 360);
+    return sqrt(dx * dx + dy * dy);
+  }
+
+  void position(double along_m, double &lat, double &lon, double &track)
+  /* Position at a distance along the route, and back */
+  {
+    double total_m = 0;
+    for (size_t leg = 0; leg + 1 < route_count; ++leg) {
+      total_m += leg_m(leg, track);
+    }
+    along_m = fmod(along_m, 2 * total_m);
+    const bool back = along_m > total_m;
+    if (back) {
+      along_m = 2 * total_m - along_m;
+    }
+
+    for (size_t leg = 0; leg + 1 < route_count; ++leg) {
+      const double length_m = leg_m(leg, track);
+      if (along_m <= length_m || leg + 2 == route_count) {
+        const double t = length_m > 0 ? along_m / length_m : 0;
+        lat = route[leg][0] + t * (route[leg + 1][0] - route[leg][0]);
+        lon = route[leg][1] + t * (route[leg + 1][1] - route[leg][1]);
+        if (back) {
+          track = fmod(track + 180, 360);
+        }
+        return;
+      }
+      along_m -= length_m;
+    }
+  }
+
+}
+
+int main(int argc, char *argv[])
+{
+  int interval_ms = 1000;
+  if (argc > 1 &&
+      (!libsitu::Util::parse_string_to_integer(argv[1], &interval_ms) ||
+       interval_ms <= 0)) {
+    fprintf(stderr, "Usage: %s [interval_ms]\n", argv[0]);
+    return EXIT_FAILURE;
+  }
+
+  const char *key_str = getenv("GPSD_SHM_KEY");
+  const key_t key = NULL == key_str ? GPSD_SHM_KEY :
+    static_cast<key_t>(strtol(key_str, NULL, 0));
+
+  const int id = shmget(key, sizeof(Segment), IPC_CREAT | 0666);
+  if (-1 == id) {
+    perror("shmget");
+    return EXIT_FAILURE;
+  }
+  void *address = shmat(id, NULL, 0);
+  if (reinterpret_cast<void*>(-1) == address) {
+    perror("shmat");
+    return EXIT_FAILURE;
+  }
+  Segment *segment = static_cast<Segment*>(address);
+  memset(segment, 0, sizeof(*segment));
+
+  printf("Writing fixes to shared memory key 0x%lx every %dms\n",
+         static_cast<unsigned long>(key), interval_ms);
+
+  int tick = 0;
+  for (unsigned long n = 0; ; ++n) {
+    struct gps_data_t data;
+    memset(&data, 0, sizeof(data));
+    data.set = PACKET_SET | STATUS_SET | MODE_SET | LATLON_SET | HERR_SET |
+      SPEED_SET | SPEEDERR_SET | TRACK_SET;
+    data.status = STATUS_FIX;
+    data.satellites_used = 8;
+    data.fix.mode = MODE_3D;
+    data.fix.epx = 3;
+    data.fix.epy = 3;
+    data.fix.speed = speed_mps;
+    data.fix.eps = 0.5;
+    position(speed_mps * n * interval_ms / 1000.0,
+             data.fix.latitude, data.fix.longitude, data.fix.track);
+
+    /* N.B. As gpsd does: a reader that sees equal bookends, before and
+     * after copying the data, has a consistent copy */
+    ++tick;
+    segment->bookend2 = tick;
+    __sync_synchronize();
+    memcpy(&segment->gpsdata, &data, sizeof(data));
+    __sync_synchronize();
+    segment->bookend1 = tick;
+
+    struct timespec req;
+    req.tv_sec = interval_ms / 1000;
+    req.tv_nsec = 1000000L * (interval_ms % 1000);
+    if (0 != nanosleep(&req, NULL)) {
+      perror("nanosleep");
+    }
+  }
+
+  return EXIT_SUCCESS;
+}
@@ -0,0 +1,263 @@
+/*
+  Copyright 2013-2014 Simon Dawson
+
+  This file is part of libsitu.
+
+  libsitu is free software: you can redistribute it and/or modify
+  it under the terms of the GNU Lesser General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  libsitu is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU Lesser General Public License for more details.
+
+  You should have received a copy of the GNU Lesser General Public License
+  along with libsitu.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+
+#include <math.h>
+
+#include <algorithm>
+
+#include <gpscompact.h>
+#include <gpsdebug.h>
+
+#define LIBSITU_COMPACT_SLOT_FREE 3
+#define LIBSITU_COMPACT_STATE_BITS 2
+#define LIBSITU_COMPACT_STATES_PER_WORD 32
+#define LIBSITU_COMPACT_UNITS_PER_DEGREE 1e7
+
+/* The number of events of a fix for which space is kept, so that fixes do
+ * not allocate; the whole set, if it is smaller. N.B. Not the whole set
+ * regardless, as an event is several times the size of a watch.
+ */
+#define LIBSITU_COMPACT_EVENTS 256
+
+namespace libsitu {
+
+  CompactTable::CompactTable()
+    : m_records(),
+      m_states(),
+      m_callbacks(),
+      m_callback_index(),
+      m_free(),
+      m_events(),
+      m_count(0)
+  {
+  }
+
+  CompactTable::~CompactTable()
+  {
+  }
+
+  WatchId CompactTable::add(double lat, double lon, double rad,
+                            WatchHandler handler, void *data)
+  {
+    if (!Math::is_finite(lat) || !Math::is_finite(lon) ||
+        lat < -90 || lat > 90 || lon < -180 || lon > 180 ||
+        !(rad > 0) || rad > UINT16_MAX) {
+      LIBSITU_WARN("Invalid compact watch %f,%f radius %f\n", lat, lon, rad);
+      return WATCH_ID_INVALID;
+    }
+
+    /* N.B. Watches sharing a callback and data are usually added
+     * together, so try the last entry before the index */
+    uint32_t callback = m_callbacks.size();
+    if (!m_callbacks.empty() && m_callbacks.back().handler == handler &&
+        m_callbacks.back().data == data) {
+      callback = m_callbacks.size() - 1;
+    } else {
+      const CallbackMap::const_iterator found =
+        m_callback_index.find(std::make_pair(handler, data));
+      if (m_callback_index.end() != found) {
+        callback = found->second;
+      }
+    }
+    if (callback == m_callbacks.size()) {
+      if (m_callbacks.size() > UINT16_MAX) {
+        LIBSITU_WARN("Too many compact watch callbacks\n");
+        return WATCH_ID_INVALID;
+      }
+      const Callback entry = { handler, data };
+      m_callbacks.push_back(entry);
+      m_callback_index[std::make_pair(handler, data)] =
+        static_cast<uint16_t>(callback);
+    }
+
+    uint32_t index = 0;
+    if (m_free.empty()) {
+      if (m_records.size() >= WATCH_INDEX_MASK) {
+        LIBSITU_WARN("Too many compact watches\n");
+        return WATCH_ID_INVALID;
+      }
+      index = m_records.size();
+      m_records.push_back(Record());
+      if (0 == index % LIBSITU_COMPACT_STATES_PER_WORD) {
+        m_states.push_back(0);
+      }
+    } else {
+      index = m_free.back();
+      m_free.pop_back();
+    }
+
+    Record &record = m_records[index];
+    record.lat = static_cast<int32_t>(
+      lround(lat * LIBSITU_COMPACT_UNITS_PER_DEGREE));
+    record.lon = static_cast<int32_t>(
+      lround(lon * LIBSITU_COMPACT_UNITS_PER_DEGREE));
+    record.rad = static_cast<uint16_t>(ceil(rad));
+    record.callback = static_cast<uint16_t>(callback);
+    set_state(index, Math::STATE_UNKNOWN);
+    ++m_count;
+    reserve_events();
+    return WATCH_COMPACT | index;
+  }
+
+  bool CompactTable::remove(WatchId id)
+  {
+    const uint32_t index = id & WATCH_INDEX_MASK;
+    if ((id & ~WATCH_INDEX_MASK) != WATCH_COMPACT ||
+        index >= m_records.size() ||
+        LIBSITU_COMPACT_SLOT_FREE == state_of(index)) {
+      return false;
+    }
+
+    /* N.B. Callback entries are kept, for the next watch using them */
+    set_state(index, LIBSITU_COMPACT_SLOT_FREE);
+    m_free.push_back(index);
+    --m_count;
+    return true;
+  }
+
+  size_t CompactTable::size() const
+  {
+    return m_count;
+  }
+
+  void CompactTable::reserve(size_t count)
+  {
+    m_records.reserve(count);
+    m_states.reserve((count + LIBSITU_COMPACT_STATES_PER_WORD - 1) /
+                     LIBSITU_COMPACT_STATES_PER_WORD);
+    reserve_events();
+  }
+
+  void CompactTable::reserve_events()
+  {
+    const size_t events =
+      std::min<size_t>(m_records.capacity(), LIBSITU_COMPACT_EVENTS);
+    if (m_events.capacity() < events) {
+      m_events.reserve(events);
+    }
+  }
+
+  unsigned CompactTable::state_of(uint32_t index) const
+  {
+    const unsigned shift = (index % LIBSITU_COMPACT_STATES_PER_WORD) *
+      LIBSITU_COMPACT_STATE_BITS;
+    return (m_states[index / LIBSITU_COMPACT_STATES_PER_WORD] >> shift) & 3;
+  }
+
+  void CompactTable::set_state(uint32_t index, unsigned state)
+  {
+    const unsigned shift = (index % LIBSITU_COMPACT_STATES_PER_WORD) *
+      LIBSITU_COMPACT_STATE_BITS;
+    uint64_t &word = m_states[index / LIBSITU_COMPACT_STATES_PER_WORD];
+    word = (word & ~(static_cast<uint64_t>(3) << shift)) |
+      (static_cast<uint64_t>(state) << shift);
+  }
+
+  const WatchEvent* CompactTable::handle_fix(const Fix &fix,
+                                             const Math::Here &here,
+                                             double &clearance,
+                                             size_t &count)
+  {
+    m_events.clear();
+    count = 0;
+    if (!here.fixed.valid || m_records.empty()) {
+      return NULL;
+    }
+
+    Math::FixedScale scale;
+    Math::fixed_scale_init(scale, here.fixed);
+
+    /* N.B. A word of states at a time; a word is written back only if a
+     * state in it changes */
+    const uint32_t size = m_records.size();
+    for (uint32_t base = 0; base < size;
+         base += LIBSITU_COMPACT_STATES_PER_WORD) {
+      const uint64_t states = m_states[base / LIBSITU_COMPACT_STATES_PER_WORD];
+      uint64_t next_states = states;
+      const uint32_t end = std::min(size, base +
+                                    LIBSITU_COMPACT_STATES_PER_WORD);
+      for (uint32_t index = base; index < end; ++index) {
+        const unsigned shift = (index - base) * LIBSITU_COMPACT_STATE_BITS;
+        const unsigned state = (states >> shift) & 3;
+        if (LIBSITU_COMPACT_SLOT_FREE == state) {
+          continue;
+        }
+
+        const Record &record = m_records[index];
+        const int32_t rad_cm = static_cast<int32_t>(record.rad) * 100;
+        int64_t distance_sq = 0;
+        int64_t bound_cm = 0;
+        const Math::State found =
+          Math::fixed_classify(here.fixed, scale, record.lat, record.lon,
+                               rad_cm, distance_sq, bound_cm);
+
+        /* N.B. Beyond the box, only a lower bound on the distance is
+         * known, which is enough for the poll schedule */
+        double distance = NAN;
+        if (0 != clearance) {
+          distance = distance_sq < 0 ? bound_cm / 100.0 :
+            sqrt(static_cast<double>(distance_sq)) / 100;
+          clearance = std::min(clearance, fabs(distance - record.rad));
+        }
+
+        if (Math::STATE_UNKNOWN == found ||
+            static_cast<unsigned>(found) == state) {
+          continue;
+        }
+        next_states = (next_states & ~(static_cast<uint64_t>(3) << shift)) |
+          (static_cast<uint64_t>(found) << shift);
+
+        /* N.B. As for Watch::handle_fix(), without debouncing */
+        Event event = EVENT_NONE;
+        if (Math::STATE_NEAR == found) {
+          event = EVENT_ARRIVE;
+        } else if (Math::STATE_NEAR == state) {
+          event = EVENT_DEPART;
+        }
+        if (EVENT_NONE != event) {
+          const Callback &callback = m_callbacks[record.callback];
+          if (0 == clearance) {
+            distance = distance_sq < 0 ? bound_cm / 100.0 :
+              sqrt(static_cast<double>(distance_sq)) / 100;
+          }
+          WatchEvent watch_event;
+          watch_event.id = WATCH_COMPACT | index;
+          watch_event.event = event;
+          watch_event.distance = distance;
+          watch_event.time = fix.time;
+          watch_event.latitude = fix.latitude;
+          watch_event.longitude = fix.longitude;
+          watch_event.name = NULL;
+          watch_event.alarm = NULL;
+          watch_event.handler = callback.handler;
+          watch_event.data = callback.data;
+          m_events.push_back(watch_event);
+        }
+      }
+      if (next_states != states) {
+        m_states[base / LIBSITU_COMPACT_STATES_PER_WORD] = next_states;
+      }
+    }
+
+    count = m_events.size();
+    return m_events.empty() ? NULL : &m_events[0];
+  }
+
+}
@@ -0,0 +1,103 @@
+/*
+  Copyright 2013-2014 Simon Dawson
+
+  This file is part of libsitu.
+
+  libsitu is free software: you can redistribute it and/or modify
+  it under the terms of the GNU Lesser General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  libsitu is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU Lesser General Public License for more details.
+
+  You should have received a copy of the GNU Lesser General Public License
+  along with libsitu.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+
+#ifndef _LIBSITU_GPSCOMPACT_H_
+#define _LIBSITU_GPSCOMPACT_H_
+
+#include <stdint.h>
+
+#include <map>
+#include <utility>
+#include <vector>
+
+/* N.B. for definitions of WatchEvent, WatchHandler and WatchId */
+#include <libsitu.h>
+
+/* N.B. for definition of Here */
+#include <gpsmath.h>
+
+namespace libsitu {
+
+  /* A set of compact watches, addressed by WatchId
+   *
+   * Each watch is a 12-byte record: its centre in 1e-7 degree units, its
+   * radius in whole meters, and the index of its callback and data in a
+   * shared table; its state is two bits of a separate bitmap. The slot
+   * index of an identifier is the position of the record, which never
+   * moves, so there is no slot table; a removed watch leaves a hole,
+   * marked in the bitmap, and reused by the next watch added.
+   *
+   * Every watch is evaluated for each fix, in record order, with integer
+   * arithmetic only; see Math::fixed_classify().
+   */
+  class CompactTable {
+  public:
+    CompactTable();
+    ~CompactTable();
+
+    WatchId add(double lat, double lon, double rad, WatchHandler handler,
+                void *data);
+    bool remove(WatchId id);
+    size_t size() const;
+    void reserve(size_t count);
+
+    /* N.B. The events are valid until the next call. The clearance is
+     * lowered to the least distance of the fix from a watch boundary; see
+     * Watch::handle_fix() */
+    const WatchEvent* handle_fix(const Fix &fix, const Math::Here &here,
+                                 double &clearance, size_t &count);
+
+  private:
+    CompactTable(const CompactTable&);
+    CompactTable& operator=(const CompactTable&);
+
+    struct Record {
+      int32_t lat;
+      int32_t lon;
+      uint16_t rad;
+      uint16_t callback;
+    };
+
+    struct Callback {
+      WatchHandler handler;
+      void *data;
+    };
+
+    /* Position of each callback and data in m_callbacks */
+    typedef std::map<std::pair<WatchHandler,void*>,uint16_t> CallbackMap;
+
+    /* N.B. Math::State, or SLOT_FREE for a hole */
+    unsigned state_of(uint32_t index) const;
+    void set_state(uint32_t index, unsigned state);
+    void reserve_events();
+
+    std::vector<Record> m_records;
+    /* N.B. Two bits per record, 32 records per word */
+    std::vector<uint64_t> m_states;
+    std::vector<Callback> m_callbacks;
+    CallbackMap m_callback_index;
+    std::vector<uint32_t> m_free;
+    std::vector<WatchEvent> m_events;
+    size_t m_count;
+  };
+
+}
+
+#endif
@@ -0,0 +1,582 @@
+/*
+  Copyright 2013-2014 Simon Dawson
+
+  This file is part of libsitu.
+
+  libsitu is free software: you can redistribute it and/or modify
+  it under the terms of the GNU Lesser General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  libsitu is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU Lesser General Public License for more details.
+
+  You should have received a copy of the GNU Lesser General Public License
+  along with libsitu.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <math.h>
+#include <string.h>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <algorithm>
+
+#include <gpsdb.h>
+#include <gpsdebug.h>
+#include <gpsindex.h>
+#include <gpsstate.h>
+
+#define LIBSITU_DATABASE_FORMAT 1
+#define LIBSITU_DATABASE_BYTE_ORDER 0x01020304u
+
+/*
+ * Watches further than this beyond their reach (their radius, plus the
+ * error radius of the fix) are not evaluated; so this is also the least
+ * clearance that a fix has from any watch that is not
+ */
+#define LIBSITU_DATABASE_MARGIN_m 500.0
+
+/* The number of watches within reach of a fix, and so NEAR, or raising
+ * an event, for which space is reserved when a database is opened, so
+ * that fixes do not allocate; the whole database, if it is smaller
+ */
+#define LIBSITU_DATABASE_WORKING_SET 4096
+
+namespace libsitu {
+
+  namespace {
+
+    const char magic[8] = { 's', 'i', 't', 'u', 'd', 'b', '\0', '\0' };
+
+  }
+
+  struct Database::Header {
+    char magic[8];
+    uint32_t format;
+    uint32_t byte_order;
+    uint64_t version;
+    uint32_t watch_count;
+    uint32_t strings_size;
+    double max_rad;
+  };
+
+  struct Database::Record {
+    double v[3]; /* Unit vector of the centre */
+    double lat;
+    double lon;
+    double rad;
+    /* Local tangent plane terms, or zero where the plane is not accurate
+     * enough for the watch radius */
+    double kx;
+    double ky;
+    double subtree_rad; /* Largest radius in the subtree rooted here */
+    uint32_t axis; /* Split axis of the subtree rooted here */
+    uint32_t name; /* String offset */
+  };
+
+  namespace {
+
+    /* N.B. Ordering of record indices by name, for the name table */
+    struct ByName {
+      const char *strings;
+      const uint32_t *names;
+      bool operator()(uint32_t a, uint32_t b) const
+      {
+        return strcmp(strings + names[a], strings + names[b]) < 0;
+      }
+    };
+
+    template <typename Record>
+    double set_subtree_rad(Record *records, size_t lo, size_t hi)
+    {
+      if (lo >= hi) {
+        return 0;
+      }
+      const size_t mid = lo + (hi - lo) / 2;
+      records[mid].subtree_rad = std::max(
+        records[mid].rad,
+        std::max(set_subtree_rad(records, lo, mid),
+                 set_subtree_rad(records, mid + 1, hi)));
+      return records[mid].subtree_rad;
+    }
+
+    void append(std::vector<char> &buffer, const void *data, size_t size)
+    {
+      const char *bytes = static_cast<const char*>(data);
+      buffer.insert(buffer.end(), bytes, bytes + size);
+    }
+
+  }
+
+  Database::Source::Source()
+    : name(), lat(0), lon(0), rad(0)
+  {
+  }
+
+  Database::Source::Source(const Source &original)
+    : name(original.name),
+      lat(original.lat),
+      lon(original.lon),
+      rad(original.rad)
+  {
+  }
+
+  Database::Source& Database::Source::operator=(const Source &rhs)
+  {
+    if (this != &rhs) {
+      name = rhs.name;
+      lat = rhs.lat;
+      lon = rhs.lon;
+      rad = rhs.rad;
+    }
+
+    return *this;
+  }
+
+  bool Database::compile(const char *path, uint64_t version,
+                         const std::vector<Source> &sources)
+  {
+    const size_t count = sources.size();
+    /* N.B. Identifiers of database watches have a record index */
+    if (count >= WATCH_INDEX_MASK) {
+      LIBSITU_WARN("Too many watches: %lu\n",
+                   static_cast<unsigned long>(count));
+      return false;
+    }
+
+    std::vector<Record> records(count);
+    double max_rad = 0;
+    for (size_t i = 0; i < count; ++i) {
+      const Source &source = sources[i];
+      if (!(source.lat >= -90 && source.lat <= 90 &&
+            source.lon >= -180 && source.lon <= 180 &&
+            source.rad > 0 && Math::is_finite(source.rad))) {
+        LIBSITU_WARN("Watch \"%s\" invalid\n", source.name.c_str());
+        return false;
+      }
+
+      Record &record = records[i];
+      memset(&record, 0, sizeof(record));
+      Math::unit_vector(source.lat, source.lon, record.v);
+      record.lat = source.lat;
+      record.lon = source.lon;
+      record.rad = source.rad;
+      Math::Plane plane;
+      if (Math::plane_init(plane, source.lat, source.lon, source.rad)) {
+        record.kx = plane.kx;
+        record.ky = plane.ky;
+      }
+      /* N.B. The source index, until the tree is built */
+      record.name = static_cast<uint32_t>(i);
+      max_rad = std::max(max_rad, source.rad);
+    }
+
+    if (0 != count) {
+      KdTree::build(&records[0], 0, count);
+      set_subtree_rad(&records[0], 0, count);
+    }
+
+    std::vector<char> strings;
+    std::vector<uint32_t> names(count);
+    for (size_t i = 0; i < count; ++i) {
+      const std::string &name = sources[records[i].name].name;
+      records[i].name = names[i] = static_cast<uint32_t>(strings.size());
+      strings.insert(strings.end(), name.begin(), name.end());
+      strings.push_back('\0');
+    }
+
+    std::vector<uint32_t> by_name(count);
+    for (size_t i = 0; i < count; ++i) {
+      by_name[i] = static_cast<uint32_t>(i);
+    }
+    if (0 != count) {
+      ByName order = { &strings[0], &names[0] };
+      std::sort(by_name.begin(), by_name.end(), order);
+      for (size_t i = 1; i < count; ++i) {
+        if (!order(by_name[i - 1], by_name[i])) {
+          LIBSITU_WARN("Duplicate watch name \"%s\"\n",
+                       &strings[names[by_name[i]]]);
+          return false;
+        }
+      }
+    }
+
+    Header header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, magic, sizeof(magic));
+    header.format = LIBSITU_DATABASE_FORMAT;
+    header.byte_order = LIBSITU_DATABASE_BYTE_ORDER;
+    header.version = version;
+    header.watch_count = static_cast<uint32_t>(count);
+    header.strings_size = static_cast<uint32_t>(strings.size());
+    header.max_rad = max_rad;
+
+    std::vector<char> buffer;
+    buffer.reserve(sizeof(header) + count * sizeof(Record) +
+                   count * sizeof(uint32_t) + strings.size());
+    append(buffer, &header, sizeof(header));
+    if (0 != count) {
+      append(buffer, &records[0], count * sizeof(Record));
+      append(buffer, &by_name[0], count * sizeof(uint32_t));
+      append(buffer, &strings[0], strings.size());
+    }
+
+    /* N.B. Replaced atomically, so that a process opening the database
+     * never sees it partly written */
+    return Snapshot::write(path, buffer);
+  }
+
+  Database::Database()
+    : m_data(NULL),
+      m_size(0),
+      m_header(NULL),
+      m_by_name(NULL),
+      m_strings(NULL),
+      m_distance(Math::distance_function(PRECISION_DOUBLE)),
+      m_alarm(NULL),
+      m_handler(NULL),
+      m_callback_data(NULL),
+      m_near(),
+      m_next_near(),
+      m_found(),
+      m_events()
+  {
+  }
+
+  Database::~Database()
+  {
+    close();
+  }
+
+  bool Database::open(const char *path)
+  /* N.B. The header is checked, and every index held by the records and
+   * the name table, so that a corrupt file is rejected here rather than
+   * read out of bounds by a search */
+  {
+    close();
+
+    const int fd = ::open(path, O_RDONLY);
+    if (-1 == fd) {
+      LIBSITU_WARN("Failed to open %s: %s\n", path, strerror(errno));
+      return false;
+    }
+    struct stat status;
+    if (0 != fstat(fd, &status)) {
+      LIBSITU_WARN("Failed to stat %s: %s\n", path, strerror(errno));
+      ::close(fd);
+      return false;
+    }
+    const size_t size = status.st_size;
+    if (size < sizeof(Header)) {
+      LIBSITU_WARN("Database %s truncated\n", path);
+      ::close(fd);
+      return false;
+    }
+
+    void *data = mmap(NULL, size, PROT_READ, MAP_SHARED, fd, 0);
+    ::close(fd);
+    if (MAP_FAILED == data) {
+      LIBSITU_WARN("Failed to map %s: %s\n", path, strerror(errno));
+      return false;
+    }
+    /* N.B. The tree is searched at random, so read ahead is wasted */
+    if (0 != madvise(data, size, MADV_RANDOM)) {
+      LIBSITU_DBG("Failed to advise on %s: %s\n", path, strerror(errno));
+    }
+    m_data = static_cast<const char*>(data);
+    m_size = size;
+
+    const Header &header = *reinterpret_cast<const Header*>(m_data);
+    const uint64_t records_size =
+      static_cast<uint64_t>(header.watch_count) * sizeof(Record);
+    const uint64_t names_size =
+      static_cast<uint64_t>(header.watch_count) * sizeof(uint32_t);
+    const char *strings = m_data + sizeof(Header) + records_size +
+      names_size;
+    if (0 != memcmp(header.magic, magic, sizeof(magic)) ||
+        LIBSITU_DATABASE_FORMAT != header.format ||
+        LIBSITU_DATABASE_BYTE_ORDER != header.byte_order) {
+      LIBSITU_WARN("%s is not a database of this format and byte order\n",
+                   path);
+    } else if (header.watch_count >= WATCH_INDEX_MASK ||
+               sizeof(Header) + records_size + names_size +
+               header.strings_size != size) {
+      LIBSITU_WARN("Database %s size mismatch\n", path);
+    } else if (0 != header.strings_size &&
+               '\0' != strings[header.strings_size - 1]) {
+      LIBSITU_WARN("Database %s strings unterminated\n", path);
+    } else if (!check_records(header)) {
+      LIBSITU_WARN("Database %s has records out of range\n", path);
+    } else {
+      m_header = &header;
+      m_by_name = reinterpret_cast<const uint32_t*>(
+        m_data + sizeof(Header) + records_size);
+      m_strings = strings;
+
+      /* N.B. The events of a fix are at most the watches found, and
+       * those NEAR before */
+      const size_t working_set =
+        std::min<size_t>(header.watch_count, LIBSITU_DATABASE_WORKING_SET);
+      m_near.reserve(working_set);
+      m_next_near.reserve(working_set);
+      m_found.reserve(working_set);
+      m_events.reserve(2 * working_set);
+      LIBSITU_DBG("Opened database %s, version %llu, with %u watches\n",
+                  path, static_cast<unsigned long long>(header.version),
+                  header.watch_count);
+      return true;
+    }
+
+    close();
+    return false;
+  }
+
+  void Database::close()
+  {
+    if (NULL != m_data) {
+      if (0 != munmap(const_cast<char*>(m_data), m_size)) {
+        LIBSITU_WARN("Failed to unmap database: %s\n", strerror(errno));
+      }
+    }
+    m_data = NULL;
+    m_size = 0;
+    m_header = NULL;
+    m_by_name = NULL;
+    m_strings = NULL;
+    m_near.clear();
+  }
+
+  bool Database::is_open() const
+  {
+    return NULL != m_header;
+  }
+
+  uint64_t Database::version() const
+  {
+    return NULL == m_header ? 0 : m_header->version;
+  }
+
+  size_t Database::size() const
+  {
+    return NULL == m_header ? 0 : m_header->watch_count;
+  }
+
+  WatchId Database::find(const char *name) const
+  {
+    if (NULL == m_header || NULL == name) {
+      return WATCH_ID_INVALID;
+    }
+
+    /* N.B. Binary search of the name table */
+    size_t lo = 0;
+    size_t hi = m_header->watch_count;
+    while (lo < hi) {
+      const size_t mid = lo + (hi - lo) / 2;
+      const uint32_t index = m_by_name[mid];
+      const char *mid_name = name_of(index);
+      if (NULL == mid_name) {
+        return WATCH_ID_INVALID;
+      }
+      const int order = strcmp(mid_name, name);
+      if (0 == order) {
+        return WATCH_DATABASE | index;
+      } else if (order < 0) {
+        lo = mid + 1;
+      } else {
+        hi = mid;
+      }
+    }
+    return WATCH_ID_INVALID;
+  }
+
+  void Database::set_callbacks(WatchAlarm alarm, WatchHandler handler,
+                               void *data)
+  {
+    m_alarm = alarm;
+    m_handler = handler;
+    m_callback_data = data;
+  }
+
+  const Database::Record* Database::records() const
+  {
+    return reinterpret_cast<const Record*>(m_data + sizeof(Header));
+  }
+
+  bool Database::check_records(const Header &header) const
+  /* Check the split axis and name of each record, and each entry of the
+   * name table, against the bounds given by the header */
+  {
+    const Record *nodes = records();
+    const uint32_t *by_name = reinterpret_cast<const uint32_t*>(
+      nodes + header.watch_count);
+    for (uint32_t i = 0; i < header.watch_count; ++i) {
+      /* N.B. The axis indexes a unit vector, of three components */
+      if (nodes[i].axis > 2 || nodes[i].name >= header.strings_size ||
+          by_name[i] >= header.watch_count) {
+        return false;
+      }
+    }
+    return true;
+  }
+
+  const char* Database::name_of(uint32_t index) const
+  {
+    if (index >= m_header->watch_count) {
+      return NULL;
+    }
+    const uint32_t offset = records()[index].name;
+    return offset < m_header->strings_size ? m_strings + offset : NULL;
+  }
+
+  Math::State Database::evaluate(const Fix &fix, const Math::Here &here,
+                                 uint32_t index, double &distance) const
+  {
+    const Record &record = records()[index];
+    Math::State state = Math::STATE_UNKNOWN;
+    if (record.kx > 0) {
+      const Math::Plane plane = { record.lat, record.lon,
+                                  record.kx, record.ky };
+      double distance_sq = 0;
+      state = Math::plane_classify(fix, here, plane, record.rad,
+                                   distance_sq);
+      distance = sqrt(distance_sq);
+    } else {
+      distance = fabs((*m_distance)(fix, record.lat, record.lon,
+                                    record.rad, state));
+    }
+    return state;
+  }
+
+  void Database::raise(const Fix &fix, uint32_t index, Event event,
+                       double distance)
+  {
+    WatchEvent watch_event;
+    watch_event.id = WATCH_DATABASE | index;
+    watch_event.event = event;
+    watch_event.distance = distance;
+    watch_event.time = fix.time;
+    watch_event.latitude = fix.latitude;
+    watch_event.longitude = fix.longitude;
+    watch_event.name = name_of(index);
+    watch_event.alarm = m_alarm;
+    watch_event.handler = m_handler;
+    watch_event.data = m_callback_data;
+    m_events.push_back(watch_event);
+  }
+
+  void Database::search(size_t lo, size_t hi, const double q[3],
+                        double reach)
+  /* As KdTree::within(), but bounding each subtree by the reach of its
+   * largest watch, so that a few large watches do not widen the search
+   * for all of the others */
+  {
+    const Record *nodes = records();
+    while (lo < hi) {
+      const size_t mid = lo + (hi - lo) / 2;
+      const Record &node = nodes[mid];
+
+      const double node_chord = Math::distance_to_chord(node.rad + reach);
+      if (KdTree::chord_sq(q, node.v) <= node_chord * node_chord) {
+        m_found.push_back(static_cast<uint32_t>(mid));
+      }
+
+      const double chord = Math::distance_to_chord(node.subtree_rad + reach);
+      const double diff = q[node.axis] - node.v[node.axis];
+      if (diff * diff > chord * chord) {
+        if (diff < 0) {
+          hi = mid;
+        } else {
+          lo = mid + 1;
+        }
+      } else {
+        search(lo, mid, q, reach);
+        lo = mid + 1;
+      }
+    }
+  }
+
+  const WatchEvent* Database::handle_fix(const Fix &fix,
+                                         const Math::Here &here,
+                                         double &clearance, size_t &count)
+  {
+    m_events.clear();
+    count = 0;
+    if (NULL == m_header || 0 == m_header->watch_count) {
+      return NULL;
+    }
+    if (!here.fixed.valid) {
+      /* N.B. Without a position and an error radius, nothing is known of
+       * any watch */
+      clearance = 0;
+      return NULL;
+    }
+
+    /* Find the watches within reach of the fix; no other can be NEAR,
+     * and every other is at least the reach clear of its boundary */
+    const double reach = here.err + LIBSITU_DATABASE_MARGIN_m;
+    double q[3];
+    Math::unit_vector(fix.latitude, fix.longitude, q);
+    m_found.clear();
+    search(0, m_header->watch_count, q, reach);
+    std::sort(m_found.begin(), m_found.end());
+    if (reach < clearance) {
+      clearance = reach;
+    }
+
+    /* N.B. Merge the watches found with those NEAR before, in record
+     * order; a watch NEAR before, but now out of reach, departs */
+    m_next_near.clear();
+    std::vector<uint32_t>::const_iterator near = m_near.begin();
+    for (std::vector<uint32_t>::const_iterator found = m_found.begin();
+         found != m_found.end(); ++found) {
+      for (; near != m_near.end() && *near < *found; ++near) {
+        double distance = NAN;
+        evaluate(fix, here, *near, distance);
+        raise(fix, *near, EVENT_DEPART, distance);
+      }
+      const bool was_near = near != m_near.end() && *near == *found;
+      if (was_near) {
+        ++near;
+      }
+
+      double distance = NAN;
+      const Math::State state = evaluate(fix, here, *found, distance);
+      const double boundary = fabs(distance - records()[*found].rad);
+      if (boundary < clearance) {
+        clearance = boundary;
+      }
+
+      /* N.B. As Watch::handle_fix(), without debouncing: a fix in the
+       * error zone leaves the state unchanged */
+      if (Math::STATE_NEAR == state) {
+        if (!was_near) {
+          raise(fix, *found, EVENT_ARRIVE, distance);
+        }
+        m_next_near.push_back(*found);
+      } else if (Math::STATE_FAR == state) {
+        if (was_near) {
+          raise(fix, *found, EVENT_DEPART, distance);
+        }
+      } else if (was_near) {
+        m_next_near.push_back(*found);
+      }
+    }
+    for (; near != m_near.end(); ++near) {
+      double distance = NAN;
+      evaluate(fix, here, *near, distance);
+      raise(fix, *near, EVENT_DEPART, distance);
+    }
+    m_near.swap(m_next_near);
+
+    count = m_events.size();
+    return m_events.empty() ? NULL : &m_events[0];
+  }
+
+}
@@ -0,0 +1,119 @@
+/*
+  Copyright 2013-2014 Simon Dawson
+
+  This file is part of libsitu.
+
+  libsitu is free software: you can redistribute it and/or modify
+  it under the terms of the GNU Lesser General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  libsitu is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU Lesser General Public License for more details.
+
+  You should have received a copy of the GNU Lesser General Public License
+  along with libsitu.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef _LIBSITU_GPSDB_H_
+#define _LIBSITU_GPSDB_H_
+
+#include <string>
+#include <vector>
+
+/* N.B. for definitions of WatchAlarm, WatchHandler and WatchId */
+#include <libsitu.h>
+
+/* N.B. for definition of Here */
+#include <gpsmath.h>
+
+namespace libsitu {
+
+  /* A compiled watch database
+   *
+   * An immutable file, compiled offline (see utils/situdb), and mapped
+   * read-only and shared, so that every process using it shares one copy
+   * in the page cache. A header, then a fixed-size record per watch, with
+   * its geometry precomputed, in implicit KD-tree order (see KdTree);
+   * then the record indices in name order; then the names, as
+   * NUL-terminated strings. All fields are in host byte order, and
+   * aligned, so that the file is used in place: opening it copies
+   * nothing, but checks the indices held by each record and by the name
+   * table, so that a corrupt file is rejected.
+   *
+   * The only per-process state is the set of watches that the receiver
+   * is near; every other watch is FAR. On each fix, only the watches
+   * within reach of it are evaluated, found via the tree, each subtree of
+   * which records the largest watch radius within it.
+   */
+  class Database {
+  public:
+    /* A watch, as read from a source file by the compiler */
+    struct Source {
+      Source();
+      Source(const Source &original);
+      Source& operator=(const Source &rhs);
+      std::string name;
+      double lat;
+      double lon;
+      double rad;
+    };
+
+    static bool compile(const char *path, uint64_t version,
+                        const std::vector<Source> &sources);
+
+    Database();
+    ~Database();
+
+    bool open(const char *path);
+    void close();
+    bool is_open() const;
+    /* N.B. The version given to the compiler */
+    uint64_t version() const;
+    size_t size() const;
+    WatchId find(const char *name) const;
+    void set_callbacks(WatchAlarm alarm, WatchHandler handler, void *data);
+
+    /* N.B. The events are valid until the next call. The clearance is
+     * lowered to the least distance of the fix from a watch boundary; see
+     * Watch::handle_fix() */
+    const WatchEvent* handle_fix(const Fix &fix, const Math::Here &here,
+                                 double &clearance, size_t &count);
+
+  private:
+    Database(const Database&);
+    Database& operator=(const Database&);
+
+    struct Header;
+    struct Record;
+
+    const Record* records() const;
+    bool check_records(const Header &header) const;
+    const char* name_of(uint32_t index) const;
+    void search(size_t lo, size_t hi, const double q[3], double reach);
+    Math::State evaluate(const Fix &fix, const Math::Here &here,
+                         uint32_t index, double &distance) const;
+    void raise(const Fix &fix, uint32_t index, Event event,
+               double distance);
+
+    const char *m_data;
+    size_t m_size;
+    const Header *m_header;
+    const uint32_t *m_by_name;
+    const char *m_strings;
+    Math::DistanceFunction m_distance;
+    WatchAlarm m_alarm;
+    WatchHandler m_handler;
+    void *m_callback_data;
+    /* N.B. Record indices, ascending, of the watches found NEAR */
+    std::vector<uint32_t> m_near;
+    std::vector<uint32_t> m_next_near;
+    std::vector<uint32_t> m_found;
+    std::vector<WatchEvent> m_events;
+  };
+
+}
+
+#endif
@@ -20,12 +20,12 @@
 #ifndef _LIBSITU_GPSDEBUG_H_
 #define _LIBSITU_GPSDEBUG_H_
 
-#include <stdio.h>
+#include <gpslog.h>
 
 /* #define DEBUG */
 #ifdef DEBUG
 /*#  define LIBSITU_DBG_VERBOSE */
-#  define LIBSITU_DBG(...) fprintf(stdout, "DEBUG: " __VA_ARGS__)
+#  define LIBSITU_DBG(...) LIBSITU_LOG(libsitu::LOG_LEVEL_DEBUG, __VA_ARGS__)
 #  ifdef LIBSITU_DBG_VERBOSE
 #    define LIBSITU_DBGV(...) LIBSITU_DBG(__VA_ARGS__)
 #  else /* LIBSITU_DBG_VERBOSE */
@@ -36,6 +36,6 @@
 #  define LIBSITU_DBGV(...)
 #endif /* DEBUG */
 
-#define LIBSITU_WARN(...) fprintf(stderr, "WARNING: " __VA_ARGS__)
+#define LIBSITU_WARN(...) LIBSITU_LOG(libsitu::LOG_LEVEL_WARN, __VA_ARGS__)
 
 #endif
@@ -0,0 +1,212 @@
+/*
+  Copyright 2013-2014 Simon Dawson
+
+  This file is part of libsitu.
+
+  libsitu is free software: you can redistribute it and/or modify
+  it under the terms of the GNU Lesser General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  libsitu is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU Lesser General Public License for more details.
+
+  You should have received a copy of the GNU Lesser General Public License
+  along with libsitu.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <math.h>
+
+#include <algorithm>
+
+#include <gpsdebug.h>
+#include <gpsindex.h>
+#include <gpsmath.h>
+#include <gpswatch.h>
+
+/* Watches copied per hold of the watch lock, when loading the index */
+#define LIBSITU_INDEX_LOAD_CHUNK 4096
+
+namespace libsitu {
+
+  bool WatchIndex::Candidate::operator<(const Candidate &rhs) const
+  {
+    return chord_sq < rhs.chord_sq;
+  }
+
+  WatchIndex::WatchIndex()
+    : m_positions(),
+      m_nodes(),
+      m_found(),
+      m_loaded(false),
+      m_version(0)
+  {
+  }
+
+  WatchIndex::~WatchIndex()
+  {
+  }
+
+  bool WatchIndex::is_current(const WatchTable &watches) const
+  {
+    return m_loaded && m_version == watches.version();
+  }
+
+  void WatchIndex::reserve(size_t count)
+  {
+    /* N.B. Resized rather than reserved, so that the pages are touched
+     * now, rather than faulted in by load() */
+    if (m_positions.size() < count) {
+      m_positions.resize(count);
+    }
+  }
+
+  bool WatchIndex::load(const WatchTable &watches, size_t &loaded)
+  {
+    const size_t count = watches.size();
+    if (0 == loaded) {
+      m_loaded = false;
+      m_version = watches.version();
+    } else if (m_version != watches.version()) {
+      /* N.B. Watches have moved since the last chunk: start again */
+      loaded = 0;
+      m_version = watches.version();
+    }
+    if (count > m_positions.size()) {
+      loaded = 0;
+      return false;
+    }
+
+    const size_t end = std::min(count, loaded + LIBSITU_INDEX_LOAD_CHUNK);
+    for (size_t i = loaded; i < end; ++i) {
+      const Watch &watch = watches.watch_at(i);
+      Position &position = m_positions[i];
+      position.lat = watch.get_lat();
+      position.lon = watch.get_lon();
+      position.id = watches.id_at(i);
+    }
+    loaded = end;
+    if (loaded < count) {
+      return false;
+    }
+
+    m_positions.resize(count);
+    m_loaded = true;
+    return true;
+  }
+
+  void WatchIndex::build()
+  {
+    const size_t count = m_positions.size();
+    m_nodes.resize(count);
+    for (size_t i = 0; i < count; ++i) {
+      Math::unit_vector(m_positions[i].lat, m_positions[i].lon,
+                        m_nodes[i].v);
+      m_nodes[i].id = m_positions[i].id;
+      m_nodes[i].axis = 0;
+    }
+    if (!m_nodes.empty()) {
+      KdTree::build(&m_nodes[0], 0, m_nodes.size());
+    }
+  }
+
+  void WatchIndex::search_nearest(size_t lo, size_t hi, const double q[3],
+                                  size_t k)
+  /* Maintain the k nearest candidates so far as a max-heap */
+  {
+    while (lo < hi) {
+      const size_t mid = lo + (hi - lo) / 2;
+      const Node &node = m_nodes[mid];
+
+      const Candidate candidate = { KdTree::chord_sq(q, node.v),
+                                    node.id };
+      if (m_found.size() < k) {
+        m_found.push_back(candidate);
+        std::push_heap(m_found.begin(), m_found.end());
+      } else if (candidate < m_found.front()) {
+        std::pop_heap(m_found.begin(), m_found.end());
+        m_found.back() = candidate;
+        std::push_heap(m_found.begin(), m_found.end());
+      }
+
+      /* Search the side of the split containing the query point first;
+       * then the other side, only if it could hold a nearer watch */
+      const double diff = q[node.axis] - node.v[node.axis];
+      if (diff < 0) {
+        search_nearest(lo, mid, q, k);
+        lo = mid + 1;
+      } else {
+        search_nearest(mid + 1, hi, q, k);
+        hi = mid;
+      }
+      if (m_found.size() >= k && diff * diff >= m_found.front().chord_sq) {
+        break;
+      }
+    }
+  }
+
+  struct WatchIndex::Collect {
+    const std::vector<Node> *nodes;
+    std::vector<Candidate> *found;
+    void operator()(size_t index, double node_chord_sq)
+    {
+      const Candidate candidate = { node_chord_sq, (*nodes)[index].id };
+      found->push_back(candidate);
+    }
+  };
+
+  size_t WatchIndex::copy_out(WatchDistance *out, size_t max) const
+  {
+    const size_t count = std::min(max, m_found.size());
+    for (size_t i = 0; i < count; ++i) {
+      out[i].id = m_found[i].id;
+      out[i].distance = Math::chord_to_distance(sqrt(m_found[i].chord_sq));
+    }
+    return count;
+  }
+
+  size_t WatchIndex::nearest(double lat, double lon, size_t k,
+                             WatchDistance *out)
+  {
+    m_found.clear();
+    if (0 == k || NULL == out) {
+      return 0;
+    }
+
+    double q[3];
+    Math::unit_vector(lat, lon, q);
+    search_nearest(0, m_nodes.size(), q, k);
+    std::sort_heap(m_found.begin(), m_found.end());
+    return copy_out(out, k);
+  }
+
+  size_t WatchIndex::within(double lat, double lon, double radius,
+                            WatchDistance *out, size_t max)
+  {
+    m_found.clear();
+    if (!(radius >= 0)) {
+      return 0;
+    }
+
+    double q[3];
+    Math::unit_vector(lat, lon, q);
+    const double chord = Math::distance_to_chord(radius);
+    if (!m_nodes.empty()) {
+      Collect collect = { &m_nodes, &m_found };
+      KdTree::within(&m_nodes[0], 0, m_nodes.size(), q, chord * chord,
+                     collect);
+    }
+
+    /* N.B. Only the nearest matches need be in order */
+    const size_t count = std::min(max, m_found.size());
+    std::partial_sort(m_found.begin(), m_found.begin() + count,
+                      m_found.end());
+    if (NULL != out) {
+      copy_out(out, count);
+    }
+    return m_found.size();
+  }
+
+}
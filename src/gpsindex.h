@@ -0,0 +1,193 @@
+/*
+  Copyright 2013-2014 Simon Dawson
+
+  This file is part of libsitu.
+
+  libsitu is free software: you can redistribute it and/or modify
+  it under the terms of the GNU Lesser General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  libsitu is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU Lesser General Public License for more details.
+
+  You should have received a copy of the GNU Lesser General Public License
+  along with libsitu.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef _LIBSITU_GPSINDEX_H_
+#define _LIBSITU_GPSINDEX_H_
+
+#include <math.h>
+
+#include <algorithm>
+#include <vector>
+
+/* N.B. for definitions of WatchDistance and WatchId */
+#include <libsitu.h>
+
+namespace libsitu {
+
+  class WatchTable;
+
+  /* Implicit KD-tree construction and radius search, over an array of any
+   * node type with a unit vector member v and a split axis member axis
+   *
+   * The median of each subtree, split on its widest axis, is at the
+   * middle of its range of the node array, so the tree needs no links,
+   * and may equally be built in memory or written out to a file.
+   */
+  namespace KdTree {
+
+    inline double chord_sq(const double a[3], const double b[3])
+    {
+      const double dx = a[0] - b[0];
+      const double dy = a[1] - b[1];
+      const double dz = a[2] - b[2];
+      return dx * dx + dy * dy + dz * dz;
+    }
+
+    template <typename Node>
+    struct ByAxis {
+      unsigned axis;
+      bool operator()(const Node &a, const Node &b) const
+      {
+        return a.v[axis] < b.v[axis];
+      }
+    };
+
+    template <typename Node>
+    void build(Node *nodes, size_t lo, size_t hi)
+    {
+      /* N.B. Recursion depth is logarithmic in the number of nodes */
+      while (hi - lo > 1) {
+        double min[3] = { INFINITY, INFINITY, INFINITY };
+        double max[3] = { -INFINITY, -INFINITY, -INFINITY };
+        for (size_t i = lo; i < hi; ++i) {
+          for (unsigned a = 0; a < 3; ++a) {
+            min[a] = std::min(min[a], nodes[i].v[a]);
+            max[a] = std::max(max[a], nodes[i].v[a]);
+          }
+        }
+        ByAxis<Node> by_axis;
+        by_axis.axis = 0;
+        for (unsigned a = 1; a < 3; ++a) {
+          if (max[a] - min[a] > max[by_axis.axis] - min[by_axis.axis]) {
+            by_axis.axis = a;
+          }
+        }
+
+        const size_t mid = lo + (hi - lo) / 2;
+        std::nth_element(nodes + lo, nodes + mid, nodes + hi, by_axis);
+        nodes[mid].axis = by_axis.axis;
+
+        build(nodes, lo, mid);
+        lo = mid + 1;
+      }
+    }
+
+    /* Call visit(index, chord_sq) for each node within the chord of q */
+    template <typename Node, typename Visit>
+    void within(const Node *nodes, size_t lo, size_t hi, const double q[3],
+                double max_chord_sq, Visit &visit)
+    {
+      while (lo < hi) {
+        const size_t mid = lo + (hi - lo) / 2;
+        const Node &node = nodes[mid];
+
+        const double node_chord_sq = chord_sq(q, node.v);
+        if (node_chord_sq <= max_chord_sq) {
+          visit(mid, node_chord_sq);
+        }
+
+        const double diff = q[node.axis] - node.v[node.axis];
+        if (diff * diff > max_chord_sq) {
+          /* N.B. Only the side containing the query point can match */
+          if (diff < 0) {
+            hi = mid;
+          } else {
+            lo = mid + 1;
+          }
+        } else {
+          within(nodes, lo, mid, q, max_chord_sq, visit);
+          lo = mid + 1;
+        }
+      }
+    }
+
+  }
+
+  /* A spatial index of watch centres, for nearest and radius queries
+   *
+   * An implicit KD-tree over the unit vectors of the watch centres. Chord
+   * length in three dimensions is
+   * monotonic in great circle distance, so there is no special case for
+   * the poles or the antimeridian.
+   *
+   * The index is a snapshot: load() copies the watch positions, which is
+   * all that needs the watch lock, and build() and the queries then work
+   * on the copy alone. The copy is made into space set aside beforehand
+   * by reserve(), so that nothing is allocated, and no trig is done,
+   * with the lock held; and in chunks, so that the lock may be released
+   * in between.
+   */
+  class WatchIndex {
+  public:
+    WatchIndex();
+    ~WatchIndex();
+
+    /* N.B. True if loaded from the current version of the table */
+    bool is_current(const WatchTable &watches) const;
+    void reserve(size_t count);
+    /* N.B. Copies the next chunk of the positions, from loaded onwards,
+     * and true once they are all copied. If the watches have changed
+     * since the previous chunk, starts again; and if there are more than
+     * were reserved for, copies nothing, and resets loaded */
+    bool load(const WatchTable &watches, size_t &loaded);
+    void build();
+
+    /* N.B. Results are in ascending order of distance */
+    size_t nearest(double lat, double lon, size_t k, WatchDistance *out);
+    size_t within(double lat, double lon, double radius,
+                  WatchDistance *out, size_t max);
+
+  private:
+    WatchIndex(const WatchIndex&);
+    WatchIndex& operator=(const WatchIndex&);
+
+    struct Position {
+      double lat;
+      double lon;
+      WatchId id;
+    };
+
+    struct Node {
+      double v[3];
+      WatchId id;
+      unsigned axis;
+    };
+
+    struct Candidate {
+      double chord_sq;
+      WatchId id;
+      bool operator<(const Candidate &rhs) const;
+    };
+
+    struct Collect;
+
+    void search_nearest(size_t lo, size_t hi, const double q[3], size_t k);
+    size_t copy_out(WatchDistance *out, size_t max) const;
+
+    std::vector<Position> m_positions;
+    std::vector<Node> m_nodes;
+    /* N.B. Reused by each query, as a heap or as a list of matches */
+    std::vector<Candidate> m_found;
+    bool m_loaded;
+    uint32_t m_version;
+  };
+
+}
+
+#endif
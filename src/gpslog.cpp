@@ -0,0 +1,265 @@
+/*
+  Copyright 2013-2014 Simon Dawson
+
+  This file is part of libsitu.
+
+  libsitu is free software: you can redistribute it and/or modify
+  it under the terms of the GNU Lesser General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  libsitu is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU Lesser General Public License for more details.
+
+  You should have received a copy of the GNU Lesser General Public License
+  along with libsitu.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <errno.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include <pthread.h>
+#include <semaphore.h>
+
+#include <gpslog.h>
+
+/* Queued records; a power of two */
+#define LIBSITU_LOG_RECORDS 256
+/* Longest message, including the terminator; longer ones are truncated */
+#define LIBSITU_LOG_TEXT 240
+/* Messages written by a call site per interval, before suppression */
+#define LIBSITU_LOG_BURST 10u
+#define LIBSITU_LOG_INTERVAL_ms 1000u
+
+namespace libsitu {
+
+  namespace Log {
+
+    volatile int level = LOG_LEVEL_WARN;
+
+    namespace {
+
+      struct Record {
+        /* N.B. Equal to the queue position when the record is free for
+         * that position, and one past it once written */
+        uint64_t sequence;
+        LogLevel level;
+        char text[LIBSITU_LOG_TEXT];
+      };
+
+      /* N.B. A bounded multiple-producer queue, after Vyukov; producers
+       * claim a position by compare and swap, and only the consumer,
+       * holding consumer_mutex, removes records */
+      Record records[LIBSITU_LOG_RECORDS];
+      uint64_t enqueue_pos = 0;
+      uint64_t dequeue_pos = 0;
+      unsigned long dropped = 0;
+
+      pthread_once_t init_once = PTHREAD_ONCE_INIT;
+      pthread_mutex_t consumer_mutex = PTHREAD_MUTEX_INITIALIZER;
+      sem_t pending;
+      bool writer_running = false;
+
+      LogSink sink = NULL;
+      void *sink_data = NULL;
+
+      const char* level_str(LogLevel message_level)
+      {
+        switch (message_level) {
+        case LOG_LEVEL_ERROR:
+          return "ERROR";
+        case LOG_LEVEL_WARN:
+          return "WARNING";
+        case LOG_LEVEL_INFO:
+          return "INFO";
+        default:
+          return "DEBUG";
+        }
+      }
+
+      void drain()
+      /* Write every published record; the caller holds consumer_mutex */
+      {
+        for (;;) {
+          Record &record = records[dequeue_pos & (LIBSITU_LOG_RECORDS - 1)];
+          if (__atomic_load_n(&record.sequence, __ATOMIC_ACQUIRE) !=
+              dequeue_pos + 1) {
+            break;
+          }
+          if (NULL != sink) {
+            (*sink)(record.level, record.text, sink_data);
+          } else {
+            fprintf(stderr, "%s: %s\n", level_str(record.level), record.text);
+          }
+          __atomic_store_n(&record.sequence, dequeue_pos + LIBSITU_LOG_RECORDS,
+                           __ATOMIC_RELEASE);
+          ++dequeue_pos;
+        }
+      }
+
+      void* writer(void *UNUSED(arg))
+      {
+        for (;;) {
+          while (0 != sem_wait(&pending)) {
+            if (EINTR != errno) {
+              return NULL;
+            }
+          }
+          flush();
+        }
+        return NULL;
+      }
+
+      void init()
+      {
+        for (uint64_t i = 0; i < LIBSITU_LOG_RECORDS; ++i) {
+          records[i].sequence = i;
+        }
+        atexit(&flush);
+
+        pthread_attr_t attr;
+        if (0 == sem_init(&pending, 0, 0) &&
+            0 == pthread_attr_init(&attr)) {
+          pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+          pthread_t thread;
+          writer_running = 0 == pthread_create(&thread, &attr, &writer, NULL);
+          pthread_attr_destroy(&attr);
+        }
+        if (!writer_running) {
+          fprintf(stderr, "%s: Failed to start log writer; logging "
+                  "synchronously\n", level_str(LOG_LEVEL_WARN));
+        }
+      }
+
+      Record* claim()
+      /* Claim the record at the tail of the queue, or NULL if it is full */
+      {
+        uint64_t pos = __atomic_load_n(&enqueue_pos, __ATOMIC_RELAXED);
+        for (;;) {
+          Record &record = records[pos & (LIBSITU_LOG_RECORDS - 1)];
+          const uint64_t sequence =
+            __atomic_load_n(&record.sequence, __ATOMIC_ACQUIRE);
+          const int64_t lag = static_cast<int64_t>(sequence - pos);
+          if (0 == lag) {
+            if (__atomic_compare_exchange_n(&enqueue_pos, &pos, pos + 1, true,
+                                            __ATOMIC_RELAXED,
+                                            __ATOMIC_RELAXED)) {
+              return &record;
+            }
+          } else if (lag < 0) {
+            return NULL;
+          } else {
+            pos = __atomic_load_n(&enqueue_pos, __ATOMIC_RELAXED);
+          }
+        }
+      }
+
+      bool admit(Site &site, uint32_t &suppressed)
+      /* Apply the rate limit of a call site; on admission, take the count
+       * of messages suppressed since the last admission */
+      {
+        /* N.B. Without a clock the window is never renewed, so the burst
+         * limit still applies */
+        struct timespec now = { 0, 0 };
+        if (0 == clock_gettime(CLOCK_MONOTONIC, &now)) {
+          const uint32_t now_ms = now.tv_sec * 1000 + now.tv_nsec / 1000000;
+
+          /* N.B. Races here can only admit a message or two extra */
+          uint32_t window_ms =
+            __atomic_load_n(&site.window_ms, __ATOMIC_RELAXED);
+          if (now_ms - window_ms >= LIBSITU_LOG_INTERVAL_ms &&
+              __atomic_compare_exchange_n(&site.window_ms, &window_ms,
+                                          now_ms, false, __ATOMIC_RELAXED,
+                                          __ATOMIC_RELAXED)) {
+            __atomic_store_n(&site.count, 0, __ATOMIC_RELAXED);
+          }
+        }
+        if (__atomic_add_fetch(&site.count, 1, __ATOMIC_RELAXED) >
+            LIBSITU_LOG_BURST) {
+          __atomic_add_fetch(&site.suppressed, 1, __ATOMIC_RELAXED);
+          return false;
+        }
+        suppressed = __atomic_exchange_n(&site.suppressed, 0, __ATOMIC_RELAXED);
+        return true;
+      }
+
+    }
+
+    void start()
+    {
+      pthread_once(&init_once, &init);
+    }
+
+    void write(Site &site, LogLevel message_level, const char *format, ...)
+    {
+      uint32_t suppressed = 0;
+      if (!admit(site, suppressed)) {
+        return;
+      }
+      start();
+
+      Record *record = claim();
+      if (NULL == record) {
+        __atomic_add_fetch(&dropped, 1 + suppressed, __ATOMIC_RELAXED);
+        return;
+      }
+
+      record->level = message_level;
+      va_list args;
+      va_start(args, format);
+      int length = vsnprintf(record->text, sizeof(record->text), format, args);
+      va_end(args);
+      if (length < 0) {
+        length = 0;
+        record->text[0] = '\0';
+      } else if (length >= static_cast<int>(sizeof(record->text))) {
+        length = sizeof(record->text) - 1;
+      }
+      if (length > 0 && '\n' == record->text[length - 1]) {
+        record->text[--length] = '\0';
+      }
+      if (0 != suppressed) {
+        snprintf(record->text + length, sizeof(record->text) - length,
+                 " (%u similar messages suppressed)", suppressed);
+      }
+
+      __atomic_store_n(&record->sequence, record->sequence + 1,
+                       __ATOMIC_RELEASE);
+
+      if (writer_running) {
+        sem_post(&pending);
+      } else {
+        flush();
+      }
+    }
+
+    void set_sink(LogSink new_sink, void *data)
+    {
+      pthread_mutex_lock(&consumer_mutex);
+      sink = new_sink;
+      sink_data = data;
+      pthread_mutex_unlock(&consumer_mutex);
+    }
+
+    void flush()
+    {
+      /* N.B. Before the first message, no record is published */
+      pthread_mutex_lock(&consumer_mutex);
+      drain();
+      pthread_mutex_unlock(&consumer_mutex);
+    }
+
+    unsigned long get_dropped()
+    {
+      return __atomic_load_n(&dropped, __ATOMIC_RELAXED);
+    }
+
+  }
+
+}
@@ -0,0 +1,79 @@
+/*
+  Copyright 2013-2014 Simon Dawson
+
+  This file is part of libsitu.
+
+  libsitu is free software: you can redistribute it and/or modify
+  it under the terms of the GNU Lesser General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  libsitu is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU Lesser General Public License for more details.
+
+  You should have received a copy of the GNU Lesser General Public License
+  along with libsitu.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef _LIBSITU_GPSLOG_H_
+#define _LIBSITU_GPSLOG_H_
+
+#include <stdint.h>
+
+#include <libsitu.h>
+
+/*
+ * Log a message from a call site, at a level
+ *
+ * Each call site is rate limited on its own, and a message below the
+ * current level costs a single load. Formatting happens in the calling
+ * thread, into a fixed-size record on a lock-free queue; the records are
+ * written by a background thread, so that logging never blocks on I/O.
+ */
+#define LIBSITU_LOG(level, ...)                                         \
+  do {                                                                  \
+    static libsitu::Log::Site libsitu_log_site_ = { 0, 0, 0 };          \
+    if (libsitu::Log::enabled(level)) {                                 \
+      libsitu::Log::write(libsitu_log_site_, (level), __VA_ARGS__);     \
+    }                                                                   \
+  } while (0)
+
+namespace libsitu {
+
+  namespace Log {
+
+    /* N.B. Statically initialised to zero, so that a site needs no
+     * guard */
+    struct Site {
+      uint32_t window_ms; /* Start of the current rate window */
+      uint32_t count; /* Messages in the current rate window */
+      uint32_t suppressed; /* Messages dropped by the rate limit */
+    };
+
+    extern volatile int level;
+
+    inline bool enabled(LogLevel message_level)
+    {
+      return static_cast<int>(message_level) <= level;
+    }
+
+    /* N.B. Starts the writer thread, which is otherwise started by the
+     * first message, wherever that is logged */
+    void start();
+
+    void write(Site &site, LogLevel message_level, const char *format, ...)
+      __attribute__((format(printf, 3, 4)));
+
+    /* N.B. The sink is called with the consumer lock held, so it must
+     * not call set_sink() or flush() */
+    void set_sink(LogSink sink, void *data);
+    void flush();
+    unsigned long get_dropped();
+
+  }
+
+}
+
+#endif
@@ -27,6 +27,7 @@
 #include <gps.h>
 #ifdef HAVE_LIBMPFR
 #include <mpfr.h>
+#include <pthread.h>
 #endif /* HAVE_LIBMPFR */
 
 #include <gpsdebug.h>
@@ -55,8 +56,56 @@
  */
 #define LIBSITU_PRECISION_BITS 64
 
+/* GMP allocations made by MPFR while evaluating are served from a pool per
+ * thread, in power of two size classes from 2^MIN_SHIFT to 2^MAX_SHIFT
+ * bytes, each class with a region of CLASS_BYTES. At 64 bits of precision
+ * the trig functions need a few blocks at a time, and the pi cache one.
+ */
+#define LIBSITU_MPFR_POOL_MIN_SHIFT 4
+#define LIBSITU_MPFR_POOL_MAX_SHIFT 12
+#define LIBSITU_MPFR_POOL_CLASS_BYTES (16 * 1024)
+
 #define LIBSITU_EARTH_RADIUS_m 6378137.0
 
+/* WGS-84 ellipsoid: semi-major axis and flattening */
+#define LIBSITU_WGS84_A_m 6378137.0
+#define LIBSITU_WGS84_F (1.0 / 298.257223563)
+
+/* Vincenty iteration limit, and convergence tolerance on lambda (radians).
+ *
+ * A tolerance of 1e-12 corresponds to around 0.006mm on the ground. */
+#define LIBSITU_VINCENTY_MAX_ITERATIONS 100
+#define LIBSITU_VINCENTY_TOLERANCE 1e-12
+
+/* Maximum error permitted for the local tangent plane, in meters.
+ *
+ * The plane is equirectangular about the watch, scaled by the cosine of
+ * the watch latitude. Its error against the great circle distance is
+ * dominated by the convergence of the meridians, and is bounded by
+ * d^2.tan(lat)/2R at a separation of d; the bound is applied at twice the
+ * watch radius, beyond which no zone boundary lies. Typical station
+ * watches of 500m qualify at all latitudes below 70 degrees.
+ */
+#define LIBSITU_PLANE_MAX_ERROR_m 0.25
+
+/* Fixed-point coordinates are in units of 1e-7 of a degree, as used by
+ * u-blox and most other receivers, and projected distances are in
+ * centimetres.
+ *
+ * The local projection is equirectangular about the watch, so it agrees
+ * with the great circle distance to within 0.1% for separations of up to
+ * 20km at latitudes below 70 degrees. For a 500m watch, classification
+ * therefore matches the reference except where the fix lies within 0.5m
+ * of a zone boundary (radius plus or minus the error radius).
+ */
+#define LIBSITU_FIXED_UNITS_PER_DEGREE 10000000
+#define LIBSITU_FIXED_SHIFT 16
+
+/* Crossings are interpolated between fixes up to this far apart, and
+ * predicted at speeds of at least this */
+#define LIBSITU_STEP_MAX_s 10.0
+#define LIBSITU_MIN_SPEED_m_s 0.5
+
 namespace libsitu {
   namespace Math {
 
@@ -65,6 +114,29 @@ namespace libsitu {
       return isfinite(x);
     }
 
+    double wrap_longitude(double d)
+    /* Normalise a difference of longitudes to [-180, 180] */
+    {
+      return d > 180 ? d - 360 : d < -180 ? d + 360 : d;
+    }
+
+    bool circle_crossing(double x, double y, double dx, double dy,
+                         double rad, bool entering, double &t)
+    /* Solve for the parameter t at which the line (x, y) + t (dx, dy)
+     * enters, or leaves, a circle about the origin */
+    {
+      const double a = dx * dx + dy * dy;
+      const double b = 2 * (x * dx + y * dy);
+      const double c = x * x + y * y - rad * rad;
+      const double discriminant = b * b - 4 * a * c;
+      if (!(a > 0) || discriminant < 0) {
+        return false;
+      }
+      const double root = sqrt(discriminant);
+      t = (entering ? -b - root : -b + root) / (2 * a);
+      return true;
+    }
+
     double deg2rad(double d)
     /* Convert from degrees to radians */
     {
@@ -72,27 +144,589 @@ namespace libsitu {
       return d * pi_over_180;
     }
 
-    bool calculate_rms(double x, double y, double &rms)
+    State classify(const Fix &fix, double distance_val, double there_rad)
+    /* Classify a distance against a watch radius, allowing for the
+     * horizontal positional error of the fix */
     {
-      /* N.B. Calculate the RMS horizontal positional error. */
+      const double distance_abs_value = fabs(distance_val);
+
+      /* Allow for up to 3 standard deviations of error */
+      const double here_eph = fix.eph;
+      double error_radius = 3 * here_eph;
+      if (error_radius >= there_rad) {
+        /* It is possible that an unrealistically low watch radius has
+         * been set for the waypoint.
+         *
+         * Equally, the position might be known to a low precision.
+         *
+         * Anyway, we need to avert disaster here. */
+        LIBSITU_WARN("Error radius is %f, but watch radius is only %f\n",
+                     error_radius, there_rad);
+        /* \todo FIXME: Can we do this in a less arbitrary manner? */
+        error_radius = 0.2 * there_rad;
+      }
+
+      return
+        isnan(distance_abs_value) || isnan(error_radius) ? STATE_UNKNOWN :
+        distance_abs_value + error_radius <= there_rad ? STATE_NEAR :
+        distance_abs_value - error_radius > there_rad ? STATE_FAR :
+        /* Failing that, we're not certain */
+        STATE_UNKNOWN;
+    }
+
+    /* libm operations, by floating-point type
+     *
+     * N.B. These are spelled out per type, rather than relying upon
+     * overloads, so that each policy is bound to exactly the libm entry
+     * points it needs.
+     */
+    template <typename T> struct Libm;
+
+    template <> struct Libm<float> {
+      static float from(double x) { return static_cast<float>(x); }
+      static double to_double(float x) { return x; }
+      static float pi() { return 3.14159265358979323846f; }
+      static float sin(float x) { return sinf(x); }
+      static float cos(float x) { return cosf(x); }
+      static float asin(float x) { return asinf(x); }
+      static float sqrt(float x) { return sqrtf(x); }
+      static float hypot(float x, float y) { return hypotf(x, y); }
+    };
+
+    template <> struct Libm<double> {
+      static double from(double x) { return x; }
+      static double to_double(double x) { return x; }
+      static double pi() { return 3.14159265358979323846; }
+      static double sin(double x) { return ::sin(x); }
+      static double cos(double x) { return ::cos(x); }
+      static double asin(double x) { return ::asin(x); }
+      static double sqrt(double x) { return ::sqrt(x); }
+      static double hypot(double x, double y) { return ::hypot(x, y); }
+    };
+
+    template <> struct Libm<long double> {
+      static long double from(double x) { return x; }
+      static double to_double(long double x) {
+        return static_cast<double>(x);
+      }
+      static long double pi() { return 3.14159265358979323846264338327950288L; }
+      static long double sin(long double x) { return sinl(x); }
+      static long double cos(long double x) { return cosl(x); }
+      static long double asin(long double x) { return asinl(x); }
+      static long double sqrt(long double x) { return sqrtl(x); }
+      static long double hypot(long double x, long double y) {
+        return hypotl(x, y);
+      }
+    };
+
 #ifdef HAVE_LIBMPFR
-      MPFR_DECL_INIT(epx, LIBSITU_PRECISION_BITS);
-      MPFR_DECL_INIT(epy, LIBSITU_PRECISION_BITS);
-      mpfr_set_ld(epx, x, GMP_RNDN);
-      mpfr_set_ld(epy, y, GMP_RNDN);
-      MPFR_DECL_INIT(hypotenuse, LIBSITU_PRECISION_BITS);
-      mpfr_hypot(hypotenuse, epx, epy, GMP_RNDN);
-      if (mpfr_nan_p(hypotenuse)) {
-        LIBSITU_WARN("Hypotenuse is NaN\n");
-        return false;
+    namespace {
+
+      enum {
+        POOL_CLASSES =
+          LIBSITU_MPFR_POOL_MAX_SHIFT - LIBSITU_MPFR_POOL_MIN_SHIFT + 1
+      };
+
+      struct Pool {
+        /* N.B. Pools are never unlinked from the registry, nor freed */
+        Pool *next;
+        volatile int in_use;
+        /* N.B. Only the owning thread allocates, but any thread may free */
+        pthread_mutex_t mutex;
+        char *base; /* The regions of each class, in order */
+        char *top[POOL_CLASSES];
+        void *free_list[POOL_CLASSES];
+      };
+
+      typedef void* (*AllocFunction)(size_t);
+      typedef void* (*ReallocFunction)(void*, size_t, size_t);
+      typedef void (*FreeFunction)(void*, size_t);
+
+      Pool *pool_registry = NULL;
+      pthread_once_t pool_once = PTHREAD_ONCE_INIT;
+      pthread_key_t pool_key;
+      __thread Pool *thread_pool = NULL;
+      __thread bool pool_active = false;
+
+      /* The GMP memory functions installed before the pool's */
+      AllocFunction next_alloc = NULL;
+      ReallocFunction next_realloc = NULL;
+      FreeFunction next_free = NULL;
+
+      int pool_class(size_t size)
+      /* Size class of a block, or -1 if too large for the pool */
+      {
+        int c = 0;
+        while ((static_cast<size_t>(1) << (LIBSITU_MPFR_POOL_MIN_SHIFT + c))
+               < size) {
+          if (POOL_CLASSES == ++c) {
+            return -1;
+          }
+        }
+        return c;
       }
 
-      rms = mpfr_get_d(hypotenuse, GMP_RNDN);
-      return true;
+      Pool* pool_of(void *block, int &c)
+      /* Pool, and size class, of a block; or NULL if not from a pool
+       *
+       * N.B. The class is found from the address rather than the size
+       * passed by GMP, so that it does not rely upon the latter */
+      {
+        const char *p = static_cast<char*>(block);
+        for (Pool *pool = __atomic_load_n(&pool_registry, __ATOMIC_ACQUIRE);
+             NULL != pool; pool = pool->next) {
+          if (p >= pool->base &&
+              p < pool->base + POOL_CLASSES * LIBSITU_MPFR_POOL_CLASS_BYTES) {
+            c = static_cast<int>((p - pool->base) /
+                                 LIBSITU_MPFR_POOL_CLASS_BYTES);
+            return pool;
+          }
+        }
+        return NULL;
+      }
+
+      void* pool_alloc(size_t size)
+      {
+        const int c = pool_active ? pool_class(size) : -1;
+        if (c >= 0) {
+          Pool *pool = thread_pool;
+          void *block = NULL;
+          pthread_mutex_lock(&pool->mutex);
+          if (NULL != pool->free_list[c]) {
+            block = pool->free_list[c];
+            pool->free_list[c] = *static_cast<void**>(block);
+          } else if (pool->top[c] <
+                     pool->base + (c + 1) * LIBSITU_MPFR_POOL_CLASS_BYTES) {
+            block = pool->top[c];
+            pool->top[c] +=
+              static_cast<size_t>(1) << (LIBSITU_MPFR_POOL_MIN_SHIFT + c);
+          }
+          pthread_mutex_unlock(&pool->mutex);
+          if (NULL != block) {
+            return block;
+          }
+          LIBSITU_DBG("MPFR pool exhausted for %lu bytes\n",
+                      static_cast<unsigned long>(size));
+        }
+        return (*next_alloc)(size);
+      }
+
+      void pool_free(void *block, size_t size)
+      {
+        int c = 0;
+        Pool *pool = pool_of(block, c);
+        if (NULL == pool) {
+          (*next_free)(block, size);
+          return;
+        }
+        pthread_mutex_lock(&pool->mutex);
+        *static_cast<void**>(block) = pool->free_list[c];
+        pool->free_list[c] = block;
+        pthread_mutex_unlock(&pool->mutex);
+      }
+
+      void* pool_realloc(void *block, size_t old_size, size_t new_size)
+      {
+        int c = 0;
+        if (NULL == pool_of(block, c)) {
+          return (*next_realloc)(block, old_size, new_size);
+        }
+        const size_t class_size =
+          static_cast<size_t>(1) << (LIBSITU_MPFR_POOL_MIN_SHIFT + c);
+        if (new_size <= class_size) {
+          return block;
+        }
+        void *moved = pool_alloc(new_size);
+        if (NULL != moved) {
+          memcpy(moved, block, class_size);
+          pool_free(block, old_size);
+        }
+        return moved;
+      }
+
+      void release_pool(void *pool)
+      /* Release the pool of an exiting thread, for a new thread to claim */
+      {
+        __atomic_store_n(&static_cast<Pool*>(pool)->in_use, 0,
+                         __ATOMIC_RELEASE);
+      }
+
+      void install_pool()
+      {
+        if (0 != pthread_key_create(&pool_key, &release_pool)) {
+          LIBSITU_WARN("Failed to create MPFR pool key\n");
+        }
+        mp_get_memory_functions(&next_alloc, &next_realloc, &next_free);
+        mp_set_memory_functions(&pool_alloc, &pool_realloc, &pool_free);
+      }
+
+      Pool* claim_pool()
+      {
+        for (Pool *pool = __atomic_load_n(&pool_registry, __ATOMIC_ACQUIRE);
+             NULL != pool; pool = pool->next) {
+          if (__sync_bool_compare_and_swap(&pool->in_use, 0, 1)) {
+            return pool;
+          }
+        }
+
+        Pool *pool = static_cast<Pool*>(calloc(1, sizeof(Pool)));
+        if (NULL == pool) {
+          return NULL;
+        }
+        pool->base = static_cast<char*>(
+          malloc(POOL_CLASSES * LIBSITU_MPFR_POOL_CLASS_BYTES));
+        if (NULL == pool->base ||
+            0 != pthread_mutex_init(&pool->mutex, NULL)) {
+          free(pool->base);
+          free(pool);
+          return NULL;
+        }
+        for (int c = 0; c < POOL_CLASSES; ++c) {
+          pool->top[c] = pool->base + c * LIBSITU_MPFR_POOL_CLASS_BYTES;
+        }
+        pool->in_use = 1;
+        do {
+          pool->next = __atomic_load_n(&pool_registry, __ATOMIC_ACQUIRE);
+        } while (!__sync_bool_compare_and_swap(&pool_registry, pool->next,
+                                               pool));
+        return pool;
+      }
+
+      void prepare_pool()
+      /* Install the pool, and claim one for the calling thread */
+      {
+#if MPFR_VERSION_MAJOR >= 4
+        /* N.B. MPFR 4 caches the GMP memory functions per thread, so drop
+         * any cached before the pool was installed */
+        mpfr_mp_memory_cleanup();
+#endif /* MPFR_VERSION_MAJOR >= 4 */
+        if (0 != pthread_once(&pool_once, &install_pool)) {
+          LIBSITU_WARN("Failed to install MPFR pool\n");
+          return;
+        }
+        if (NULL == thread_pool) {
+          thread_pool = claim_pool();
+          if (NULL == thread_pool) {
+            LIBSITU_WARN("Failed to allocate MPFR pool\n");
+          } else if (0 != pthread_setspecific(pool_key, thread_pool)) {
+            LIBSITU_WARN("Failed to set MPFR pool\n");
+          }
+        }
+      }
+
+      /* Serves MPFR's allocations from the thread's pool, for its
+       * lifetime */
+      class PoolScope {
+      public:
+        PoolScope()
+          : m_outer(pool_active)
+        {
+          pool_active = NULL != thread_pool;
+        }
+
+        ~PoolScope()
+        {
+          pool_active = m_outer;
+        }
+
+      private:
+        PoolScope(const PoolScope &original);
+        PoolScope& operator=(const PoolScope &rhs);
+
+        const bool m_outer;
+      };
+
+    }
+
+    /* A GNU MPFR number of LIBSITU_PRECISION_BITS bits, for instantiating
+     * the native policy at high precision
+     *
+     * N.B. The limbs are held in place, as MPFR_DECL_INIT would hold them
+     * on the stack, so that arithmetic does not allocate.
+     */
+    class Mpfr {
+    public:
+      Mpfr()
+        : m_limbs(), m_value()
+      {
+        init();
+      }
+
+      explicit Mpfr(double x)
+        : m_limbs(), m_value()
+      {
+        init();
+        mpfr_set_d(m_value, x, GMP_RNDN);
+      }
+
+      Mpfr(const Mpfr &original)
+        : m_limbs(), m_value()
+      {
+        init();
+        mpfr_set(m_value, original.m_value, GMP_RNDN);
+      }
+
+      Mpfr& operator=(const Mpfr &rhs)
+      {
+        if (this != &rhs) {
+          mpfr_set(m_value, rhs.m_value, GMP_RNDN);
+        }
+        return *this;
+      }
+
+      mpfr_ptr get()
+      {
+        return m_value;
+      }
+
+      mpfr_srcptr get() const
+      {
+        return m_value;
+      }
+
+    private:
+      enum {
+        LIMBS = (LIBSITU_PRECISION_BITS + GMP_NUMB_BITS - 1) / GMP_NUMB_BITS
+      };
+
+      void init()
+      {
+        mpfr_custom_init(m_limbs, LIBSITU_PRECISION_BITS);
+        mpfr_custom_init_set(m_value, MPFR_ZERO_KIND, 0,
+                             LIBSITU_PRECISION_BITS, m_limbs);
+      }
+
+      mp_limb_t m_limbs[LIMBS];
+      mpfr_t m_value;
+    };
+
+    typedef int (*MpfrBinary)(mpfr_ptr, mpfr_srcptr, mpfr_srcptr,
+                              mpfr_rnd_t);
+    typedef int (*MpfrUnary)(mpfr_ptr, mpfr_srcptr, mpfr_rnd_t);
+
+    Mpfr mpfr_apply(MpfrBinary op, const Mpfr &a, const Mpfr &b)
+    {
+      Mpfr result;
+      (*op)(result.get(), a.get(), b.get(), GMP_RNDN);
+      return result;
+    }
+
+    Mpfr mpfr_apply(MpfrUnary op, const Mpfr &a)
+    {
+      Mpfr result;
+      (*op)(result.get(), a.get(), GMP_RNDN);
+      return result;
+    }
+
+    Mpfr operator+(const Mpfr &a, const Mpfr &b)
+    {
+      return mpfr_apply(&mpfr_add, a, b);
+    }
+
+    Mpfr operator-(const Mpfr &a, const Mpfr &b)
+    {
+      return mpfr_apply(&mpfr_sub, a, b);
+    }
+
+    Mpfr operator*(const Mpfr &a, const Mpfr &b)
+    {
+      return mpfr_apply(&mpfr_mul, a, b);
+    }
+
+    Mpfr operator/(const Mpfr &a, const Mpfr &b)
+    {
+      return mpfr_apply(&mpfr_div, a, b);
+    }
+
+    bool operator<(const Mpfr &a, const Mpfr &b)
+    {
+      return 0 != mpfr_less_p(a.get(), b.get());
+    }
+
+    template <> struct Libm<Mpfr> {
+      static Mpfr from(double x) { return Mpfr(x); }
+      static double to_double(const Mpfr &x) {
+        return mpfr_get_d(x.get(), GMP_RNDN);
+      }
+      static Mpfr pi() {
+        Mpfr result;
+        mpfr_const_pi(result.get(), GMP_RNDN);
+        return result;
+      }
+      static Mpfr sin(const Mpfr &x) { return mpfr_apply(&mpfr_sin, x); }
+      static Mpfr cos(const Mpfr &x) { return mpfr_apply(&mpfr_cos, x); }
+      static Mpfr asin(const Mpfr &x) { return mpfr_apply(&mpfr_asin, x); }
+      static Mpfr sqrt(const Mpfr &x) { return mpfr_apply(&mpfr_sqrt, x); }
+      static Mpfr hypot(const Mpfr &x, const Mpfr &y) {
+        return mpfr_apply(&mpfr_hypot, x, y);
+      }
+    };
+#endif /* HAVE_LIBMPFR */
+
+    /* Numeric policy using floating-point type T
+     *
+     * The great circle distance uses the haversine formulation, which
+     * (unlike the spherical law of cosines) remains well conditioned at
+     * the small angles found near a watch, even in single precision.
+     */
+    template <typename T>
+    struct Native {
+      static double distance(double here_lat, double here_lon,
+                             double there_lat, double there_lon)
+      {
+        typedef Libm<T> M;
+        const T one = M::from(1);
+        const T two = M::from(2);
+        const T pi_over_180 = M::pi() / M::from(180);
+        const T here_n = M::from(here_lat) * pi_over_180;
+        const T there_n = M::from(there_lat) * pi_over_180;
+        const T half_diff_n = (there_n - here_n) / two;
+        const T half_diff_e =
+          (M::from(there_lon) - M::from(here_lon)) * pi_over_180 / two;
+
+        const T A = M::sin(half_diff_n);
+        const T B = M::sin(half_diff_e);
+        const T h = A * A + M::cos(here_n) * M::cos(there_n) * B * B;
+
+        /* N.B. Rounding can push h fractionally above one */
+        const T angular_delta = two * M::asin(M::sqrt(h < one ? h : one));
+
+        /* Convert to a great circle distance in meters */
+        return M::to_double(angular_delta *
+                            M::from(LIBSITU_EARTH_RADIUS_m));
+      }
+
+      static bool rms(double x, double y, double &rms)
+      {
+        rms = Libm<T>::to_double(Libm<T>::hypot(Libm<T>::from(x),
+                                                Libm<T>::from(y)));
+        return true;
+      }
+    };
+
+#ifdef HAVE_LIBMPFR
+    /* Numeric policy using GNU MPFR, with LIBSITU_PRECISION_BITS bits of
+     * precision
+     *
+     * This is the reference against which the native policies are
+     * compared: the same haversine computation, at higher precision, so
+     * that the comparison measures precision alone.
+     *
+     * N.B. MPFR's temporaries are allocated from the thread's pool, so
+     * that evaluation does not allocate once warm_up() has run.
+     */
+    struct Mpfr64 {
+      static double distance(double here_lat, double here_lon,
+                             double there_lat, double there_lon)
+      {
+        const PoolScope scope;
+        return Native<Mpfr>::distance(here_lat, here_lon,
+                                      there_lat, there_lon);
+      }
+
+      static bool rms(double x, double y, double &rms)
+      {
+        const PoolScope scope;
+        MPFR_DECL_INIT(epx, LIBSITU_PRECISION_BITS);
+        MPFR_DECL_INIT(epy, LIBSITU_PRECISION_BITS);
+        mpfr_set_ld(epx, x, GMP_RNDN);
+        mpfr_set_ld(epy, y, GMP_RNDN);
+        MPFR_DECL_INIT(hypotenuse, LIBSITU_PRECISION_BITS);
+        mpfr_hypot(hypotenuse, epx, epy, GMP_RNDN);
+        if (mpfr_nan_p(hypotenuse)) {
+          LIBSITU_WARN("Hypotenuse is NaN\n");
+          return false;
+        }
+
+        rms = mpfr_get_d(hypotenuse, GMP_RNDN);
+        return true;
+      }
+    };
+
+    typedef Mpfr64 DefaultPolicy;
 #else /* HAVE_LIBMPFR */
-      rms = hypot(x, y);
-      return true;
+    typedef Native<double> DefaultPolicy;
 #endif /* HAVE_LIBMPFR */
+
+    template <typename Policy>
+    double policy_distance(
+      const Fix &fix,
+      double there_lat,
+      double there_lon,
+      double there_rad,
+      State &state
+    )
+    /* Calculate the distance from here to there, using the specified
+     * numeric policy */
+    {
+      const double distance_val =
+        Policy::distance(fix.latitude, fix.longitude, there_lat, there_lon);
+
+      state = classify(fix, distance_val, there_rad);
+
+      return distance_val;
+    }
+
+    int32_t fixed_units(double degrees)
+    /* Round degrees to fixed-point units, half away from zero as lround()
+     * would, without calling into libm */
+    {
+      const double units = degrees * LIBSITU_FIXED_UNITS_PER_DEGREE;
+      return static_cast<int32_t>(units < 0 ? units - 0.5 : units + 0.5);
+    }
+
+    void fixed_here_init(FixedHere &here, const Fix &fix, double err)
+    /* Compute the fix-side fixed-point terms, with integer conversions
+     * only */
+    {
+      const double err_cm = err * 100;
+      here.valid = is_finite(fix.latitude) && is_finite(fix.longitude) &&
+        fix.latitude >= -90 && fix.latitude <= 90 &&
+        fix.longitude >= -180 && fix.longitude <= 180 && !isnan(err_cm);
+      if (here.valid) {
+        here.lat = fixed_units(fix.latitude);
+        here.lon = fixed_units(fix.longitude);
+        here.err_cm = err_cm < INT32_MAX ?
+          static_cast<int32_t>(err_cm) : INT32_MAX;
+      } else {
+        here.lat = 0;
+        here.lon = 0;
+        here.err_cm = 0;
+      }
+    }
+
+    double fixed_policy_distance(
+      const Fix &fix,
+      double there_lat,
+      double there_lon,
+      double there_rad,
+      State &state
+    )
+    /* Calculate the distance from here to there in the local projection
+     * about there, and classify it, as a PRECISION_FIXED watch would */
+    {
+      FixedHere here;
+      fixed_here_init(here, fix, 3 * fix.eph);
+      FixedThere there;
+      fixed_init(there, there_lat, there_lon, there_rad);
+
+      int64_t distance_sq = 0;
+      state = fixed_classify(here, there, distance_sq);
+
+      return here.valid ? fixed_distance(here, there) : NAN;
+    }
+
+    template <typename Policy>
+    bool policy_rms(double x, double y, double &rms)
+    /* Calculate the RMS horizontal positional error, using the specified
+     * numeric policy */
+    {
+      return Policy::rms(x, y, rms);
+    }
+
+    bool calculate_rms(double x, double y, double &rms)
+    {
+      return policy_rms<DefaultPolicy>(x, y, rms);
     }
 
     double distance(
@@ -102,132 +736,561 @@ namespace libsitu {
       double there_rad,
       State &state
     )
-    /* Calculate the distance from here to there
-     *
-     * See http://www.movable-type.co.uk/scripts/latlong.html for algorithm
-     */
     {
-      const double here_lat = fix.latitude;
-      const double here_lon = fix.longitude;
+      return policy_distance<DefaultPolicy>(fix, there_lat, there_lon,
+                                            there_rad, state);
+    }
 
+    bool has_precision(Precision precision)
+    {
+#ifndef HAVE_LIBMPFR
+      if (PRECISION_MPFR == precision) {
+        return false;
+      }
+#endif /* HAVE_LIBMPFR */
+      return PRECISION_DEFAULT <= precision && PRECISION_FIXED >= precision;
+    }
+
+    DistanceFunction distance_function(Precision precision)
+    {
+      switch (precision) {
+      case PRECISION_MPFR:
 #ifdef HAVE_LIBMPFR
-      /* Get eastings and northings in radian measure */
-      MPFR_DECL_INIT(here_e, LIBSITU_PRECISION_BITS);
-      MPFR_DECL_INIT(here_n, LIBSITU_PRECISION_BITS);
-      MPFR_DECL_INIT(there_e, LIBSITU_PRECISION_BITS);
-      MPFR_DECL_INIT(there_n, LIBSITU_PRECISION_BITS);
-      mpfr_set_ld(here_e, deg2rad(here_lon), GMP_RNDN);
-      mpfr_set_ld(here_n, deg2rad(90.0 - here_lat), GMP_RNDN);
-      mpfr_set_ld(there_e, deg2rad(there_lon), GMP_RNDN);
-      mpfr_set_ld(there_n, deg2rad(90.0 - there_lat), GMP_RNDN);
-
-      MPFR_DECL_INIT(diff_e, LIBSITU_PRECISION_BITS);
-      mpfr_sub(diff_e, here_e, there_e, GMP_RNDN);
-
-      MPFR_DECL_INIT(A, LIBSITU_PRECISION_BITS);
-      MPFR_DECL_INIT(B, LIBSITU_PRECISION_BITS);
-      MPFR_DECL_INIT(C, LIBSITU_PRECISION_BITS);
-      MPFR_DECL_INIT(D, LIBSITU_PRECISION_BITS);
-      MPFR_DECL_INIT(E, LIBSITU_PRECISION_BITS);
-
-      mpfr_sin(A, here_n, GMP_RNDN);
-      mpfr_sin(B, there_n, GMP_RNDN);
-      mpfr_cos(C, here_n, GMP_RNDN);
-      mpfr_cos(D, there_n, GMP_RNDN);
-      mpfr_cos(E, diff_e, GMP_RNDN);
-
-      MPFR_DECL_INIT(AA, LIBSITU_PRECISION_BITS);
-      MPFR_DECL_INIT(BB, LIBSITU_PRECISION_BITS);
-      MPFR_DECL_INIT(CC, LIBSITU_PRECISION_BITS);
-
-      mpfr_mul(AA, A, B, GMP_RNDN);
-      mpfr_mul(BB, C, D, GMP_RNDN);
-      mpfr_mul(BB, BB, E, GMP_RNDN);
-      mpfr_add(CC, AA, BB, GMP_RNDN);
-
-      MPFR_DECL_INIT(angular_delta, LIBSITU_PRECISION_BITS);
-      mpfr_acos(angular_delta, CC, GMP_RNDN);
-
-      /* Convert to a great circle distance in meters */
-      MPFR_DECL_INIT(earth_radius_m, LIBSITU_PRECISION_BITS);
-      mpfr_set_ld(earth_radius_m, LIBSITU_EARTH_RADIUS_m, GMP_RNDN); /* Equatorial Earth radius. */
-
-      /* return angular_delta * earth_radius_m; */
-      MPFR_DECL_INIT(res, LIBSITU_PRECISION_BITS);
-      mpfr_mul(res, angular_delta, earth_radius_m, GMP_RNDN);
-
-      if (mpfr_nan_p(res)) {
-        LIBSITU_DBGV("Distance is NAN:\n");
-      }
-
-#ifdef LIBSITU_DEBUG_MATH
-      LIBSITU_DBG("here_e: %.12g, here_n: %.12g, there_e: %.12g, there_n: %.12g, diff_e: %.12g\n",
-                  mpfr_get_d(here_e, GMP_RNDN),
-                  mpfr_get_d(here_n, GMP_RNDN),
-                  mpfr_get_d(there_e, GMP_RNDN),
-                  mpfr_get_d(there_n, GMP_RNDN),
-                  mpfr_get_d(diff_e, GMP_RNDN));
-      LIBSITU_DBG("A: %.12g, B: %.12g, C: %.12g, D: %.12g, E: %.12g\n",
-                  mpfr_get_d(A, GMP_RNDN),
-                  mpfr_get_d(B, GMP_RNDN),
-                  mpfr_get_d(C, GMP_RNDN),
-                  mpfr_get_d(D, GMP_RNDN),
-                  mpfr_get_d(E, GMP_RNDN));
-      LIBSITU_DBG("AA: %.12g, BB: %.12g\n",
-                  mpfr_get_d(AA, GMP_RNDN), mpfr_get_d(BB, GMP_RNDN));
-      LIBSITU_DBG("CC: %.12g, angular_delta: %.12g, result: %.12g\n",
-                  mpfr_get_d(CC, GMP_RNDN),
-                  mpfr_get_d(angular_delta, GMP_RNDN),
-                  mpfr_get_d(res, GMP_RNDN));
-
-#endif /* LIBSITU_DEBUG_MATH */
-
-      const double distance_val = mpfr_get_d(res, GMP_RNDN);
+        return &policy_distance<Mpfr64>;
 #else /* HAVE_LIBMPFR */
-      const double here_e = deg2rad(here_lon);
-      const double here_n = deg2rad(90.0 - here_lat);
-      const double there_e = deg2rad(there_lon);
-      const double there_n = deg2rad(90.0 - there_lat);
-      const double diff_e = here_e - there_e;
-      const double A = sin(here_n);
-      const double B = sin(there_n);
-      const double C = cos(here_n);
-      const double D = cos(there_n);
-      const double E = cos(diff_e);
-      const double AA = A * B;
-      double BB = C * D;
-      double BB = BB * E;
-      const double CC = AA * BB;
-      const double angular_delta = acos(CC);
-      const double earth_radius_m = LIBSITU_EARTH_RADIUS_m;
-      const double res = angular_delta * earth_radius_m;
-
-      const double distance_val = res;
+        LIBSITU_WARN("MPFR precision not available, using long double\n");
+        return &policy_distance< Native<long double> >;
 #endif /* HAVE_LIBMPFR */
-      const double distance_abs_value = fabs(distance_val);
+      case PRECISION_LONG_DOUBLE:
+        return &policy_distance< Native<long double> >;
+      case PRECISION_DOUBLE:
+        return &policy_distance< Native<double> >;
+      case PRECISION_FLOAT:
+        return &policy_distance< Native<float> >;
+      case PRECISION_FIXED:
+        return &fixed_policy_distance;
+      case PRECISION_DEFAULT:
+        break;
+      default:
+        LIBSITU_WARN("Invalid precision\n");
+        break;
+      }
 
-      /* Allow for up to 3 standard deviations of error */
-      const double here_eph = fix.eph;
-      double error_radius = 3 * here_eph;
+      return &policy_distance<DefaultPolicy>;
+    }
+
+    RmsFunction rms_function(Precision precision)
+    {
+      switch (precision) {
+      case PRECISION_MPFR:
+#ifdef HAVE_LIBMPFR
+        return &policy_rms<Mpfr64>;
+#else /* HAVE_LIBMPFR */
+        return &policy_rms< Native<long double> >;
+#endif /* HAVE_LIBMPFR */
+      case PRECISION_LONG_DOUBLE:
+        return &policy_rms< Native<long double> >;
+      case PRECISION_DOUBLE:
+        return &policy_rms< Native<double> >;
+      case PRECISION_FLOAT:
+        /* Run into next case. */
+      case PRECISION_FIXED:
+        return &policy_rms< Native<float> >;
+      case PRECISION_DEFAULT:
+        break;
+      default:
+        LIBSITU_WARN("Invalid precision\n");
+        break;
+      }
+
+      return &policy_rms<DefaultPolicy>;
+    }
+
+    void warm_up()
+    {
+#ifdef HAVE_LIBMPFR
+      prepare_pool();
+#endif /* HAVE_LIBMPFR */
+
+      /* N.B. MPFR caches constants, such as pi for argument reduction, per
+       * thread and per precision; so use both near and distant points */
+      static const double points[][2] = {
+        { 51.398, -1.308 },
+        { -33.857, 151.215 }
+      };
+
+      Fix fix = Fix();
+      fix.valid = true;
+      fix.latitude = 51.398;
+      fix.longitude = -1.323;
+      fix.eph = 1;
+
+      Here here;
+      here_init(here, fix);
+
+      for (int p = PRECISION_DEFAULT; p <= PRECISION_FIXED; ++p) {
+        const Precision precision = static_cast<Precision>(p);
+        if (has_precision(precision)) {
+          for (size_t i = 0; i < sizeof(points) / sizeof(points[0]); ++i) {
+            State state = STATE_UNKNOWN;
+            (*distance_function(precision))(fix, points[i][0], points[i][1],
+                                            500, state);
+          }
+          double rms = 0;
+          (*rms_function(precision))(3, 4, rms);
+        }
+      }
+
+      /* N.B. And the evaluators that take the fix-side terms */
+      for (size_t i = 0; i < sizeof(points) / sizeof(points[0]); ++i) {
+        State state = STATE_UNKNOWN;
+        Geodesic there;
+        geodesic_init(there, points[i][0], points[i][1]);
+        double lambda = NAN;
+        geodesic_distance(fix, here_geodesic(here, fix), there, points[i][0],
+                          points[i][1], 500, lambda, state);
+
+        Plane plane;
+        if (plane_init(plane, points[i][0], points[i][1], 500)) {
+          double distance_sq = 0;
+          plane_classify(fix, here, plane, 500, distance_sq);
+        }
+
+        FixedThere fixed;
+        fixed_init(fixed, points[i][0], points[i][1], 500);
+        int64_t fixed_sq = 0;
+        fixed_classify(here.fixed, fixed, fixed_sq);
+      }
+    }
+
+    void here_init(Here &here, const Fix &fix)
+    {
+      /* N.B. The error radius is 3 standard deviations, as in classify() */
+      here.err = 3 * fix.eph;
+
+      here.has_geodesic = false;
+      here.geodesic = Geodesic();
+      fixed_here_init(here.fixed, fix, here.err);
+
+      here.motion = Motion();
+    }
+
+    const Geodesic& here_geodesic(const Here &here, const Fix &fix)
+    {
+      if (!here.has_geodesic) {
+        geodesic_init(here.geodesic, fix.latitude, fix.longitude);
+        here.has_geodesic = true;
+      }
+      return here.geodesic;
+    }
+
+    void motion_init(Here &here, const Fix &fix, const Fix &previous,
+                     double lead_s)
+    {
+      Motion &motion = here.motion;
+      motion.ky = deg2rad(1.0) * LIBSITU_EARTH_RADIUS_m;
+      motion.kx = motion.ky * cos(deg2rad(fix.latitude));
+
+      const double step_s = fix.time - previous.time;
+      motion.has_step = previous.valid && 0 != previous.time &&
+        0 != fix.time && step_s > 0 && step_s <= LIBSITU_STEP_MAX_s &&
+        is_finite(previous.latitude) && is_finite(previous.longitude);
+      if (motion.has_step) {
+        motion.step_x = wrap_longitude(fix.longitude - previous.longitude) *
+          motion.kx;
+        motion.step_y = (fix.latitude - previous.latitude) * motion.ky;
+        motion.step_s = step_s;
+      }
+
+      motion.lead_s = lead_s;
+      motion.has_velocity = lead_s > 0 && fix.has_speed && fix.has_track &&
+        is_finite(fix.speed) && is_finite(fix.track) &&
+        fix.speed >= LIBSITU_MIN_SPEED_m_s;
+      if (motion.has_velocity) {
+        /* N.B. The track is in degrees clockwise from true north */
+        motion.vx = fix.speed * sin(deg2rad(fix.track));
+        motion.vy = fix.speed * cos(deg2rad(fix.track));
+      }
+    }
+
+    bool step_crossing(const Fix &fix, const Here &here, double lat,
+                       double lon, double rad, bool entering, double &t)
+    {
+      const Motion &motion = here.motion;
+      if (!motion.has_step) {
+        return false;
+      }
+      const double x = wrap_longitude(fix.longitude - lon) * motion.kx;
+      const double y = (fix.latitude - lat) * motion.ky;
+      return circle_crossing(x - motion.step_x, y - motion.step_y,
+                             motion.step_x, motion.step_y, rad, entering,
+                             t) &&
+        t >= -1 && t <= 1;
+    }
+
+    void offset_position(const Fix &fix, const Here &here, double x,
+                         double y, double &lat, double &lon)
+    {
+      lat = fix.latitude + y / here.motion.ky;
+      lon = wrap_longitude(fix.longitude + x / here.motion.kx);
+    }
+
+    double arrival_s(const Fix &fix, const Here &here, double lat,
+                     double lon, double rad)
+    {
+      const Motion &motion = here.motion;
+      if (!motion.has_velocity) {
+        return INFINITY;
+      }
+
+      /* N.B. Most watches are out of reach along either axis alone, which
+       * costs no trig */
+      const double reach = rad + 2 * motion.lead_s * fix.speed;
+      const double y = (fix.latitude - lat) * motion.ky;
+      if (fabs(y) > reach) {
+        return INFINITY;
+      }
+      const double x = wrap_longitude(fix.longitude - lon) * motion.kx;
+      if (fabs(x) > reach) {
+        return INFINITY;
+      }
+
+      double t = 0;
+      return circle_crossing(x, y, motion.vx, motion.vy, rad, true, t) &&
+        t >= 0 ? t : INFINITY;
+    }
+
+    bool plane_init(Plane &there, double lat, double lon, double rad)
+    {
+      there.lat = lat;
+      there.lon = lon;
+      there.ky = deg2rad(1.0) * LIBSITU_EARTH_RADIUS_m;
+      there.kx = there.ky * cos(deg2rad(lat));
+
+      const double d = 2 * rad;
+      const double max_error =
+        d * d * fabs(tan(deg2rad(lat))) / (2 * LIBSITU_EARTH_RADIUS_m);
+      return max_error <= LIBSITU_PLANE_MAX_ERROR_m;
+    }
+
+    State plane_classify(
+      const Fix &fix,
+      const Here &here,
+      const Plane &there,
+      double there_rad,
+      double &distance_sq
+    )
+    /* Classify a fix against a watch, in the local tangent plane of the
+     * watch */
+    {
+      double dx = fix.longitude - there.lon;
+      if (dx > 180) {
+        dx -= 360;
+      } else if (dx < -180) {
+        dx += 360;
+      }
+      const double x = dx * there.kx;
+      const double y = (fix.latitude - there.lat) * there.ky;
+      distance_sq = x * x + y * y;
+
+      double error_radius = here.err;
       if (error_radius >= there_rad) {
-        /* It is possible that an unrealistically low watch radius has
-         * been set for the waypoint.
-         *
-         * Equally, the position might be known to a low precision.
-         *
-         * Anyway, we need to avert disaster here. */
+        /* N.B. As in classify() */
         LIBSITU_WARN("Error radius is %f, but watch radius is only %f\n",
                      error_radius, there_rad);
-        /* \todo FIXME: Can we do this in a less arbitrary manner? */
         error_radius = 0.2 * there_rad;
       }
 
-      state =
-        isnan(distance_abs_value) || isnan(error_radius) ? STATE_UNKNOWN :
-        distance_abs_value + error_radius <= there_rad ? STATE_NEAR :
-        distance_abs_value - error_radius > there_rad ? STATE_FAR :
-        /* Failing that, we're not certain */
+      /* N.B. Comparisons with NaN are false, giving STATE_UNKNOWN */
+      const double near = there_rad - error_radius;
+      const double far = there_rad + error_radius;
+      return
+        distance_sq <= near * near ? STATE_NEAR :
+        distance_sq > far * far ? STATE_FAR :
         STATE_UNKNOWN;
+    }
+
+    void fixed_init(FixedThere &there, double lat, double lon, double rad)
+    {
+      /* Centimetres per unit, along a meridian, in Q16 */
+      const double ky = ldexp(deg2rad(1.0) * LIBSITU_EARTH_RADIUS_m * 100 /
+                              LIBSITU_FIXED_UNITS_PER_DEGREE,
+                              LIBSITU_FIXED_SHIFT);
+      const double kx = ky * cos(deg2rad(lat));
+
+      there.lat = static_cast<int32_t>(
+        lround(lat * LIBSITU_FIXED_UNITS_PER_DEGREE));
+      there.lon = static_cast<int32_t>(
+        lround(lon * LIBSITU_FIXED_UNITS_PER_DEGREE));
+      there.ky = static_cast<int32_t>(lround(ky));
+      there.kx = kx < 1 ? 1 : static_cast<int32_t>(lround(kx));
+      there.rad_cm = static_cast<int32_t>(lround(rad * 100));
+
+      /* N.B. After clamping, the error radius is always less than the
+       * watch radius; so beyond twice the radius, a watch is always FAR */
+      const double box_cm = 2 * rad * 100;
+      const double box_lat = ldexp(box_cm, LIBSITU_FIXED_SHIFT) / there.ky;
+      const double box_lon = ldexp(box_cm, LIBSITU_FIXED_SHIFT) / there.kx;
+      there.box_lat = box_lat < INT32_MAX - 1 ?
+        static_cast<int32_t>(box_lat) + 1 : INT32_MAX;
+      there.box_lon = box_lon < INT32_MAX - 1 ?
+        static_cast<int32_t>(box_lon) + 1 : INT32_MAX;
+    }
+
+    void fixed_offset(const FixedHere &here, const FixedThere &there,
+                      int64_t &dx, int64_t &dy)
+    /* Offset from the watch to the fix, in 1e-7 degree units */
+    {
+      static const int64_t half_turn =
+        static_cast<int64_t>(180) * LIBSITU_FIXED_UNITS_PER_DEGREE;
+
+      dy = static_cast<int64_t>(here.lat) - there.lat;
+      dx = static_cast<int64_t>(here.lon) - there.lon;
+      if (dx > half_turn) {
+        dx -= 2 * half_turn;
+      } else if (dx < -half_turn) {
+        dx += 2 * half_turn;
+      }
+    }
+
+    int64_t fixed_distance_sq(int64_t dx, int64_t dy,
+                              const FixedThere &there)
+    /* Squared distance in the local projection, in square centimetres
+     *
+     * N.B. Even for antipodal points, each square is below 2^62 */
+    {
+      const int64_t y = (dy * there.ky) >> LIBSITU_FIXED_SHIFT;
+      const int64_t x = (dx * there.kx) >> LIBSITU_FIXED_SHIFT;
+      return x * x + y * y;
+    }
+
+    State fixed_classify(const FixedHere &here, const FixedThere &there,
+                         int64_t &distance_sq)
+    /* Classify a fix against a watch, using integer arithmetic only */
+    {
+      distance_sq = -1;
+      if (!here.valid) {
+        return STATE_UNKNOWN;
+      }
+
+      int64_t dx = 0;
+      int64_t dy = 0;
+      fixed_offset(here, there, dx, dy);
+      if (dy > there.box_lat || dy < -there.box_lat ||
+          dx > there.box_lon || dx < -there.box_lon) {
+        return STATE_FAR;
+      }
+
+      distance_sq = fixed_distance_sq(dx, dy, there);
+
+      const int64_t rad = there.rad_cm;
+      int64_t err = here.err_cm;
+      if (err >= rad) {
+        /* N.B. As in classify() */
+        LIBSITU_WARN("Error radius is %f, but watch radius is only %f\n",
+                     err / 100.0, rad / 100.0);
+        err = rad / 5;
+      }
+
+      const int64_t near = rad - err;
+      const int64_t far = rad + err;
+      return
+        distance_sq <= near * near ? STATE_NEAR :
+        distance_sq > far * far ? STATE_FAR :
+        STATE_UNKNOWN;
+    }
+
+    int64_t fixed_distance_sq(const FixedHere &here, const FixedThere &there)
+    {
+      int64_t dx = 0;
+      int64_t dy = 0;
+      fixed_offset(here, there, dx, dy);
+      return fixed_distance_sq(dx, dy, there);
+    }
+
+    double fixed_distance(const FixedHere &here, const FixedThere &there)
+    {
+      return sqrt(static_cast<double>(fixed_distance_sq(here, there))) / 100;
+    }
+
+    void fixed_scale_init(FixedScale &scale, const FixedHere &here)
+    {
+      FixedThere there;
+      const double lat =
+        static_cast<double>(here.lat) / LIBSITU_FIXED_UNITS_PER_DEGREE;
+      fixed_init(there, lat, 0, 0);
+      scale.kx = there.kx;
+      scale.ky = there.ky;
+    }
+
+    State fixed_classify(const FixedHere &here, const FixedScale &scale,
+                         int32_t lat, int32_t lon, int32_t rad_cm,
+                         int64_t &distance_sq, int64_t &bound_cm)
+    {
+      distance_sq = -1;
+      bound_cm = 0;
+      if (!here.valid) {
+        return STATE_UNKNOWN;
+      }
+
+      FixedThere there = FixedThere();
+      there.lat = lat;
+      there.lon = lon;
+      int64_t dx = 0;
+      int64_t dy = 0;
+      fixed_offset(here, there, dx, dy);
+
+      /* N.B. As for fixed_classify() above, beyond twice the radius the
+       * watch is always FAR; and each offset is then below 2^49 */
+      const int64_t y = (dy * scale.ky) >> LIBSITU_FIXED_SHIFT;
+      const int64_t x = (dx * scale.kx) >> LIBSITU_FIXED_SHIFT;
+      const int64_t rad = rad_cm;
+      const int64_t ax = x < 0 ? -x : x;
+      const int64_t ay = y < 0 ? -y : y;
+      bound_cm = ax > ay ? ax : ay;
+      if (bound_cm > 2 * rad) {
+        return STATE_FAR;
+      }
+
+      distance_sq = x * x + y * y;
+
+      int64_t err = here.err_cm;
+      if (err >= rad) {
+        LIBSITU_WARN("Error radius is %f, but watch radius is only %f\n",
+                     err / 100.0, rad / 100.0);
+        err = rad / 5;
+      }
+
+      const int64_t near = rad - err;
+      const int64_t far = rad + err;
+      return
+        distance_sq <= near * near ? STATE_NEAR :
+        distance_sq > far * far ? STATE_FAR :
+        STATE_UNKNOWN;
+    }
+
+    void unit_vector(double lat, double lon, double v[3])
+    {
+      const double phi = deg2rad(lat);
+      const double lambda = deg2rad(lon);
+      v[0] = cos(phi) * cos(lambda);
+      v[1] = cos(phi) * sin(lambda);
+      v[2] = sin(phi);
+    }
+
+    double chord_to_distance(double chord)
+    {
+      const double half = chord / 2;
+      return 2 * LIBSITU_EARTH_RADIUS_m * asin(half < 1 ? half : 1);
+    }
+
+    double distance_to_chord(double distance)
+    {
+      const double half_angle = distance / (2 * LIBSITU_EARTH_RADIUS_m);
+      /* N.B. Beyond the antipode, every point is within the distance */
+      return half_angle < acos(0.0) ? 2 * sin(half_angle) : 2;
+    }
+
+    void geodesic_init(Geodesic &point, double lat, double lon)
+    {
+      /* Reduced latitude: tan(U) = (1 - f) tan(lat) */
+      const double tan_u = (1.0 - LIBSITU_WGS84_F) * tan(deg2rad(lat));
+      point.cos_u = 1.0 / sqrt(1.0 + tan_u * tan_u);
+      point.sin_u = tan_u * point.cos_u;
+      point.lon = deg2rad(lon);
+    }
+
+    double geodesic_distance(
+      const Fix &fix,
+      const Geodesic &here,
+      const Geodesic &there,
+      double there_lat,
+      double there_lon,
+      double there_rad,
+      double &lambda,
+      State &state
+    )
+    /* Calculate the distance from here to there on the WGS-84 ellipsoid
+     *
+     * Vincenty's inverse formula; see
+     * http://www.movable-type.co.uk/scripts/latlong-vincenty.html
+     *
+     * The iteration is seeded with the lambda from the previous fix, so
+     * that for a slowly moving receiver it converges in one or two steps.
+     */
+    {
+      static const double b = LIBSITU_WGS84_A_m * (1.0 - LIBSITU_WGS84_F);
+      static const double e2_prime =
+        (LIBSITU_WGS84_A_m * LIBSITU_WGS84_A_m - b * b) / (b * b);
+
+      const double L = there.lon - here.lon;
+      const double sin_u1_sin_u2 = here.sin_u * there.sin_u;
+      const double cos_u1_cos_u2 = here.cos_u * there.cos_u;
+      const double cos_u1_sin_u2 = here.cos_u * there.sin_u;
+      const double sin_u1_cos_u2 = here.sin_u * there.cos_u;
+
+      double lam = is_finite(lambda) ? lambda : L;
+      double sin_sigma = 0;
+      double cos_sigma = 1;
+      double sigma = 0;
+      double cos_sq_alpha = 1;
+      double cos_2sigma_m = 0;
+      bool converged = false;
+      for (int i = 0; i < LIBSITU_VINCENTY_MAX_ITERATIONS; ++i) {
+        const double sin_lam = sin(lam);
+        const double cos_lam = cos(lam);
+        const double p = there.cos_u * sin_lam;
+        const double q = cos_u1_sin_u2 - sin_u1_cos_u2 * cos_lam;
+        sin_sigma = sqrt(p * p + q * q);
+        if (0 == sin_sigma) {
+          /* Coincident points */
+          cos_sigma = 1;
+          sigma = 0;
+          converged = true;
+          break;
+        }
+        cos_sigma = sin_u1_sin_u2 + cos_u1_cos_u2 * cos_lam;
+        sigma = atan2(sin_sigma, cos_sigma);
+        const double sin_alpha = cos_u1_cos_u2 * sin_lam / sin_sigma;
+        cos_sq_alpha = 1 - sin_alpha * sin_alpha;
+        /* N.B. Equatorial line: cos_sq_alpha is zero */
+        cos_2sigma_m = 0 == cos_sq_alpha ? 0 :
+          cos_sigma - 2 * sin_u1_sin_u2 / cos_sq_alpha;
+        const double C = LIBSITU_WGS84_F / 16 * cos_sq_alpha *
+          (4 + LIBSITU_WGS84_F * (4 - 3 * cos_sq_alpha));
+        const double prev = lam;
+        lam = L + (1 - C) * LIBSITU_WGS84_F * sin_alpha *
+          (sigma + C * sin_sigma *
+           (cos_2sigma_m + C * cos_sigma *
+            (-1 + 2 * cos_2sigma_m * cos_2sigma_m)));
+        if (fabs(lam - prev) < LIBSITU_VINCENTY_TOLERANCE) {
+          converged = true;
+          break;
+        }
+      }
+
+      if (!converged) {
+        /* Nearly antipodal points; fall back to the spherical model */
+        LIBSITU_DBG("Geodesic failed to converge\n");
+        lambda = L;
+        return distance(fix, there_lat, there_lon, there_rad, state);
+      }
+      lambda = lam;
+
+      const double u_sq = cos_sq_alpha * e2_prime;
+      const double A = 1 + u_sq / 16384 *
+        (4096 + u_sq * (-768 + u_sq * (320 - 175 * u_sq)));
+      const double B = u_sq / 1024 *
+        (256 + u_sq * (-128 + u_sq * (74 - 47 * u_sq)));
+      const double delta_sigma = B * sin_sigma *
+        (cos_2sigma_m + B / 4 *
+         (cos_sigma * (-1 + 2 * cos_2sigma_m * cos_2sigma_m) -
+          B / 6 * cos_2sigma_m * (-3 + 4 * sin_sigma * sin_sigma) *
+          (-3 + 4 * cos_2sigma_m * cos_2sigma_m)));
+
+      const double distance_val = b * A * (sigma - delta_sigma);
+
+      state = classify(fix, distance_val, there_rad);
 
       return distance_val;
     }
@@ -20,9 +20,12 @@
 #ifndef _LIBSITU_GPSMATH_H_
 #define _LIBSITU_GPSMATH_H_
 
-namespace libsitu {
+#include <stdint.h>
+
+/* N.B. for definitions of Fix and Precision */
+#include <libsitu.h>
 
-  struct Fix;
+namespace libsitu {
 
   namespace Math {
 
@@ -32,12 +35,179 @@ namespace libsitu {
       STATE_NEAR = 2
     } State;
 
+    /* Ellipsoid terms for one end of a geodesic, computed once per point */
+    struct Geodesic {
+      double lon; /* Longitude, in radians */
+      double sin_u; /* Sine of the reduced latitude */
+      double cos_u; /* Cosine of the reduced latitude */
+    };
+
+    /* Fix-side fixed-point terms: 1e-7 degree coordinates, and the
+     * horizontal error radius in centimetres */
+    struct FixedHere {
+      bool valid;
+      int32_t lat;
+      int32_t lon;
+      int32_t err_cm;
+    };
+
+    /* Watch-side fixed-point terms: a local projection, scaling 1e-7
+     * degree offsets to centimetres (Q16), and a bounding box outside of
+     * which the watch is certainly FAR */
+    struct FixedThere {
+      int32_t lat;
+      int32_t lon;
+      int32_t kx;
+      int32_t ky;
+      int32_t box_lat;
+      int32_t box_lon;
+      int32_t rad_cm;
+    };
+
+    /* Watch-side local tangent plane: meters per degree along each axis */
+    struct Plane {
+      double lat;
+      double lon;
+      double kx;
+      double ky;
+    };
+
+    /* Fix-side motion terms, for interpolating and predicting boundary
+     * crossings, in the local tangent plane at the fix */
+    struct Motion {
+      double kx; /* Meters per degree of longitude */
+      double ky; /* Meters per degree of latitude */
+      bool has_step;
+      double step_x; /* Offset from the previous fix, in meters east */
+      double step_y; /* Offset from the previous fix, in meters north */
+      double step_s; /* Time since the previous fix, in seconds */
+      bool has_velocity;
+      double vx; /* Velocity, in meters per second east */
+      double vy; /* Velocity, in meters per second north */
+      double lead_s; /* Prediction lead time, or 0 if not predicting */
+    };
+
+    /* Fix-side terms, computed once per fix and shared by all watches */
+    struct Here {
+      double err; /* Error radius, in meters */
+      /* N.B. Only ellipsoidal watches need the geodesic terms, so they are
+       * computed on first use; see here_geodesic() */
+      mutable bool has_geodesic;
+      mutable Geodesic geodesic;
+      FixedHere fixed;
+      Motion motion;
+    };
+
+    /* N.B. Without motion terms; see motion_init() */
+    void here_init(Here &here, const Fix &fix);
+
+    /* Geodesic terms of the fix, computed on the first call for a fix */
+    const Geodesic& here_geodesic(const Here &here, const Fix &fix);
+
+    /* N.B. The previous fix is used only if valid, with a GPS time up to
+     * a few seconds before that of the fix */
+    void motion_init(Here &here, const Fix &fix, const Fix &previous,
+                     double lead_s);
+
+    /* Fraction of the step from the previous fix to the fix at which the
+     * straight path between them enters (or leaves) a circle; from -1,
+     * extrapolating back by up to a step, to 1. False if there is no step,
+     * or no such crossing */
+    bool step_crossing(const Fix &fix, const Here &here, double lat,
+                       double lon, double rad, bool entering, double &t);
+
+    /* Position at an offset from the fix, in meters east and north */
+    void offset_position(const Fix &fix, const Here &here, double x,
+                         double y, double &lat, double &lon);
+
+    /* Seconds until the receiver, continuing along its track at its
+     * speed, enters a circle; INFINITY if it does not, or is not in reach
+     * of it within twice the lead time */
+    double arrival_s(const Fix &fix, const Here &here, double lat,
+                     double lon, double rad);
+
+    /* Distance and RMS calculations, instantiated per numeric policy */
+    typedef double (*DistanceFunction)(const Fix &fix,
+                                       double there_lat, double there_lon,
+                                       double there_rad, State &state);
+    typedef bool (*RmsFunction)(double x, double y, double &rms);
+
+    bool has_precision(Precision precision);
+    DistanceFunction distance_function(Precision precision);
+    RmsFunction rms_function(Precision precision);
+
+    /* N.B. These use the default numeric policy */
     bool calculate_rms(double x, double y, double &rms);
 
     double distance(const Fix &fix,
                     double there_lat, double there_lon, double there_rad,
                     State &state);
 
+    void geodesic_init(Geodesic &point, double lat, double lon);
+
+    /* N.B. lambda seeds the iterative solver, and is updated with the
+     * converged value; pass NaN where there is no previous solution */
+    double geodesic_distance(const Fix &fix,
+                             const Geodesic &here, const Geodesic &there,
+                             double there_lat, double there_lon,
+                             double there_rad, double &lambda,
+                             State &state);
+
+    /* N.B. Returns false where the plane would not be accurate enough for
+     * the watch radius, at the watch latitude */
+    bool plane_init(Plane &there, double lat, double lon, double rad);
+
+    /* N.B. No trig and no square root; distance_sq is in square meters */
+    State plane_classify(const Fix &fix, const Here &here,
+                         const Plane &there, double there_rad,
+                         double &distance_sq);
+
+    void fixed_init(FixedThere &there, double lat, double lon, double rad);
+
+    /* N.B. No floating point arithmetic; distance_sq is in square
+     * centimetres, or negative beyond the bounding box of the watch */
+    State fixed_classify(const FixedHere &here, const FixedThere &there,
+                         int64_t &distance_sq);
+
+    /* Squared distance in square centimetres, in the local projection of
+     * the watch */
+    int64_t fixed_distance_sq(const FixedHere &here, const FixedThere &there);
+
+    /* Distance in meters, in the local projection of the watch */
+    double fixed_distance(const FixedHere &here, const FixedThere &there);
+
+    /* Fix-side projection scales, for watches that keep no terms of their
+     * own: centimetres per 1e-7 degree unit (Q16), at the latitude of the
+     * fix rather than of the watch, which for watches of up to 10km
+     * radius below 70 degrees of latitude moves the boundary by under 1% */
+    struct FixedScale {
+      int32_t kx;
+      int32_t ky;
+    };
+
+    void fixed_scale_init(FixedScale &scale, const FixedHere &here);
+
+    /* N.B. No floating point arithmetic; distance_sq is in square
+     * centimetres, or negative if the watch is certainly FAR, with a lower
+     * bound on its distance from the fix in bound_cm */
+    State fixed_classify(const FixedHere &here, const FixedScale &scale,
+                         int32_t lat, int32_t lon, int32_t rad_cm,
+                         int64_t &distance_sq, int64_t &bound_cm);
+
+    /* Unit vector of a point on the sphere. The chord length between two
+     * unit vectors is monotonic in the great circle distance */
+    void unit_vector(double lat, double lon, double v[3]);
+
+    /* Conversions between chord length, on the unit sphere, and great
+     * circle distance in meters */
+    double chord_to_distance(double chord);
+    double distance_to_chord(double distance);
+
+    /* Exercise every numeric policy once on the calling thread, so that
+     * lazily allocated library state is allocated before the first fix;
+     * where MPFR is available, this also claims the thread's pool for
+     * MPFR's temporaries */
+    void warm_up();
 
     bool is_finite(double x);
 
@@ -23,6 +23,8 @@
 #include <time.h>
 
 #include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
 
 #include <gps.h>
 #include <libgpsmm.h>
@@ -30,11 +32,21 @@
 #include <gpsdebug.h>
 #include <libsitu.h>
 #include <gpsmath.h>
+#include <gpspoller.h>
+#include <gpstrace.h>
+
+/* Reconnection backoff bounds */
+#define LIBSITU_RECONNECT_MIN_us 250000
+#define LIBSITU_RECONNECT_MAX_us 30000000
+
+/* Longest sleep during which a cancellation is deferred */
+#define LIBSITU_SLEEP_SLICE_us 100000
 
 namespace libsitu {
 
   bool parse_raw_gps_data(
     const gps_data_t *gps_data,
+    Math::RmsFunction calculate_rms,
     Fix &data
   )
   /* Parse the specified raw GPS data, and populate the specified data
@@ -82,15 +94,19 @@ namespace libsitu {
 
                     /* N.B. Calculate the RMS horizontal positional error. */
                     double eph = 0;
-                    if (!Math::calculate_rms(gps_data->fix.epx,
-                                             gps_data->fix.epy,
-                                             eph)) {
+                    if (!(*calculate_rms)(gps_data->fix.epx,
+                                          gps_data->fix.epy,
+                                          eph)) {
                       LIBSITU_WARN("Failed to calculate RMS horizontal position error\n");
                     } else {
                       data.latitude = gps_data->fix.latitude;
                       data.longitude = gps_data->fix.longitude;
                       data.eph = eph;
                       data.satellites_used = gps_data->satellites_used;
+                      if ((gps_data->set & TIME_SET) &&
+                          Math::is_finite(gps_data->fix.time)) {
+                        data.time = gps_data->fix.time;
+                      }
                       if ((gps_data->set & SPEED_SET) &&
                           (gps_data->set & SPEEDERR_SET)) {
                         data.has_speed = true;
@@ -137,78 +153,393 @@ namespace libsitu {
     return data.valid;
   }
 
+  namespace {
+
+    int sleep_us(int duration_us, sem_t *wake = NULL)
+    /* Sleep, in slices, so that a cancellation during a long sleep is
+     * acted upon promptly; and, given a semaphore, until it is posted
+     *
+     * Returns the time slept, in microseconds
+     */
+    {
+      int slept_us = 0;
+      while (slept_us < duration_us) {
+        const int remaining_us = duration_us - slept_us;
+        const int slice_us = remaining_us < LIBSITU_SLEEP_SLICE_us ?
+          remaining_us : LIBSITU_SLEEP_SLICE_us;
+        bool woken = false;
+
+        if (0 != pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, NULL)) {
+          LIBSITU_WARN("Failed to set thread cancel state\n");
+        }
+        /* N.B. We can use sleep() here without the parenthetical
+         * disabling of thread cancellation.
+         *
+         * However, the disable is required in order to use usleep or
+         * nanosleep. If the thread is cancelled while we are in a
+         * usleep or nanosleep call, we get a segfault.
+         *
+         * This seems odd, because all of sleep, usleep and nanosleep
+         * are meant to be thread cancellation points.
+         *
+         * Anyway, it doesn't matter: just do the parenthetical thread
+         * cancellation disable, and all is well.
+         */
+        struct timespec deadline;
+        if (NULL != wake && 0 == clock_gettime(CLOCK_REALTIME, &deadline)) {
+          deadline.tv_sec += slice_us / 1000000;
+          deadline.tv_nsec += 1000 * (slice_us % 1000000);
+          if (deadline.tv_nsec >= 1000000000) {
+            deadline.tv_sec += 1;
+            deadline.tv_nsec -= 1000000000;
+          }
+          int status = 0;
+          do {
+            status = sem_timedwait(wake, &deadline);
+          } while (0 != status && EINTR == errno);
+          woken = 0 == status;
+        } else {
+          struct timespec req;
+          req.tv_sec = slice_us / 1000000;
+          req.tv_nsec = 1000 * (slice_us % 1000000);
+          if (0 != nanosleep(&req, NULL)) {
+            perror("nanosleep");
+          }
+        }
+
+        if (0 != pthread_setcancelstate(PTHREAD_CANCEL_ENABLE, NULL)) {
+          LIBSITU_WARN("Failed to set thread cancel state\n");
+        }
+        pthread_testcancel();
+
+        if (woken) {
+          break;
+        }
+        slept_us += slice_us;
+      }
+      return slept_us;
+    }
+
+    bool open_interface(gpsmm &gps_interface, bool shm, int &fd)
+    /* Start reading from a newly constructed interface, and get the
+     * socket to read from, if any
+     *
+     * Returns true on success
+     */
+    {
+      fd = -1;
+      if (shm) {
+        if (!gps_interface.is_open()) {
+          LIBSITU_DBG("Failed to attach to GPS shared memory: %d, %s\n",
+                      errno, gps_errstr(errno));
+          return false;
+        }
+      } else {
+        const struct gps_data_t *gps_data =
+          gps_interface.stream(WATCH_ENABLE|WATCH_JSON);
+        if (NULL == gps_data) {
+          LIBSITU_DBG("Failed to start GPS stream: %d, %s\n",
+                      errno, gps_errstr(errno));
+          return false;
+        }
+        fd = gps_data->gps_fd;
+      }
+      return true;
+    }
+
+    unsigned message_class(const char *message)
+    /* Get the class of a gpsd JSON message, without decoding it
+     *
+     * N.B. gpsd always writes the class first */
+    {
+      static const char prefix[] = "{\"class\":\"";
+      if (0 != strncmp(message, prefix, sizeof(prefix) - 1)) {
+        return MESSAGE_OTHER;
+      }
+      const char *name = message + sizeof(prefix) - 1;
+      if (0 == strncmp(name, "TPV\"", 4)) {
+        return MESSAGE_TPV;
+      } else if (0 == strncmp(name, "SKY\"", 4)) {
+        return MESSAGE_SKY;
+      } else if (0 == strncmp(name, "GST\"", 4)) {
+        return MESSAGE_GST;
+      } else if (0 == strncmp(name, "DEVICE\"", 7) ||
+                 0 == strncmp(name, "DEVICES\"", 8)) {
+        return MESSAGE_DEVICE;
+      }
+      return MESSAGE_OTHER;
+    }
+
+  }
+
+  MessageReader::MessageReader()
+    : m_data(new gps_data_t()),
+      m_buffer(),
+      m_start(0),
+      m_used(0)
+  {
+  }
+
+  MessageReader::~MessageReader()
+  {
+    delete m_data;
+  }
+
+  bool MessageReader::fill(int fd)
+  {
+    if (0 != m_start) {
+      memmove(m_buffer, m_buffer + m_start, m_used - m_start);
+      m_used -= m_start;
+      m_start = 0;
+    }
+    if (sizeof(m_buffer) - 1 == m_used) {
+      LIBSITU_WARN("Discarding overlong gpsd message\n");
+      m_used = 0;
+    }
+
+    const ssize_t count =
+      ::read(fd, m_buffer + m_used, sizeof(m_buffer) - 1 - m_used);
+    if (count > 0) {
+      m_used += count;
+      return true;
+    } else if (0 == count) {
+      /* N.B. gpsd has closed the socket */
+      return false;
+    }
+    /* N.B. No complete message yet is not a lost connection */
+    return EINTR == errno || EAGAIN == errno || EWOULDBLOCK == errno;
+  }
+
+  char* MessageReader::next(size_t &length)
+  {
+    char *message = m_buffer + m_start;
+    char *end = static_cast<char*>(memchr(message, '\n', m_used - m_start));
+    if (NULL == end) {
+      return NULL;
+    }
+    *end = '\0';
+    length = end + 1 - message;
+    m_start += length;
+    return message;
+  }
+
+  gps_data_t* MessageReader::data()
+  {
+    return m_data;
+  }
+
+  namespace {
+
+    void parse_message(Gps *context, const gps_data_t *gps_data,
+                       int64_t read_ns, Fix &fix, bool &have_fix)
+    /* Parse a decoded message, keeping the fix if it is valid */
+    {
+      Fix parsed;
+      LIBSITU_TRACE_BEGIN("parse");
+      const bool valid = parse_raw_gps_data(
+        gps_data,
+        Math::rms_function(context->get_precision()),
+        parsed);
+      LIBSITU_TRACE_END("parse", valid);
+      if (valid) {
+        parsed.read_ns = read_ns;
+        fix = parsed;
+        have_fix = true;
+      } else {
+        LIBSITU_DBGV("Failed to parse raw GPS data\n");
+      }
+    }
+
+    struct MessageCounts {
+      unsigned long messages;
+      unsigned long bytes;
+      unsigned long dropped[MESSAGE_CLASSES];
+    };
+
+    bool read_messages(Gps *context, gpsmm &gps_interface,
+                       MessageReader &reader, int fd, Fix &fix,
+                       bool &have_fix, MessageCounts &counts)
+    /* Read the messages queued on the socket, dropping those of the
+     * classes not wanted before libgps decodes them, and parse the rest,
+     * keeping the most recent valid fix
+     *
+     * Returns false if the connection is lost
+     */
+    {
+      const unsigned wanted = context->get_messages();
+      memset(&counts, 0, sizeof(counts));
+      bool open = true;
+      do {
+        LIBSITU_TRACE_BEGIN("read");
+        open = reader.fill(fd);
+        const int64_t read_ns = Util::monotonic_ns();
+        LIBSITU_TRACE_END("read", open);
+        if (!open) {
+          /* N.B. gpsd has closed the socket, or it failed */
+          LIBSITU_DBG("Failed to read from gpsd: %d, %s\n",
+                      errno, strerror(errno));
+          break;
+        }
+
+        size_t length = 0;
+        for (char *message = reader.next(length);
+             NULL != message; message = reader.next(length)) {
+          ++counts.messages;
+          counts.bytes += length;
+          const unsigned type = message_class(message);
+          if (0 == (wanted & type)) {
+            ++counts.dropped[__builtin_ctz(type)];
+            continue;
+          }
+          gps_data_t *gps_data = reader.data();
+          gps_data->set = 0;
+          if (0 != gps_unpack(message, gps_data)) {
+            LIBSITU_DBGV("Failed to decode GPS data\n");
+            continue;
+          }
+          gps_data->set |= PACKET_SET;
+          parse_message(context, gps_data, read_ns, fix, have_fix);
+        }
+      } while (gps_interface.waiting(0));
+
+      return open;
+    }
+
+  }
+
   void* poller(void *arg)
   {
     if (NULL == arg) {
       LIBSITU_WARN("Null poll data\n");
     } else {
       Gps *context = static_cast<Gps*>(arg);
-      if (NULL == context->get_host() || NULL == context->get_port()) {
+      const bool shm = TRANSPORT_SHM == context->get_transport();
+      if (!shm &&
+          (NULL == context->get_host() || NULL == context->get_port())) {
         LIBSITU_WARN("Host and/or port unknown\n");
       } else {
-        LIBSITU_DBG("Opening interface %s:%s\n",
-                    context->get_host(), context->get_port());
-        gpsmm gps_interface(context->get_host(), context->get_port());
-        if (NULL == gps_interface.stream(WATCH_ENABLE|WATCH_JSON)) {
-          LIBSITU_WARN("Failed to start GPS stream: %d, %s\n",
-                       errno, gps_errstr(errno));
-        } else {
 
-          LIBSITU_DBG("Entering GPS poll loop (%dus)\n",
-                      context->get_poll_us());
-          while (true) {
-            if (gps_interface.waiting(context->get_poll_us())) {
-              const struct gps_data_t *gps_data = gps_interface.read();
-              if (NULL == gps_data) {
-                LIBSITU_WARN("Null GPS data from interface: %d, %s\n",
-                             errno, gps_errstr(errno));
-              } else {
-                Fix fix;
-                if (parse_raw_gps_data(gps_data, fix)) {
-                  /* Call back */
-                  LIBSITU_DBGV("Calling back...\n");
-                  context->handle_poll_fix(fix);
+        /* N.B. Allocate any lazily allocated library state now, rather
+         * than when processing the first fix */
+        Math::warm_up();
+        LIBSITU_TRACE_THREAD("libsitu poller");
+
+        /* N.B. Seeded per instance, so that devices restarted together do
+         * not reconnect in step */
+        unsigned int seed = time(NULL) ^ reinterpret_cast<uintptr_t>(context);
+        int backoff_us = LIBSITU_RECONNECT_MIN_us;
+        unsigned failures = 0;
+        while (true) {
+          if (shm) {
+            LIBSITU_DBG("Attaching to shared memory\n");
+          } else {
+            LIBSITU_DBG("Opening interface %s:%s\n",
+                        context->get_host(), context->get_port());
+          }
+          {
+            /* N.B. libgps attaches to the shared memory export when given
+             * its pseudo host name */
+            gpsmm gps_interface(shm ? GPSD_SHARED_MEMORY : context->get_host(),
+                                shm ? NULL : context->get_port());
+            int fd = -1;
+            if (open_interface(gps_interface, shm, fd)) {
+              LIBSITU_TRACE_INSTANT("connected", 0);
+              context->handle_poll_connection(CONNECTION_CONNECTED);
+              backoff_us = LIBSITU_RECONNECT_MIN_us;
+              failures = 0;
+
+              /* N.B. libgps busy-waits for a shared memory update, so
+               * sample the segment without waiting, and count the time
+               * since the last update towards the poll timeout instead */
+              const int wait_us = shm ? 0 : context->get_poll_us();
+              int stale_us = 0;
+              bool lost = false;
+              MessageReader reader;
+
+              LIBSITU_DBG("Entering GPS poll loop (%dus)\n",
+                          context->get_poll_us());
+              while (!lost) {
+                LIBSITU_TRACE_BEGIN("wait");
+                const bool ready = gps_interface.waiting(wait_us);
+                LIBSITU_TRACE_END("wait", ready);
+                if (ready) {
+                  stale_us = 0;
+
+                  /* N.B. Messages queue up while we sleep, so read them
+                   * all, and process only the most recent fix */
+                  Fix fix = Fix();
+                  bool have_fix = false;
+                  if (shm) {
+                    do {
+                      LIBSITU_TRACE_BEGIN("read");
+                      const struct gps_data_t *gps_data =
+                        gps_interface.read();
+                      const int64_t read_ns = Util::monotonic_ns();
+                      LIBSITU_TRACE_END("read", NULL != gps_data);
+                      if (NULL == gps_data) {
+                        /* N.B. gpsd was part way through an update */
+                        LIBSITU_DBGV("Inconsistent GPS shared memory\n");
+                        break;
+                      }
+                      parse_message(context, gps_data, read_ns, fix,
+                                    have_fix);
+                    } while (gps_interface.waiting(0));
+                  } else {
+                    MessageCounts counts;
+                    lost = !read_messages(context, gps_interface, reader, fd,
+                                          fix, have_fix, counts);
+                    context->handle_poll_messages(counts.messages,
+                                                  counts.bytes,
+                                                  counts.dropped);
+                  }
+
+                  if (have_fix) {
+                    /* Call back */
+                    LIBSITU_DBGV("Calling back...\n");
+                    context->handle_poll_fix(fix);
+                  }
+                } else if (shm && stale_us < context->get_poll_us()) {
+                  /* N.B. No update since the last shared memory sample */
                 } else {
-                  LIBSITU_DBGV("Failed to parse raw GPS data\n");
+                  LIBSITU_DBGV("Timeout\n");
+                  LIBSITU_TRACE_INSTANT("timeout", stale_us);
+                  stale_us = 0;
+                  context->handle_poll_timeout();
                 }
-              }
-            } else {
-              LIBSITU_DBGV("Timeout\n");
-              context->handle_poll_timeout();
-            }
 
-            {
-              if (0 != pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, NULL)) {
-                LIBSITU_WARN("Failed to set thread cancel state\n");
-              }
-              /* N.B. We can use sleep() here without the parenthetical
-               * disabling of thread cancellation.
-               *
-               * However, the disable is required in order to use usleep or
-               * nanosleep. If the thread is cancelled while we are in a
-               * usleep or nanosleep call, we get a segfault.
-               *
-               * This seems odd, because all of sleep, usleep and nanosleep
-               * are meant to be thread cancellation points.
-               *
-               * Anyway, it doesn't matter: just do the parenthetical thread
-               * cancellation disable, and all is well.
-               */
-              {
-                struct timespec req;
-                req.tv_sec = context->get_sleep_us() / 1000000;
-                req.tv_nsec = 1000 * (context->get_sleep_us() % 1000000);
-                if (0 != nanosleep(&req, NULL)) {
-                  perror("nanosleep");
+                if (!lost) {
+                  const int duration_us = context->handle_poll_sleep();
+                  LIBSITU_TRACE_BEGIN("sleep");
+                  /* N.B. Woken early if the watches or the schedule
+                   * change */
+                  const int slept_us =
+                    sleep_us(duration_us, &context->m_reschedule);
+                  LIBSITU_TRACE_END("sleep", slept_us);
+                  if (shm && stale_us < context->get_poll_us()) {
+                    stale_us += slept_us;
+                  }
                 }
               }
 
-              if (0 != pthread_setcancelstate(PTHREAD_CANCEL_ENABLE, NULL)) {
-                LIBSITU_WARN("Failed to set thread cancel state\n");
-              }
+              LIBSITU_WARN("Lost connection to gpsd, reconnecting\n");
+              LIBSITU_TRACE_INSTANT("disconnected", 0);
+              context->handle_poll_connection(CONNECTION_DISCONNECTED);
+            } else if (1 == ++failures) {
+              /* N.B. Only warn once, while gpsd is unavailable */
+              LIBSITU_WARN("Failed to connect to gpsd, retrying\n");
             }
           }
 
+          /* Back off exponentially, sleeping for a random time between
+           * half and all of the backoff time */
+          const int delay_us =
+            backoff_us / 2 + rand_r(&seed) % (backoff_us / 2 + 1);
+          LIBSITU_DBG("Reconnecting in %dus\n", delay_us);
+          LIBSITU_TRACE_BEGIN("backoff");
+          sleep_us(delay_us);
+          LIBSITU_TRACE_END("backoff", delay_us);
+          backoff_us = backoff_us < LIBSITU_RECONNECT_MAX_us / 2 ?
+            2 * backoff_us : LIBSITU_RECONNECT_MAX_us;
         }
       }
     }
@@ -216,4 +547,91 @@ namespace libsitu {
     return NULL;
   }
 
+  Session::Session(Gps *context)
+    : m_context(context),
+      m_interface(NULL),
+      m_reader(NULL),
+      m_fd(-1)
+  {
+  }
+
+  Session::~Session()
+  {
+    /* N.B. The Gps is being destroyed, so is not told */
+    delete m_reader;
+    delete m_interface;
+  }
+
+  int Session::get_fd()
+  {
+    if (-1 != m_fd) {
+      return m_fd;
+    }
+    if (TRANSPORT_SOCKET != m_context->get_transport()) {
+      LIBSITU_WARN("External polling needs the socket transport\n");
+      return -1;
+    }
+    if (NULL == m_context->get_host() || NULL == m_context->get_port()) {
+      LIBSITU_WARN("Host and/or port unknown\n");
+      return -1;
+    }
+
+    LIBSITU_DBG("Opening interface %s:%s\n",
+                m_context->get_host(), m_context->get_port());
+    m_interface = new gpsmm(m_context->get_host(), m_context->get_port());
+    int fd = -1;
+    if (!open_interface(*m_interface, false, fd) ||
+        -1 == fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK)) {
+      LIBSITU_DBG("Failed to connect to gpsd\n");
+      delete m_interface;
+      m_interface = NULL;
+      return -1;
+    }
+
+    m_reader = new MessageReader();
+    m_fd = fd;
+    LIBSITU_TRACE_INSTANT("connected", 0);
+    m_context->handle_poll_connection(CONNECTION_CONNECTED);
+    return m_fd;
+  }
+
+  bool Session::process_ready()
+  {
+    if (-1 == m_fd) {
+      return false;
+    }
+
+    Fix fix = Fix();
+    bool have_fix = false;
+    MessageCounts counts;
+    const bool open = read_messages(m_context, *m_interface, *m_reader, m_fd,
+                                    fix, have_fix, counts);
+    m_context->handle_poll_messages(counts.messages, counts.bytes,
+                                    counts.dropped);
+    if (have_fix) {
+      m_context->handle_poll_fix(fix);
+    }
+
+    if (!open) {
+      LIBSITU_WARN("Lost connection to gpsd\n");
+      disconnect();
+    }
+    return open;
+  }
+
+  void Session::disconnect()
+  {
+    if (-1 == m_fd) {
+      return;
+    }
+
+    delete m_reader;
+    m_reader = NULL;
+    delete m_interface;
+    m_interface = NULL;
+    m_fd = -1;
+    LIBSITU_TRACE_INSTANT("disconnected", 0);
+    m_context->handle_poll_connection(CONNECTION_DISCONNECTED);
+  }
+
 }
@@ -0,0 +1,98 @@
+/*
+  Copyright 2013-2014 Simon Dawson
+
+  This file is part of libsitu.
+
+  libsitu is free software: you can redistribute it and/or modify
+  it under the terms of the GNU Lesser General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  libsitu is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU Lesser General Public License for more details.
+
+  You should have received a copy of the GNU Lesser General Public License
+  along with libsitu.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef _LIBSITU_GPSPOLLER_H_
+#define _LIBSITU_GPSPOLLER_H_
+
+#include <stddef.h>
+
+/* N.B. for definition of Gps */
+#include <libsitu.h>
+
+/* Read buffer for gpsd messages; longer messages are discarded */
+#define LIBSITU_MESSAGE_BUFFER 16384
+
+class gpsmm;
+struct gps_data_t;
+
+namespace libsitu {
+
+  /* Reads gpsd JSON messages from the socket, a line at a time, so that
+   * each can be filtered by class before libgps decodes it
+   *
+   * N.B. The decoded data persists from message to message, as it does
+   * within libgps: a TPV message, for instance, leaves the satellite
+   * counts of the last SKY message in place.
+   */
+  class MessageReader {
+  public:
+    MessageReader();
+    ~MessageReader();
+
+    /* N.B. Reads what is available from the socket, keeping any partial
+     * message for the next fill; false only at end of file, or on a read
+     * error, when the connection is lost */
+    bool fill(int fd);
+    /* N.B. The next complete message, NUL terminated in place, and its
+     * length on the wire; or NULL, if there is none */
+    char* next(size_t &length);
+    gps_data_t* data();
+
+  private:
+    MessageReader(const MessageReader&);
+    MessageReader& operator=(const MessageReader&);
+
+    gps_data_t *m_data;
+    char m_buffer[LIBSITU_MESSAGE_BUFFER];
+    size_t m_start;
+    size_t m_used;
+  };
+
+  /* A connection to gpsd, for a Gps without a poller thread (see
+   * POLLING_EXTERNAL), read when the application finds its socket
+   * readable
+   *
+   * The socket is non-blocking, so that a spurious readiness does not
+   * block the application's event loop.
+   */
+  class Session {
+  public:
+    explicit Session(Gps *context);
+    ~Session();
+
+    /* N.B. Connects, if need be; -1 if that fails */
+    int get_fd();
+    /* N.B. False if the connection is lost, whereupon it is closed */
+    bool process_ready();
+
+  private:
+    Session(const Session&);
+    Session& operator=(const Session&);
+
+    void disconnect();
+
+    Gps *m_context;
+    gpsmm *m_interface;
+    MessageReader *m_reader;
+    int m_fd;
+  };
+
+}
+
+#endif
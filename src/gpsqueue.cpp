@@ -0,0 +1,361 @@
+/*
+  Copyright 2013-2014 Simon Dawson
+
+  This file is part of libsitu.
+
+  libsitu is free software: you can redistribute it and/or modify
+  it under the terms of the GNU Lesser General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  libsitu is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU Lesser General Public License for more details.
+
+  You should have received a copy of the GNU Lesser General Public License
+  along with libsitu.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <errno.h>
+#include <time.h>
+
+#include <gpsdebug.h>
+#include <gpsqueue.h>
+
+namespace libsitu {
+
+  NotificationQueue::NotificationQueue(size_t capacity, Overflow overflow,
+                                       unsigned types)
+    : m_slots(),
+      m_held(),
+      m_mask(0),
+      m_enqueue_pos(0),
+      m_dequeue_pos(0),
+      m_overflow(overflow),
+      m_types(types),
+      m_dropped(0),
+      m_closed(false),
+      m_items(),
+      m_space(),
+      m_next(NULL),
+      m_next_held(NULL),
+      m_armed(NULL)
+  {
+    size_t size = 2;
+    while (size < capacity) {
+      size *= 2;
+    }
+    m_slots.resize(size);
+    m_mask = size - 1;
+    for (size_t i = 0; i < size; ++i) {
+      m_slots[i].sequence = i;
+    }
+    /* N.B. So that holding the notifications of a fix does not allocate,
+     * unless it raises more than a queue's worth */
+    if (OVERFLOW_BLOCK == overflow) {
+      m_held.reserve(size);
+    }
+
+    if (0 != sem_init(&m_items, 0, 0) || 0 != sem_init(&m_space, 0, 0)) {
+      LIBSITU_WARN("Failed to initialise notification semaphores\n");
+    }
+  }
+
+  NotificationQueue::~NotificationQueue()
+  {
+    sem_destroy(&m_items);
+    sem_destroy(&m_space);
+  }
+
+  bool NotificationQueue::try_push(const Notification &notification)
+  {
+    uint64_t pos = __atomic_load_n(&m_enqueue_pos, __ATOMIC_RELAXED);
+    for (;;) {
+      Slot &slot = m_slots[pos & m_mask];
+      const uint64_t sequence =
+        __atomic_load_n(&slot.sequence, __ATOMIC_ACQUIRE);
+      const int64_t lag = static_cast<int64_t>(sequence - pos);
+      if (0 == lag) {
+        if (__atomic_compare_exchange_n(&m_enqueue_pos, &pos, pos + 1, true,
+                                        __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+          slot.notification = notification;
+          __atomic_store_n(&slot.sequence, pos + 1, __ATOMIC_RELEASE);
+          return true;
+        }
+      } else if (lag < 0) {
+        return false;
+      } else {
+        pos = __atomic_load_n(&m_enqueue_pos, __ATOMIC_RELAXED);
+      }
+    }
+  }
+
+  bool NotificationQueue::try_pop(Notification *notification)
+  /* Remove the oldest notification, if any, copying it unless NULL */
+  {
+    uint64_t pos = __atomic_load_n(&m_dequeue_pos, __ATOMIC_RELAXED);
+    for (;;) {
+      Slot &slot = m_slots[pos & m_mask];
+      const uint64_t sequence =
+        __atomic_load_n(&slot.sequence, __ATOMIC_ACQUIRE);
+      const int64_t lag = static_cast<int64_t>(sequence - (pos + 1));
+      if (0 == lag) {
+        if (__atomic_compare_exchange_n(&m_dequeue_pos, &pos, pos + 1, true,
+                                        __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+          if (NULL != notification) {
+            *notification = slot.notification;
+          }
+          __atomic_store_n(&slot.sequence, pos + m_mask + 1,
+                           __ATOMIC_RELEASE);
+          return true;
+        }
+      } else if (lag < 0) {
+        return false;
+      } else {
+        pos = __atomic_load_n(&m_dequeue_pos, __ATOMIC_RELAXED);
+      }
+    }
+  }
+
+  void NotificationQueue::push(const Notification &notification)
+  {
+    if (0 == (m_types & notification.type)) {
+      return;
+    }
+
+    while (!try_push(notification)) {
+      if (OVERFLOW_DROP_NEWEST == m_overflow) {
+        __atomic_add_fetch(&m_dropped, 1, __ATOMIC_RELAXED);
+        return;
+      } else if (OVERFLOW_DROP_OLDEST == m_overflow) {
+        /* N.B. The consumer may take the oldest first, which makes room
+         * all the same */
+        if (try_pop(NULL)) {
+          __atomic_add_fetch(&m_dropped, 1, __ATOMIC_RELAXED);
+        }
+      } else {
+        if (m_closed) {
+          return;
+        }
+        while (0 != sem_wait(&m_space) && EINTR == errno) {
+        }
+      }
+    }
+
+    if (0 != sem_post(&m_items)) {
+      LIBSITU_WARN("Failed to post notification\n");
+    }
+  }
+
+  bool NotificationQueue::hold(const Notification &notification)
+  {
+    if (0 == (m_types & notification.type)) {
+      return false;
+    }
+    m_held.push_back(notification);
+    return 1 == m_held.size();
+  }
+
+  void NotificationQueue::release()
+  {
+    for (size_t i = 0; i < m_held.size(); ++i) {
+      push(m_held[i]);
+    }
+    m_held.clear();
+  }
+
+  bool NotificationQueue::pop(Notification &notification)
+  {
+    if (!try_pop(&notification)) {
+      return false;
+    }
+    if (OVERFLOW_BLOCK == m_overflow && 0 != sem_post(&m_space)) {
+      LIBSITU_WARN("Failed to post notification space\n");
+    }
+    return true;
+  }
+
+  bool NotificationQueue::wait(Notification &notification, int timeout_us)
+  {
+    struct timespec deadline;
+    if (timeout_us > 0) {
+      if (0 != clock_gettime(CLOCK_REALTIME, &deadline)) {
+        LIBSITU_WARN("Failed to read real time clock\n");
+        return pop(notification);
+      }
+      deadline.tv_sec += timeout_us / 1000000;
+      deadline.tv_nsec += 1000 * (timeout_us % 1000000);
+      if (deadline.tv_nsec >= 1000000000) {
+        deadline.tv_sec += 1;
+        deadline.tv_nsec -= 1000000000;
+      }
+    }
+
+    /* N.B. The semaphore counts publications, which may exceed the
+     * notifications queued, when the oldest are dropped */
+    while (!pop(notification)) {
+      if (m_closed || 0 == timeout_us) {
+        return false;
+      }
+      const int status = timeout_us < 0 ?
+        sem_wait(&m_items) : sem_timedwait(&m_items, &deadline);
+      if (0 != status && ETIMEDOUT == errno) {
+        return pop(notification);
+      }
+    }
+    return true;
+  }
+
+  void NotificationQueue::close()
+  {
+    m_closed = true;
+    sem_post(&m_space);
+    sem_post(&m_items);
+  }
+
+  bool NotificationQueue::is_closed() const
+  {
+    return m_closed;
+  }
+
+  bool NotificationQueue::is_empty() const
+  {
+    const uint64_t pos = __atomic_load_n(&m_dequeue_pos, __ATOMIC_RELAXED);
+    return __atomic_load_n(&m_slots[pos & m_mask].sequence,
+                           __ATOMIC_ACQUIRE) != pos + 1;
+  }
+
+  Overflow NotificationQueue::get_overflow() const
+  {
+    return m_overflow;
+  }
+
+  unsigned NotificationQueue::get_types() const
+  {
+    return m_types;
+  }
+
+  unsigned long NotificationQueue::get_dropped() const
+  {
+    return __atomic_load_n(&m_dropped, __ATOMIC_RELAXED);
+  }
+
+  NotificationQueue* NotificationQueue::get_next() const
+  {
+    return m_next;
+  }
+
+  void NotificationQueue::set_next(NotificationQueue *next)
+  {
+    m_next = next;
+  }
+
+  NotificationQueue* NotificationQueue::get_next_held() const
+  {
+    return m_next_held;
+  }
+
+  void NotificationQueue::set_next_held(NotificationQueue *next)
+  {
+    m_next_held = next;
+  }
+
+  Waiter* NotificationQueue::get_armed() const
+  {
+    return m_armed;
+  }
+
+  void NotificationQueue::set_armed(Waiter *waiter)
+  {
+    m_armed = waiter;
+  }
+
+  Subscription::Subscription(Gps &gps, size_t capacity, Overflow overflow,
+                             unsigned types)
+    : m_gps(gps),
+      m_queue(new NotificationQueue(capacity, overflow, types)),
+      m_handler(NULL),
+      m_data(NULL),
+      m_thread(),
+      m_delivering(false)
+  {
+    m_gps.subscribe(m_queue);
+  }
+
+  Subscription::Subscription(Gps &gps, size_t capacity, Overflow overflow,
+                             NotificationHandler handler, void *data,
+                             unsigned types)
+    : m_gps(gps),
+      m_queue(new NotificationQueue(capacity, overflow, types)),
+      m_handler(handler),
+      m_data(data),
+      m_thread(),
+      m_delivering(false)
+  {
+    start();
+    m_gps.subscribe(m_queue);
+  }
+
+  Subscription::~Subscription()
+  {
+    /* N.B. Closing first releases a poller blocked on this queue, so
+     * that unsubscribing need not wait for this subscriber */
+    m_queue->close();
+    m_gps.unsubscribe(m_queue);
+    if (m_delivering && 0 != pthread_join(m_thread, NULL)) {
+      LIBSITU_WARN("Failed to join delivery thread\n");
+    }
+
+    delete m_queue;
+    m_queue = NULL;
+  }
+
+  bool Subscription::pop(Notification &notification)
+  {
+    return m_queue->pop(notification);
+  }
+
+  bool Subscription::wait(Notification &notification, int timeout_us)
+  {
+    return m_queue->wait(notification, timeout_us);
+  }
+
+  unsigned long Subscription::get_dropped() const
+  {
+    return m_queue->get_dropped();
+  }
+
+  bool Subscription::arm(Waiter *waiter)
+  {
+    return m_gps.arm(m_queue, waiter);
+  }
+
+  bool Subscription::disarm(Waiter *waiter)
+  {
+    return m_gps.disarm(m_queue, waiter);
+  }
+
+  void* Subscription::deliver(void *arg)
+  {
+    Subscription *subscription = static_cast<Subscription*>(arg);
+    NotificationQueue *queue = subscription->m_queue;
+    Notification notification;
+    while (queue->wait(notification, -1) && !queue->is_closed()) {
+      (*subscription->m_handler)(notification, subscription->m_data);
+    }
+    return NULL;
+  }
+
+  void Subscription::start()
+  {
+    if (NULL == m_handler) {
+      LIBSITU_WARN("Null notification handler\n");
+    } else if (0 != pthread_create(&m_thread, NULL, &deliver, this)) {
+      LIBSITU_WARN("Failed to create delivery thread\n");
+    } else {
+      m_delivering = true;
+    }
+  }
+
+}
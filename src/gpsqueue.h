@@ -0,0 +1,122 @@
+/*
+  Copyright 2013-2014 Simon Dawson
+
+  This file is part of libsitu.
+
+  libsitu is free software: you can redistribute it and/or modify
+  it under the terms of the GNU Lesser General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  libsitu is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU Lesser General Public License for more details.
+
+  You should have received a copy of the GNU Lesser General Public License
+  along with libsitu.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef _LIBSITU_GPSQUEUE_H_
+#define _LIBSITU_GPSQUEUE_H_
+
+#include <semaphore.h>
+#include <stdint.h>
+
+#include <vector>
+
+/* N.B. for definitions of Notification and Overflow */
+#include <libsitu.h>
+
+namespace libsitu {
+
+  /* A bounded queue of notifications, for one subscription
+   *
+   * A ring of slots, each with a sequence number, after Vyukov: a
+   * position is claimed by compare and swap, and the slot is published
+   * by advancing its sequence number, so that neither end takes a lock.
+   * The poller is the only producer, but with OVERFLOW_DROP_OLDEST it
+   * also removes from the consumer's end, so both ends allow several
+   * threads.
+   *
+   * Semaphores wake a waiting consumer, and with OVERFLOW_BLOCK, a
+   * waiting producer. The queues of a GPS interface are linked into a
+   * list, guarded by its watch mutex.
+   *
+   * With OVERFLOW_BLOCK, the poller holds the notifications of a fix
+   * while it has the watch lock, and pushes them once it has released
+   * the lock, so that a full queue never blocks with the lock held.
+   */
+  class NotificationQueue {
+  public:
+    NotificationQueue(size_t capacity, Overflow overflow, unsigned types);
+    ~NotificationQueue();
+
+    /* N.B. Producer; waits only with OVERFLOW_BLOCK, until there is room
+     * or the queue is closed */
+    void push(const Notification &notification);
+
+    /* N.B. Producer, with OVERFLOW_BLOCK; hold() keeps a notification for
+     * release() to push, and is true for the first one held */
+    bool hold(const Notification &notification);
+    void release();
+
+    /* N.B. Consumer; timeout_us of -1 waits indefinitely */
+    bool pop(Notification &notification);
+    bool wait(Notification &notification, int timeout_us);
+
+    /* N.B. Wakes the producer and the consumer, for good */
+    void close();
+    bool is_closed() const;
+    bool is_empty() const;
+
+    Overflow get_overflow() const;
+    unsigned get_types() const;
+    unsigned long get_dropped() const;
+
+    NotificationQueue* get_next() const;
+    void set_next(NotificationQueue *next);
+
+    /* N.B. The list of queues holding notifications, built by the poller
+     * with the watch mutex held */
+    NotificationQueue* get_next_held() const;
+    void set_next_held(NotificationQueue *next);
+
+    /* N.B. The waiter armed on the subscription, guarded by the watch
+     * mutex, like the list */
+    Waiter* get_armed() const;
+    void set_armed(Waiter *waiter);
+
+  private:
+    NotificationQueue(const NotificationQueue&);
+    NotificationQueue& operator=(const NotificationQueue&);
+
+    struct Slot {
+      /* N.B. Equal to the position when the slot is free for that
+       * position, and one past it once written */
+      uint64_t sequence;
+      Notification notification;
+    };
+
+    bool try_push(const Notification &notification);
+    bool try_pop(Notification *notification);
+
+    std::vector<Slot> m_slots;
+    std::vector<Notification> m_held;
+    uint64_t m_mask;
+    uint64_t m_enqueue_pos;
+    uint64_t m_dequeue_pos;
+    Overflow m_overflow;
+    unsigned m_types;
+    unsigned long m_dropped;
+    volatile bool m_closed;
+    sem_t m_items;
+    sem_t m_space;
+    NotificationQueue *m_next;
+    NotificationQueue *m_next_held;
+    Waiter *m_armed;
+  };
+
+}
+
+#endif
@@ -0,0 +1,412 @@
+/*
+  Copyright 2013-2014 Simon Dawson
+
+  This file is part of libsitu.
+
+  libsitu is free software: you can redistribute it and/or modify
+  it under the terms of the GNU Lesser General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  libsitu is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU Lesser General Public License for more details.
+
+  You should have received a copy of the GNU Lesser General Public License
+  along with libsitu.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <map>
+#include <string>
+
+#include <gpsdebug.h>
+#include <gpsstate.h>
+#include <gpswatch.h>
+
+#define LIBSITU_SNAPSHOT_VERSION 2
+#define LIBSITU_SNAPSHOT_BYTE_ORDER 0x01020304u
+#define LIBSITU_SNAPSHOT_NONE 0xffffffffu
+#define LIBSITU_SNAPSHOT_WINDOWED 0x80000000u
+
+namespace libsitu {
+
+  namespace Snapshot {
+
+    namespace {
+
+      const char magic[8] = { 'l', 'i', 'b', 's', 'i', 't', 'u', '\0' };
+
+      typedef enum {
+        FIX_VALID = 1,
+        FIX_HAS_SPEED = 2,
+        FIX_HAS_TRACK = 4
+      } FixFlag;
+
+      struct SavedFix {
+        double latitude;
+        double longitude;
+        double eph;
+        double speed;
+        double eps;
+        double track;
+        uint32_t flags;
+        uint32_t satellites_used;
+      };
+
+      struct Header {
+        char magic[8];
+        uint32_t version;
+        uint32_t byte_order;
+        uint32_t watch_count;
+        uint32_t binding_count;
+        uint32_t strings_size;
+        uint32_t reserved;
+        SavedFix fix;
+      };
+
+      struct SavedWatch {
+        double lat;
+        double lon;
+        double rad;
+        uint32_t id;
+        uint32_t name; /* String offset, or LIBSITU_SNAPSHOT_NONE */
+        uint32_t binding; /* Binding index, or LIBSITU_SNAPSHOT_NONE */
+        uint16_t min_dwell_ms;
+        uint16_t coalesce_ms;
+        uint8_t model;
+        uint8_t precision;
+        uint8_t state;
+        uint8_t min_fixes;
+        /* Window days, with LIBSITU_SNAPSHOT_WINDOWED, or zero */
+        uint32_t window_days;
+        int32_t window_start_s;
+        int32_t window_end_s;
+      };
+
+      struct BySlot {
+        const WatchTable *watches;
+        bool operator()(size_t a, size_t b) const
+        {
+          return (watches->id_at(a) & WATCH_INDEX_MASK) <
+            (watches->id_at(b) & WATCH_INDEX_MASK);
+        }
+      };
+
+      uint32_t add_string(std::vector<char> &strings, const char *str)
+      {
+        const uint32_t offset = strings.size();
+        strings.insert(strings.end(), str, str + strlen(str) + 1);
+        return offset;
+      }
+
+      void append(std::vector<char> &buffer, const void *data, size_t size)
+      {
+        const char *bytes = static_cast<const char*>(data);
+        buffer.insert(buffer.end(), bytes, bytes + size);
+      }
+
+    }
+
+    void save(const WatchTable &watches, const Fix &fix,
+              std::vector<char> &buffer)
+    {
+      const size_t count = watches.size();
+
+      /* N.B. Restoring needs ascending slot order */
+      std::vector<size_t> order(count);
+      for (size_t i = 0; i < count; ++i) {
+        order[i] = i;
+      }
+      BySlot by_slot;
+      by_slot.watches = &watches;
+      std::sort(order.begin(), order.end(), by_slot);
+
+      std::vector<SavedWatch> records(count);
+      std::vector<uint32_t> bindings;
+      std::vector<char> strings;
+      std::map<std::string,uint32_t> binding_index;
+      size_t unbound = 0;
+
+      for (size_t i = 0; i < count; ++i) {
+        const Watch &watch = watches.watch_at(order[i]);
+        SavedWatch &record = records[i];
+        memset(&record, 0, sizeof(record));
+        record.lat = watch.get_lat();
+        record.lon = watch.get_lon();
+        record.rad = watch.get_rad();
+        record.id = watches.id_at(order[i]);
+
+        const char *name = watches.name_at(order[i]);
+        record.name = NULL == name ?
+          LIBSITU_SNAPSHOT_NONE : add_string(strings, name);
+
+        record.binding = LIBSITU_SNAPSHOT_NONE;
+        const char *key = watches.binding_key(watch);
+        if (NULL != key) {
+          const std::map<std::string,uint32_t>::iterator iter =
+            binding_index.insert(std::make_pair(std::string(key),
+                                                bindings.size())).first;
+          if (iter->second == bindings.size()) {
+            bindings.push_back(add_string(strings, key));
+          }
+          record.binding = iter->second;
+        } else if (NULL != watch.get_alarm() || NULL != watch.get_handler()) {
+          ++unbound;
+        }
+
+        Debounce debounce;
+        watch.get_debounce(debounce);
+        record.min_fixes = debounce.min_fixes;
+        record.min_dwell_ms = debounce.min_dwell_ms;
+        record.coalesce_ms = debounce.coalesce_ms;
+        record.model = watch.get_model();
+        record.precision = watch.get_precision();
+        record.state = watch.get_state();
+
+        Window window;
+        if (watch.get_window(window)) {
+          record.window_days = window.days | LIBSITU_SNAPSHOT_WINDOWED;
+          record.window_start_s = window.start_s;
+          record.window_end_s = window.end_s;
+        }
+      }
+
+      if (0 != unbound) {
+        LIBSITU_WARN("%zu watches have callbacks without a binding key\n",
+                     unbound);
+      }
+
+      Header header;
+      memset(&header, 0, sizeof(header));
+      memcpy(header.magic, magic, sizeof(magic));
+      header.version = LIBSITU_SNAPSHOT_VERSION;
+      header.byte_order = LIBSITU_SNAPSHOT_BYTE_ORDER;
+      header.watch_count = count;
+      header.binding_count = bindings.size();
+      header.strings_size = strings.size();
+      header.fix.latitude = fix.latitude;
+      header.fix.longitude = fix.longitude;
+      header.fix.eph = fix.eph;
+      header.fix.speed = fix.speed;
+      header.fix.eps = fix.eps;
+      header.fix.track = fix.track;
+      header.fix.flags = (fix.valid ? FIX_VALID : 0) |
+        (fix.has_speed ? FIX_HAS_SPEED : 0) |
+        (fix.has_track ? FIX_HAS_TRACK : 0);
+      header.fix.satellites_used = fix.satellites_used;
+
+      buffer.clear();
+      buffer.reserve(sizeof(header) + count * sizeof(SavedWatch) +
+                     bindings.size() * sizeof(uint32_t) + strings.size());
+      append(buffer, &header, sizeof(header));
+      if (0 != count) {
+        append(buffer, &records[0], count * sizeof(SavedWatch));
+      }
+      if (!bindings.empty()) {
+        append(buffer, &bindings[0], bindings.size() * sizeof(uint32_t));
+      }
+      if (!strings.empty()) {
+        append(buffer, &strings[0], strings.size());
+      }
+    }
+
+    bool write(const char *path, const std::vector<char> &buffer)
+    {
+      /* N.B. Write a temporary file, and rename it into place, so that an
+       * interrupted save leaves the previous snapshot intact */
+      const std::string temporary = std::string(path) + ".tmp";
+      FILE *file = fopen(temporary.c_str(), "wb");
+      if (NULL == file) {
+        LIBSITU_WARN("Failed to open %s: %s\n",
+                     temporary.c_str(), strerror(errno));
+        return false;
+      }
+      bool ok = buffer.empty() ||
+        1 == fwrite(&buffer[0], buffer.size(), 1, file);
+      ok = ok && 0 == fflush(file) && 0 == fsync(fileno(file));
+      if (0 != fclose(file)) {
+        ok = false;
+      }
+      if (!ok) {
+        LIBSITU_WARN("Failed to write %s: %s\n",
+                     temporary.c_str(), strerror(errno));
+        unlink(temporary.c_str());
+        return false;
+      }
+      if (0 != rename(temporary.c_str(), path)) {
+        LIBSITU_WARN("Failed to rename %s: %s\n",
+                     temporary.c_str(), strerror(errno));
+        unlink(temporary.c_str());
+        return false;
+      }
+      return true;
+    }
+
+    namespace {
+
+      bool restore(const char *data, size_t size, WatchTable &watches,
+                   Fix &fix)
+      {
+        if (size < sizeof(Header)) {
+          LIBSITU_WARN("Snapshot truncated\n");
+          return false;
+        }
+        const Header &header = *reinterpret_cast<const Header*>(data);
+        if (0 != memcmp(header.magic, magic, sizeof(magic)) ||
+            LIBSITU_SNAPSHOT_VERSION != header.version ||
+            LIBSITU_SNAPSHOT_BYTE_ORDER != header.byte_order) {
+          LIBSITU_WARN("Not a snapshot of this version and byte order\n");
+          return false;
+        }
+
+        const uint64_t records_size =
+          static_cast<uint64_t>(header.watch_count) * sizeof(SavedWatch);
+        const uint64_t bindings_size =
+          static_cast<uint64_t>(header.binding_count) * sizeof(uint32_t);
+        if (sizeof(Header) + records_size + bindings_size +
+            header.strings_size != size) {
+          LIBSITU_WARN("Snapshot size mismatch\n");
+          return false;
+        }
+        const SavedWatch *records =
+          reinterpret_cast<const SavedWatch*>(data + sizeof(Header));
+        const uint32_t *bindings = reinterpret_cast<const uint32_t*>(
+          data + sizeof(Header) + records_size);
+        const char *strings = data + sizeof(Header) + records_size +
+          bindings_size;
+        if (0 != header.strings_size &&
+            '\0' != strings[header.strings_size - 1]) {
+          LIBSITU_WARN("Snapshot strings unterminated\n");
+          return false;
+        }
+
+        /* Resolve each binding key once */
+        std::vector<WatchAlarm> alarms(header.binding_count, NULL);
+        std::vector<WatchHandler> handlers(header.binding_count, NULL);
+        std::vector<void*> data_pointers(header.binding_count, NULL);
+        for (uint32_t i = 0; i < header.binding_count; ++i) {
+          if (bindings[i] >= header.strings_size) {
+            LIBSITU_WARN("Snapshot binding key out of range\n");
+            return false;
+          }
+          const char *key = strings + bindings[i];
+          if (!watches.find_binding(key, alarms[i], handlers[i],
+                                    data_pointers[i])) {
+            LIBSITU_WARN("No binding for key \"%s\"\n", key);
+          }
+        }
+
+        watches.reserve(header.watch_count);
+        for (uint32_t i = 0; i < header.watch_count; ++i) {
+          const SavedWatch &record = records[i];
+          if ((LIBSITU_SNAPSHOT_NONE != record.name &&
+               record.name >= header.strings_size) ||
+              (LIBSITU_SNAPSHOT_NONE != record.binding &&
+               record.binding >= header.binding_count) ||
+              record.model > MODEL_ELLIPSOIDAL ||
+              record.precision > PRECISION_FIXED ||
+              record.state > Math::STATE_NEAR ||
+              (0 != (record.window_days & LIBSITU_SNAPSHOT_WINDOWED) &&
+               (0 != (record.window_days & ~LIBSITU_SNAPSHOT_WINDOWED &
+                      ~0x7fu) ||
+                record.window_start_s < 0 || record.window_end_s < 0))) {
+            LIBSITU_WARN("Snapshot watch %u invalid\n", i);
+            return false;
+          }
+
+          const uint32_t b = record.binding;
+          const bool bound = LIBSITU_SNAPSHOT_NONE != b;
+          Watch watch(record.lat, record.lon, record.rad,
+                      bound ? alarms[b] : NULL,
+                      bound ? handlers[b] : NULL,
+                      bound ? data_pointers[b] : NULL,
+                      static_cast<Model>(record.model),
+                      static_cast<Precision>(record.precision));
+          Debounce debounce;
+          debounce.min_fixes = record.min_fixes;
+          debounce.min_dwell_ms = record.min_dwell_ms;
+          debounce.coalesce_ms = record.coalesce_ms;
+          watch.set_debounce(debounce);
+          watch.set_state(static_cast<Math::State>(record.state));
+          if (0 != (record.window_days & LIBSITU_SNAPSHOT_WINDOWED)) {
+            Window window;
+            window.start_s = record.window_start_s;
+            window.end_s = record.window_end_s;
+            window.days = record.window_days & ~LIBSITU_SNAPSHOT_WINDOWED;
+            watch.set_window(window);
+          }
+
+          const char *name = LIBSITU_SNAPSHOT_NONE == record.name ?
+            NULL : strings + record.name;
+          if (!watches.insert(watch, name, record.id)) {
+            return false;
+          }
+        }
+
+        memset(&fix, 0, sizeof(fix));
+        fix.valid = 0 != (header.fix.flags & FIX_VALID);
+        fix.latitude = header.fix.latitude;
+        fix.longitude = header.fix.longitude;
+        fix.eph = header.fix.eph;
+        fix.has_speed = 0 != (header.fix.flags & FIX_HAS_SPEED);
+        fix.speed = header.fix.speed;
+        fix.eps = header.fix.eps;
+        fix.has_track = 0 != (header.fix.flags & FIX_HAS_TRACK);
+        fix.track = header.fix.track;
+        fix.satellites_used = header.fix.satellites_used;
+
+        return true;
+      }
+
+    }
+
+    bool load(const char *path, WatchTable &watches, Fix &fix)
+    {
+      const int fd = open(path, O_RDONLY);
+      if (-1 == fd) {
+        LIBSITU_WARN("Failed to open %s: %s\n", path, strerror(errno));
+        return false;
+      }
+      struct stat status;
+      if (0 != fstat(fd, &status)) {
+        LIBSITU_WARN("Failed to stat %s: %s\n", path, strerror(errno));
+        close(fd);
+        return false;
+      }
+      const size_t size = status.st_size;
+      if (0 == size) {
+        LIBSITU_WARN("Snapshot %s is empty\n", path);
+        close(fd);
+        return false;
+      }
+
+      void *data = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+      close(fd);
+      if (MAP_FAILED == data) {
+        LIBSITU_WARN("Failed to map %s: %s\n", path, strerror(errno));
+        return false;
+      }
+
+      const bool ok = restore(static_cast<const char*>(data), size,
+                              watches, fix);
+      if (0 != munmap(data, size)) {
+        LIBSITU_WARN("Failed to unmap %s: %s\n", path, strerror(errno));
+      }
+      return ok;
+    }
+
+  }
+
+}
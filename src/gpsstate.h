@@ -0,0 +1,56 @@
+/*
+  Copyright 2013-2014 Simon Dawson
+
+  This file is part of libsitu.
+
+  libsitu is free software: you can redistribute it and/or modify
+  it under the terms of the GNU Lesser General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  libsitu is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU Lesser General Public License for more details.
+
+  You should have received a copy of the GNU Lesser General Public License
+  along with libsitu.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef _LIBSITU_GPSSTATE_H_
+#define _LIBSITU_GPSSTATE_H_
+
+#include <vector>
+
+/* N.B. for definition of Fix */
+#include <libsitu.h>
+
+namespace libsitu {
+
+  class WatchTable;
+
+  /* Saved watch state
+   *
+   * A snapshot is a header (including the last fix), then a fixed-size
+   * record per watch, in ascending order of slot index, then a table of
+   * binding keys, then the names and keys as NUL-terminated strings. All
+   * fields are in host byte order, and aligned, so that a snapshot can be
+   * read with one read or mmap and used in place.
+   */
+  namespace Snapshot {
+
+    /* N.B. Call with the watch lock held */
+    void save(const WatchTable &watches, const Fix &fix,
+              std::vector<char> &buffer);
+
+    bool write(const char *path, const std::vector<char> &buffer);
+
+    /* Restore into an empty table, whose bindings are used to reconnect
+     * the watches to their callbacks */
+    bool load(const char *path, WatchTable &watches, Fix &fix);
+
+  }
+
+}
+
+#endif
@@ -0,0 +1,262 @@
+/*
+  Copyright 2013-2014 Simon Dawson
+
+  This file is part of libsitu.
+
+  libsitu is free software: you can redistribute it and/or modify
+  it under the terms of the GNU Lesser General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  libsitu is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU Lesser General Public License for more details.
+
+  You should have received a copy of the GNU Lesser General Public License
+  along with libsitu.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include <errno.h>
+#include <pthread.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include <vector>
+
+#include <gpsdebug.h>
+#include <gpstrace.h>
+#include <libsitu.h>
+
+/* Events per thread ring; a power of two */
+#define LIBSITU_TRACE_RING_EVENTS 4096
+
+namespace libsitu {
+
+  namespace Trace {
+
+#ifdef LIBSITU_TRACE
+
+    namespace {
+
+      struct Event {
+        uint64_t ts_ns;
+        const char *name;
+        int64_t arg;
+        uint32_t phase;
+        uint32_t reserved;
+      };
+
+      struct Ring {
+        /* N.B. Rings are never unlinked from the registry */
+        Ring *next;
+        volatile int in_use;
+        volatile uint64_t head; /* Number of events written */
+        pid_t tid;
+        const char *thread_name;
+        Event events[LIBSITU_TRACE_RING_EVENTS];
+      };
+
+      Ring *registry = NULL;
+      pthread_once_t key_once = PTHREAD_ONCE_INIT;
+      pthread_key_t key;
+      __thread Ring *thread_ring = NULL;
+
+      void release_ring(void *ring)
+      /* Release the ring of an exiting thread, for a new thread to claim;
+       * until then, its events may still be dumped */
+      {
+        __atomic_store_n(&static_cast<Ring*>(ring)->in_use, 0,
+                         __ATOMIC_RELEASE);
+      }
+
+      void make_key()
+      {
+        if (0 != pthread_key_create(&key, &release_ring)) {
+          LIBSITU_WARN("Failed to create trace key\n");
+        }
+      }
+
+      Ring* claim_ring()
+      {
+        if (0 != pthread_once(&key_once, &make_key)) {
+          LIBSITU_WARN("Failed to initialise tracing\n");
+        }
+
+        Ring *ring = NULL;
+        for (Ring *r = __atomic_load_n(&registry, __ATOMIC_ACQUIRE);
+             NULL != r; r = r->next) {
+          if (__sync_bool_compare_and_swap(&r->in_use, 0, 1)) {
+            ring = r;
+            break;
+          }
+        }
+        if (NULL == ring) {
+          ring = static_cast<Ring*>(calloc(1, sizeof(Ring)));
+          if (NULL == ring) {
+            return NULL;
+          }
+          ring->in_use = 1;
+          do {
+            ring->next = __atomic_load_n(&registry, __ATOMIC_ACQUIRE);
+          } while (!__sync_bool_compare_and_swap(&registry, ring->next,
+                                                 ring));
+        }
+
+        /* N.B. A dump in progress discards a ring whose head goes back */
+        ring->tid = static_cast<pid_t>(syscall(SYS_gettid));
+        ring->thread_name = NULL;
+        __atomic_store_n(&ring->head, 0, __ATOMIC_RELEASE);
+        if (0 != pthread_setspecific(key, ring)) {
+          LIBSITU_WARN("Failed to set trace ring\n");
+        }
+        return ring;
+      }
+
+      const char* phase_str(uint32_t phase)
+      {
+        switch (phase) {
+        case PHASE_BEGIN:
+          return "B";
+        case PHASE_END:
+          return "E";
+        default:
+          return "i";
+        }
+      }
+
+    }
+
+    void record(const char *name, Phase phase, int64_t arg)
+    {
+      Ring *ring = thread_ring;
+      if (NULL == ring) {
+        ring = thread_ring = claim_ring();
+        if (NULL == ring) {
+          return;
+        }
+      }
+
+      /* N.B. An event without a time would be misplaced, so is dropped */
+      struct timespec now = { 0, 0 };
+      if (0 != clock_gettime(CLOCK_MONOTONIC, &now)) {
+        return;
+      }
+
+      /* N.B. Only this thread writes the ring, so the event is written in
+       * place, then published by advancing the head */
+      const uint64_t head = ring->head;
+      Event &event = ring->events[head & (LIBSITU_TRACE_RING_EVENTS - 1)];
+      event.ts_ns = static_cast<uint64_t>(now.tv_sec) * 1000000000u +
+        now.tv_nsec;
+      event.name = name;
+      event.arg = arg;
+      event.phase = phase;
+      __atomic_store_n(&ring->head, head + 1, __ATOMIC_RELEASE);
+    }
+
+    void name_thread(const char *name)
+    {
+      if (NULL == thread_ring) {
+        record(name, PHASE_INSTANT, 0);
+      }
+      if (NULL != thread_ring) {
+        thread_ring->thread_name = name;
+      }
+    }
+
+    bool dump_json(const char *path)
+    {
+      FILE *file = fopen(path, "w");
+      if (NULL == file) {
+        LIBSITU_WARN("Failed to open %s: %s\n", path, strerror(errno));
+        return false;
+      }
+
+      const int pid = getpid();
+      std::vector<Event> events(LIBSITU_TRACE_RING_EVENTS);
+      bool first = true;
+      fprintf(file, "{\"traceEvents\":[");
+      for (Ring *ring = __atomic_load_n(&registry, __ATOMIC_ACQUIRE);
+           NULL != ring; ring = ring->next) {
+        const uint64_t head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+        const int tid = ring->tid;
+        const char *thread_name = ring->thread_name;
+        memcpy(&events[0], ring->events, sizeof(ring->events));
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+        const uint64_t after =
+          __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+        if (after < head) {
+          /* N.B. Claimed by a new thread meanwhile */
+          continue;
+        }
+
+        /* N.B. Events at or behind the slot being written, now or since
+         * the copy began, may be torn */
+        uint64_t begin = head > LIBSITU_TRACE_RING_EVENTS ?
+          head - LIBSITU_TRACE_RING_EVENTS : 0;
+        if (after >= LIBSITU_TRACE_RING_EVENTS &&
+            begin < after - LIBSITU_TRACE_RING_EVENTS + 1) {
+          begin = after - LIBSITU_TRACE_RING_EVENTS + 1;
+        }
+
+        if (NULL != thread_name) {
+          fprintf(file, "%s\n{\"name\":\"thread_name\",\"ph\":\"M\","
+                  "\"pid\":%d,\"tid\":%d,\"args\":{\"name\":\"%s\"}}",
+                  first ? "" : ",", pid, tid, thread_name);
+          first = false;
+        }
+        for (uint64_t i = begin; i < head; ++i) {
+          const Event &event =
+            events[i & (LIBSITU_TRACE_RING_EVENTS - 1)];
+          fprintf(file, "%s\n{\"name\":\"%s\",\"ph\":\"%s\",\"ts\":%.3f,"
+                  "\"pid\":%d,\"tid\":%d",
+                  first ? "" : ",", event.name, phase_str(event.phase),
+                  event.ts_ns / 1e3, pid, tid);
+          if (PHASE_INSTANT == event.phase) {
+            fprintf(file, ",\"s\":\"t\"");
+          }
+          if (PHASE_BEGIN != event.phase) {
+            fprintf(file, ",\"args\":{\"n\":%lld}",
+                    static_cast<long long>(event.arg));
+          }
+          fprintf(file, "}");
+          first = false;
+        }
+      }
+      fprintf(file, "\n],\"displayTimeUnit\":\"ns\"}\n");
+
+      if (0 != fclose(file)) {
+        LIBSITU_WARN("Failed to write %s: %s\n", path, strerror(errno));
+        return false;
+      }
+      return true;
+    }
+
+#else /* LIBSITU_TRACE */
+
+    void record(const char *UNUSED(name), Phase UNUSED(phase),
+                int64_t UNUSED(arg))
+    {
+    }
+
+    void name_thread(const char *UNUSED(name))
+    {
+    }
+
+    bool dump_json(const char *UNUSED(path))
+    {
+      LIBSITU_WARN("Tracing not enabled; configure with --enable-trace\n");
+      return false;
+    }
+
+#endif /* LIBSITU_TRACE */
+
+  }
+
+}
@@ -0,0 +1,82 @@
+/*
+  Copyright 2013-2014 Simon Dawson
+
+  This file is part of libsitu.
+
+  libsitu is free software: you can redistribute it and/or modify
+  it under the terms of the GNU Lesser General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  libsitu is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU Lesser General Public License for more details.
+
+  You should have received a copy of the GNU Lesser General Public License
+  along with libsitu.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef _LIBSITU_GPSTRACE_H_
+#define _LIBSITU_GPSTRACE_H_
+
+#include <config.h>
+
+#include <stdint.h>
+
+/*
+ * Trace points, compiled in with "configure --enable-trace", and
+ * otherwise compiled out entirely
+ *
+ * Names must be string literals: only the pointer is recorded. A span
+ * is a BEGIN and END pair, on the same thread; the argument of an END
+ * or an INSTANT is a count, shown with the event.
+ */
+#ifdef LIBSITU_TRACE
+#  define LIBSITU_TRACE_BEGIN(name) \
+  libsitu::Trace::record((name), libsitu::Trace::PHASE_BEGIN, 0)
+#  define LIBSITU_TRACE_END(name, arg) \
+  libsitu::Trace::record((name), libsitu::Trace::PHASE_END, (arg))
+#  define LIBSITU_TRACE_INSTANT(name, arg) \
+  libsitu::Trace::record((name), libsitu::Trace::PHASE_INSTANT, (arg))
+#  define LIBSITU_TRACE_THREAD(name) libsitu::Trace::name_thread(name)
+#else /* LIBSITU_TRACE */
+#  define LIBSITU_TRACE_BEGIN(name)
+#  define LIBSITU_TRACE_END(name, arg)
+#  define LIBSITU_TRACE_INSTANT(name, arg)
+#  define LIBSITU_TRACE_THREAD(name)
+#endif /* LIBSITU_TRACE */
+
+namespace libsitu {
+
+  /* Trace event recording
+   *
+   * Each thread records into its own ring of fixed-size binary events,
+   * with monotonic clock timestamps, so that recording takes no lock and
+   * never allocates after the first event on a thread. The newest events
+   * overwrite the oldest. A dump may be taken from any thread, while the
+   * rings are being written: the head of each ring is read before and
+   * after copying it, and events overwritten meanwhile are discarded.
+   *
+   * The ring of a thread that has exited is kept for dumping, until it
+   * is claimed by a new thread.
+   */
+  namespace Trace {
+
+    typedef enum {
+      PHASE_BEGIN = 0,
+      PHASE_END = 1,
+      PHASE_INSTANT = 2
+    } Phase;
+
+    void record(const char *name, Phase phase, int64_t arg);
+    void name_thread(const char *name);
+
+    /* N.B. Chrome trace event JSON; false if tracing is compiled out */
+    bool dump_json(const char *path);
+
+  }
+
+}
+
+#endif
@@ -19,12 +19,15 @@
 
 #include <errno.h>
 #include <limits.h> /* LONG_MIN and LONG_MAX */
+#include <math.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <time.h>
 
 #include <gpsdebug.h>
 #include <libsitu.h>
 #include <gpsmath.h>
+#include <gpstrace.h>
 
 namespace libsitu {
   namespace Util {
@@ -33,6 +36,7 @@ namespace libsitu {
     {
       return EVENT_ARRIVE == event ? "APPROACH" :
         EVENT_DEPART == event ? "DEPART" :
+        EVENT_PREDICT == event ? "PREDICT" :
         "INVALID";
     }
 
@@ -40,6 +44,11 @@ namespace libsitu {
     {
       printf("{\n");
 
+      if (0 != fix.time) {
+        printf("  \"time\": %.3f,\n", fix.time);
+      } else {
+        printf("  \"time\": null,\n");
+      }
       if (Math::is_finite(fix.latitude) && Math::is_finite(fix.longitude)) {
         printf("  \"latitude\": %.3f,\n", fix.latitude);
         printf("  \"longitude\": %.3f,\n", fix.longitude);
@@ -66,6 +75,86 @@ namespace libsitu {
       printf("}\n");
     }
 
+    int64_t monotonic_ns()
+    {
+      struct timespec now;
+      if (0 != clock_gettime(CLOCK_MONOTONIC, &now)) {
+        LIBSITU_WARN("Failed to read monotonic clock\n");
+        return 0;
+      }
+      return static_cast<int64_t>(now.tv_sec) * 1000000000 + now.tv_nsec;
+    }
+
+    double latency(const Fix &fix)
+    {
+      if (0 == fix.time) {
+        return NAN;
+      }
+      struct timespec now;
+      if (0 != clock_gettime(CLOCK_REALTIME, &now)) {
+        LIBSITU_WARN("Failed to read real time clock\n");
+        return NAN;
+      }
+      return now.tv_sec - fix.time + now.tv_nsec / 1e9;
+    }
+
+    void dump_stats_json(const Stats &stats)
+    {
+      printf("{\n");
+      printf("  \"wakeups\": %lu,\n", stats.wakeups);
+      printf("  \"fixes\": %lu,\n", stats.fixes);
+      printf("  \"timeouts\": %lu,\n", stats.timeouts);
+      printf("  \"connects\": %lu,\n", stats.connects);
+      printf("  \"elapsed_s\": %.3f,\n", stats.elapsed_s);
+      if (stats.elapsed_s > 0) {
+        printf("  \"wakeup_hz\": %.3f,\n", stats.wakeups / stats.elapsed_s);
+      } else {
+        printf("  \"wakeup_hz\": null,\n");
+      }
+      printf("  \"sleep_us\": %d,\n", stats.sleep_us);
+      printf("  \"messages\": %lu,\n", stats.messages);
+      printf("  \"message_bytes\": %lu,\n", stats.message_bytes);
+      printf("  \"dropped\": {\n");
+      printf("    \"TPV\": %lu,\n", stats.dropped[0]);
+      printf("    \"SKY\": %lu,\n", stats.dropped[1]);
+      printf("    \"GST\": %lu,\n", stats.dropped[2]);
+      printf("    \"DEVICE\": %lu,\n", stats.dropped[3]);
+      printf("    \"other\": %lu\n", stats.dropped[4]);
+      printf("  },\n");
+      printf("  \"route_resyncs\": %lu\n", stats.route_resyncs);
+      printf("}\n");
+    }
+
+    bool dump_trace_json(const char *path)
+    {
+      return Trace::dump_json(path);
+    }
+
+    void set_log_level(LogLevel level)
+    {
+      Log::level = level;
+    }
+
+    LogLevel get_log_level()
+    {
+      return static_cast<LogLevel>(Log::level);
+    }
+
+    void set_log_sink(LogSink sink, void *data)
+    {
+      Log::set_sink(sink, data);
+    }
+
+    void flush_log()
+    {
+      Log::flush();
+    }
+
+    unsigned long get_log_dropped()
+    {
+      return Log::get_dropped();
+    }
+
     bool parse_string_to_integer(
       const char *str,
       int *val
@@ -18,23 +18,133 @@
 */
 
 #include <math.h>
+#include <time.h>
+
+#include <algorithm>
 
 #include <gpsdebug.h>
 #include <gpswatch.h>
 
+#define LIBSITU_SECONDS_PER_DAY 86400
+
+#define LIBSITU_ROUTE_NONE 0xffffffffu
+#define LIBSITU_ROUTE_INDEX_BITS 16
+#define LIBSITU_ROUTE_INDEX_MASK ((1u << LIBSITU_ROUTE_INDEX_BITS) - 1)
+/* How far, relative to the distance between the stops either side of the
+ * cursor, the receiver may be from the active stops of a route before it
+ * is resynchronised */
+#define LIBSITU_ROUTE_SLACK 2
+
 namespace libsitu {
 
+  namespace {
+
+    time_t local_time(const struct tm &day, int days, int seconds)
+    /* A time of day, in seconds after local midnight, some days from the
+     * given day; mktime() normalises the fields, and finds whether
+     * daylight saving time applies */
+    {
+      struct tm local = day;
+      local.tm_mday += days;
+      local.tm_hour = 0;
+      local.tm_min = 0;
+      local.tm_sec = seconds;
+      local.tm_isdst = -1;
+      return mktime(&local);
+    }
+
+    bool window_is_open(const Window &window, time_t now, time_t &change)
+    /* Whether a window is open at a time, and the next time at which it
+     * opens or closes */
+    {
+      struct tm today;
+      if (NULL == localtime_r(&now, &today)) {
+        LIBSITU_WARN("Failed to convert time to local time\n");
+        change = now + LIBSITU_SECONDS_PER_DAY;
+        return true;
+      }
+      const int span_s = window.end_s > window.start_s ?
+        window.end_s - window.start_s :
+        window.end_s - window.start_s + LIBSITU_SECONDS_PER_DAY;
+
+      /* N.B. Openings from yesterday, which may not yet have closed, to a
+       * week hence; an opening before the last has closed extends it */
+      bool found = false;
+      time_t open_at = 0;
+      time_t close_at = 0;
+      for (int d = -1; d <= 7; ++d) {
+        const int weekday = (today.tm_wday + d + 7) % 7;
+        if (0 != window.days && 0 == (window.days & (1u << weekday))) {
+          continue;
+        }
+        const time_t start = local_time(today, d, window.start_s);
+        const time_t end = local_time(today, d, window.start_s + span_s);
+        if (found && start <= close_at) {
+          close_at = end > close_at ? end : close_at;
+          continue;
+        }
+        if (found && close_at > now) {
+          break;
+        }
+        found = true;
+        open_at = start;
+        close_at = end;
+      }
+
+      if (!found || close_at <= now) {
+        /* N.B. The window never opens: check again in a week */
+        change = now + 7 * LIBSITU_SECONDS_PER_DAY;
+        return false;
+      }
+      if (open_at <= now) {
+        change = close_at;
+        return true;
+      }
+      change = open_at;
+      return false;
+    }
+
+  }
+
   Watch::Watch()
-    : m_lat(0), m_lon(0), m_rad(0), m_alarm(NULL), m_data(NULL),
-      m_state(Math::STATE_UNKNOWN)
+    : m_lat(0), m_lon(0), m_rad(0), m_model(MODEL_SPHERICAL),
+      m_precision(PRECISION_DEFAULT), m_alarm(NULL), m_handler(NULL),
+      m_data(NULL),
+      m_state(Math::STATE_UNKNOWN), m_min_fixes(0), m_min_dwell_ms(0),
+      m_coalesce_ms(0), m_pending(Math::STATE_UNKNOWN), m_pending_fixes(0),
+      m_pending_since_ms(0), m_predicted(false), m_windowed(false),
+      m_window(),
+      m_evaluate(&Watch::evaluate_spherical),
+      m_distance(&Math::distance), m_geodesic(), m_lambda(NAN), m_plane(),
+      m_fixed()
   {
   }
 
   Watch::Watch(double lat, double lon, double rad,
-               WatchAlarm alarm, void *data)
-    : m_lat(lat), m_lon(lon), m_rad(rad), m_alarm(alarm), m_data(data),
-      m_state(Math::STATE_UNKNOWN)
+               WatchAlarm alarm, WatchHandler handler, void *data,
+               Model model, Precision precision)
+    : m_lat(lat), m_lon(lon), m_rad(rad), m_model(model),
+      m_precision(precision), m_alarm(alarm), m_handler(handler),
+      m_data(data),
+      m_state(Math::STATE_UNKNOWN), m_min_fixes(0), m_min_dwell_ms(0),
+      m_coalesce_ms(0), m_pending(Math::STATE_UNKNOWN), m_pending_fixes(0),
+      m_pending_since_ms(0), m_predicted(false), m_windowed(false),
+      m_window(),
+      m_evaluate(&Watch::evaluate_spherical),
+      m_distance(Math::distance_function(precision)), m_geodesic(),
+      m_lambda(NAN), m_plane(), m_fixed()
   {
+    /* N.B. Watch-side terms are computed once, here */
+    if (MODEL_ELLIPSOIDAL == model) {
+      Math::geodesic_init(m_geodesic, m_lat, m_lon);
+      m_evaluate = &Watch::evaluate_ellipsoidal;
+    } else if (PRECISION_FIXED == precision) {
+      Math::fixed_init(m_fixed, m_lat, m_lon, m_rad);
+      m_evaluate = &Watch::evaluate_fixed;
+    } else if (Math::plane_init(m_plane, m_lat, m_lon, m_rad)) {
+      /* N.B. Small enough for the local tangent plane */
+      m_evaluate = &Watch::evaluate_plane;
+    }
   }
 
   Watch::~Watch()
@@ -45,9 +155,27 @@ namespace libsitu {
     : m_lat(original.m_lat),
       m_lon(original.m_lon),
       m_rad(original.m_rad),
+      m_model(original.m_model),
+      m_precision(original.m_precision),
       m_alarm(original.m_alarm),
+      m_handler(original.m_handler),
       m_data(original.m_data),
-      m_state(original.m_state)
+      m_state(original.m_state),
+      m_min_fixes(original.m_min_fixes),
+      m_min_dwell_ms(original.m_min_dwell_ms),
+      m_coalesce_ms(original.m_coalesce_ms),
+      m_pending(original.m_pending),
+      m_pending_fixes(original.m_pending_fixes),
+      m_pending_since_ms(original.m_pending_since_ms),
+      m_predicted(original.m_predicted),
+      m_windowed(original.m_windowed),
+      m_window(original.m_window),
+      m_evaluate(original.m_evaluate),
+      m_distance(original.m_distance),
+      m_geodesic(original.m_geodesic),
+      m_lambda(original.m_lambda),
+      m_plane(original.m_plane),
+      m_fixed(original.m_fixed)
   {
   }
 
@@ -57,29 +185,237 @@ namespace libsitu {
       m_lat = rhs.m_lat;
       m_lon = rhs.m_lon;
       m_rad = rhs.m_rad;
+      m_model = rhs.m_model;
+      m_precision = rhs.m_precision;
       m_alarm = rhs.m_alarm;
+      m_handler = rhs.m_handler;
       m_data = rhs.m_data;
       m_state = rhs.m_state;
+      m_min_fixes = rhs.m_min_fixes;
+      m_min_dwell_ms = rhs.m_min_dwell_ms;
+      m_coalesce_ms = rhs.m_coalesce_ms;
+      m_pending = rhs.m_pending;
+      m_pending_fixes = rhs.m_pending_fixes;
+      m_pending_since_ms = rhs.m_pending_since_ms;
+      m_predicted = rhs.m_predicted;
+      m_windowed = rhs.m_windowed;
+      m_window = rhs.m_window;
+      m_evaluate = rhs.m_evaluate;
+      m_distance = rhs.m_distance;
+      m_geodesic = rhs.m_geodesic;
+      m_lambda = rhs.m_lambda;
+      m_plane = rhs.m_plane;
+      m_fixed = rhs.m_fixed;
     }
 
     return *this;
   }
 
-  void Watch::handle_fix(const Fix &fix, const char *name)
+  void Watch::set_debounce(const Debounce &debounce)
+  {
+    m_min_fixes = debounce.min_fixes < UINT8_MAX ?
+      debounce.min_fixes : UINT8_MAX;
+    m_min_dwell_ms = debounce.min_dwell_ms < UINT16_MAX ?
+      debounce.min_dwell_ms : UINT16_MAX;
+    m_coalesce_ms = debounce.coalesce_ms < UINT16_MAX ?
+      debounce.coalesce_ms : UINT16_MAX;
+  }
+
+  void Watch::set_window(const Window &window)
+  {
+    m_windowed = true;
+    m_window = window;
+  }
+
+  void Watch::clear_window()
+  {
+    m_windowed = false;
+  }
+
+  bool Watch::get_window(Window &window) const
+  {
+    if (m_windowed) {
+      window = m_window;
+    }
+    return m_windowed;
+  }
+
+  void Watch::bound_clearance(double distance, double &clearance) const
+  {
+    const double boundary = fabs(distance - m_rad);
+    if (boundary < clearance) {
+      clearance = boundary;
+    }
+  }
+
+  void Watch::bound_clearance_sq(double distance_sq, double &clearance) const
+  /* As bound_clearance(), but only taking the square root where the fix
+   * may be nearer the boundary than the clearance so far */
+  {
+    const double outer = m_rad + clearance;
+    const double inner = m_rad - clearance;
+    if (distance_sq < outer * outer &&
+        (inner <= 0 || distance_sq > inner * inner)) {
+      bound_clearance(sqrt(distance_sq), clearance);
+    }
+  }
+
+  void Watch::get_debounce(Debounce &debounce) const
+  {
+    debounce.min_fixes = m_min_fixes;
+    debounce.min_dwell_ms = m_min_dwell_ms;
+    debounce.coalesce_ms = m_coalesce_ms;
+  }
+
+  double Watch::get_lat() const
+  {
+    return m_lat;
+  }
+
+  double Watch::get_lon() const
+  {
+    return m_lon;
+  }
+
+  double Watch::get_rad() const
+  {
+    return m_rad;
+  }
+
+  Model Watch::get_model() const
+  {
+    return m_model;
+  }
+
+  Precision Watch::get_precision() const
+  {
+    return m_precision;
+  }
+
+  WatchAlarm Watch::get_alarm() const
+  {
+    return m_alarm;
+  }
+
+  WatchHandler Watch::get_handler() const
+  {
+    return m_handler;
+  }
+
+  void* Watch::get_data() const
+  {
+    return m_data;
+  }
+
+  Math::State Watch::get_state() const
+  {
+    return m_state;
+  }
+
+  void Watch::set_state(Math::State state)
+  {
+    m_state = state;
+    m_pending = state;
+    m_pending_fixes = 0;
+    m_predicted = false;
+  }
+
+  Math::State Watch::evaluate_spherical(const Fix &fix,
+                                        const Math::Here &UNUSED(here),
+                                        double &distance, double &clearance)
+  {
+    Math::State state = Math::STATE_UNKNOWN;
+    distance = fabs((*m_distance)(fix, m_lat, m_lon, m_rad, state));
+    bound_clearance(distance, clearance);
+    return state;
+  }
+
+  Math::State Watch::evaluate_ellipsoidal(const Fix &fix,
+                                          const Math::Here &here,
+                                          double &distance, double &clearance)
   {
     Math::State state = Math::STATE_UNKNOWN;
-    const double distance =
-      fabs(Math::distance(fix, m_lat, m_lon, m_rad, state));
+    const Math::Geodesic &here_geodesic = Math::here_geodesic(here, fix);
+    distance = fabs(Math::geodesic_distance(fix, here_geodesic, m_geodesic,
+                                            m_lat, m_lon, m_rad,
+                                            m_lambda, state));
+    bound_clearance(distance, clearance);
+    return state;
+  }
 
+  Math::State Watch::evaluate_plane(const Fix &fix,
+                                    const Math::Here &here,
+                                    double &distance, double &clearance)
+  {
+    double distance_sq = 0;
+    const Math::State state =
+      Math::plane_classify(fix, here, m_plane, m_rad, distance_sq);
+
+    /* N.B. The distance is only needed for an alarm, so avoid the square
+     * root unless the state has changed */
     if (state != m_state) {
-      if (NULL != m_alarm) {
+      distance = sqrt(distance_sq);
+    }
+    bound_clearance_sq(distance_sq, clearance);
+    return state;
+  }
+
+  Math::State Watch::evaluate_fixed(const Fix &UNUSED(fix),
+                                    const Math::Here &here,
+                                    double &distance, double &clearance)
+  {
+    int64_t distance_sq = 0;
+    const Math::State state =
+      Math::fixed_classify(here.fixed, m_fixed, distance_sq);
+
+    /* N.B. The distance is only needed for an alarm, so avoid the square
+     * root unless the state has changed */
+    if (state != m_state) {
+      distance = Math::fixed_distance(here.fixed, m_fixed);
+    }
+    /* N.B. Beyond the bounding box, the fix is at least a radius clear of
+     * the boundary, so the distance is only needed for a greater clearance */
+    if (distance_sq < 0 && here.fixed.valid && m_rad < clearance) {
+      distance_sq = Math::fixed_distance_sq(here.fixed, m_fixed);
+    }
+    if (distance_sq >= 0) {
+      bound_clearance_sq(distance_sq / 1e4, clearance);
+    }
+    return state;
+  }
+
+  bool Watch::handle_fix(const Fix &fix, const Math::Here &here,
+                         uint32_t now_ms, double &clearance,
+                         WatchEvent &watch_event)
+  {
+    double distance = NAN;
+    const Math::State state =
+      (this->*m_evaluate)(fix, here, distance, clearance);
+
+    Event event = EVENT_NONE;
+    if (Math::STATE_UNKNOWN == state) {
+      /* N.B. A fix in the error zone neither confirms nor cancels a
+       * pending state */
+    } else if (state == m_state) {
+      /* Cancel any pending state */
+      m_pending = m_state;
+    } else {
+      if (state != m_pending) {
+        m_pending = state;
+        m_pending_fixes = 0;
+        m_pending_since_ms = now_ms;
+      }
+      if (UINT8_MAX != m_pending_fixes) {
+        ++m_pending_fixes;
+      }
+
+      /* N.B. Hold back a departure for the coalescing window too */
+      const uint32_t dwell_ms = m_min_dwell_ms +
+        (Math::STATE_NEAR == m_state ? m_coalesce_ms : 0);
+      if (m_pending_fixes >= m_min_fixes &&
+          now_ms - m_pending_since_ms >= dwell_ms) {
         /* Figure out the event type for the alarm */
-        Event event = EVENT_NONE;
         switch (state) {
-        case Math::STATE_UNKNOWN:
-          /* FAR -> UNKNOWN: No event (transition through error zone) */
-          /* NEAR -> UNKNOWN: No event (transition through error zone) */
-          break;
         case Math::STATE_FAR:
           /* UNKNOWN -> FAR: No event (initially found FAR) */
           /* NEAR -> FAR: DEPART */
@@ -96,16 +432,784 @@ namespace libsitu {
           LIBSITU_WARN("Invalid state\n");
           break;
         }
-        if (EVENT_NONE != event) {
-          (*m_alarm)(name, distance, event, m_data);
+
+        /* N.B. The unknown state is never recorded */
+        m_state = state;
+        m_predicted = false;
+      }
+    }
+
+    /* Predict an arrival, once per approach; the prediction is renewed
+     * once the receiver is well clear of the watch again */
+    double arrival = INFINITY;
+    if (EVENT_NONE == event && Math::STATE_FAR == m_state &&
+        here.motion.has_velocity) {
+      arrival = Math::arrival_s(fix, here, m_lat, m_lon, m_rad);
+      if (arrival <= here.motion.lead_s && !m_predicted) {
+        m_predicted = true;
+        event = EVENT_PREDICT;
+        Math::State unused = Math::STATE_UNKNOWN;
+        distance = fabs((*m_distance)(fix, m_lat, m_lon, m_rad, unused));
+      } else if (arrival > 2 * here.motion.lead_s) {
+        m_predicted = false;
+      }
+    }
+
+    if (EVENT_NONE == event) {
+      return false;
+    }
+
+    /* N.B. The crossing is interpolated only where the event is raised by
+     * the first fix found in the new state */
+    watch_event.time = fix.time;
+    watch_event.latitude = fix.latitude;
+    watch_event.longitude = fix.longitude;
+    double t = 0;
+    if (EVENT_PREDICT == event) {
+      Math::offset_position(fix, here, here.motion.vx * arrival,
+                            here.motion.vy * arrival, watch_event.latitude,
+                            watch_event.longitude);
+      watch_event.time = 0 == fix.time ? 0 : fix.time + arrival;
+    } else if (1 == m_pending_fixes &&
+               Math::step_crossing(fix, here, m_lat, m_lon, m_rad,
+                                   EVENT_ARRIVE == event, t)) {
+      Math::offset_position(fix, here, (t - 1) * here.motion.step_x,
+                            (t - 1) * here.motion.step_y,
+                            watch_event.latitude, watch_event.longitude);
+      watch_event.time = fix.time + (t - 1) * here.motion.step_s;
+    }
+
+    watch_event.event = event;
+    watch_event.distance = distance;
+    watch_event.alarm = m_alarm;
+    watch_event.handler = m_handler;
+    watch_event.data = m_data;
+    return true;
+  }
+
+  WatchTable::Binding::Binding(const char *key, WatchAlarm alarm,
+                               WatchHandler handler, void *data)
+    : key(key), alarm(alarm), handler(handler), data(data)
+  {
+  }
+
+  WatchTable::Binding::Binding(const Binding &original)
+    : key(original.key),
+      alarm(original.alarm),
+      handler(original.handler),
+      data(original.data)
+  {
+  }
+
+  WatchTable::Binding& WatchTable::Binding::operator=(const Binding &rhs)
+  {
+    if (this != &rhs) {
+      key = rhs.key;
+      alarm = rhs.alarm;
+      handler = rhs.handler;
+      data = rhs.data;
+    }
+
+    return *this;
+  }
+
+  WatchTable::WatchTable()
+    : m_watches(),
+      m_ids(),
+      m_slots(),
+      m_free(),
+      m_named(),
+      m_names(),
+      m_events(),
+      m_bindings(),
+      m_version(0),
+      m_active(0),
+      m_wheel(),
+      m_expired(),
+      m_routes(),
+      m_resyncs(0)
+  {
+    /* N.B. The time zone is loaded on first use, which would otherwise be
+     * the first window applied on the fix path */
+    tzset();
+  }
+
+  WatchTable::~WatchTable()
+  {
+  }
+
+  WatchId WatchTable::add(const Watch &watch, const char *name)
+  {
+    uint32_t slot = 0;
+    if (m_free.empty()) {
+      /* N.B. The last slot is reserved, so that no identifier is ever
+       * WATCH_ID_INVALID */
+      if (m_slots.size() >= WATCH_INDEX_MASK) {
+        LIBSITU_WARN("Too many watches\n");
+        return WATCH_ID_INVALID;
+      }
+      slot = m_slots.size();
+      const Slot fresh = { 0, 0, LIBSITU_ROUTE_NONE, 0 };
+      m_slots.push_back(fresh);
+      m_names.push_back(NULL);
+      /* N.B. So that removal never allocates */
+      if (m_free.capacity() < m_slots.size()) {
+        m_free.reserve(m_slots.capacity());
+      }
+    } else {
+      slot = m_free.back();
+      m_free.pop_back();
+    }
+
+    const WatchId id =
+      (m_slots[slot].generation << WATCH_INDEX_BITS) | slot;
+    m_slots[slot].dense = m_watches.size();
+    m_watches.push_back(watch);
+    m_ids.push_back(id);
+    /* N.B. So that handling a fix never allocates */
+    if (m_events.capacity() < m_watches.size()) {
+      m_events.reserve(m_watches.capacity());
+    }
+    /* N.B. A new watch is active, until given a window */
+    swap_dense(m_active, m_slots[slot].dense);
+    ++m_active;
+
+    /* N.B. Names must be unique; the caller removes any existing watch of
+     * the same name first */
+    if (NULL != name) {
+      const NameMap::iterator iter =
+        m_named.insert(NameMap::value_type(name, id)).first;
+      m_names[slot] = iter->first.c_str();
+    }
+
+    ++m_version;
+    return id;
+  }
+
+  bool WatchTable::remove(WatchId id)
+  {
+    uint32_t slot = 0;
+    if (!lookup(id, slot)) {
+      return false;
+    }
+
+    /* Move the last active watch into the vacated position, if active,
+     * then the last watch into the position vacated by that */
+    uint32_t dense = m_slots[slot].dense;
+    if (dense < m_active) {
+      --m_active;
+      swap_dense(dense, m_active);
+      dense = m_active;
+    }
+    const uint32_t last = m_watches.size() - 1;
+    if (dense != last) {
+      m_watches[dense] = m_watches[last];
+      m_ids[dense] = m_ids[last];
+      m_slots[m_ids[dense] & WATCH_INDEX_MASK].dense = dense;
+    }
+    m_watches.pop_back();
+    m_ids.pop_back();
+    m_wheel.cancel(slot);
+
+    /* N.B. The route skips the stop from now on */
+    if (LIBSITU_ROUTE_NONE != m_slots[slot].route) {
+      m_routes[m_slots[slot].route].slots[m_slots[slot].stop] =
+        LIBSITU_ROUTE_NONE;
+      m_slots[slot].route = LIBSITU_ROUTE_NONE;
+    }
+
+    if (NULL != m_names[slot]) {
+      m_named.erase(m_names[slot]);
+      m_names[slot] = NULL;
+    }
+
+    /* N.B. The generation wraps within the bits left by the index, short
+     * of the generations of compact and database watches */
+    m_slots[slot].generation =
+      (m_slots[slot].generation + 1) % (WATCH_COMPACT >> WATCH_INDEX_BITS);
+    m_free.push_back(slot);
+
+    ++m_version;
+    return true;
+  }
+
+  WatchId WatchTable::find(const char *name) const
+  {
+    const NameMap::const_iterator iter = m_named.find(name);
+    return m_named.end() == iter ? WATCH_ID_INVALID : iter->second;
+  }
+
+  size_t WatchTable::size() const
+  {
+    return m_watches.size();
+  }
+
+  void WatchTable::reserve(size_t count)
+  {
+    m_watches.reserve(count);
+    m_ids.reserve(count);
+    m_slots.reserve(count);
+    m_free.reserve(count);
+    m_names.reserve(count);
+    m_events.reserve(count);
+    m_wheel.reserve(count);
+    m_expired.reserve(count);
+  }
+
+  uint32_t WatchTable::version() const
+  {
+    return m_version;
+  }
+
+  WatchId WatchTable::id_at(size_t index) const
+  {
+    return m_ids[index];
+  }
+
+  const Watch& WatchTable::watch_at(size_t index) const
+  {
+    return m_watches[index];
+  }
+
+  const char* WatchTable::name_at(size_t index) const
+  {
+    return m_names[m_ids[index] & WATCH_INDEX_MASK];
+  }
+
+  void WatchTable::bind(const char *key, WatchAlarm alarm,
+                        WatchHandler handler, void *data)
+  {
+    for (size_t i = 0; i < m_bindings.size(); ++i) {
+      if (m_bindings[i].key == key) {
+        m_bindings[i].alarm = alarm;
+        m_bindings[i].handler = handler;
+        m_bindings[i].data = data;
+        return;
+      }
+    }
+    m_bindings.push_back(Binding(key, alarm, handler, data));
+  }
+
+  void WatchTable::copy_bindings(const WatchTable &other)
+  {
+    m_bindings = other.m_bindings;
+  }
+
+  const char* WatchTable::binding_key(const Watch &watch) const
+  {
+    for (size_t i = 0; i < m_bindings.size(); ++i) {
+      if (m_bindings[i].alarm == watch.get_alarm() &&
+          m_bindings[i].handler == watch.get_handler() &&
+          m_bindings[i].data == watch.get_data()) {
+        return m_bindings[i].key.c_str();
+      }
+    }
+    return NULL;
+  }
+
+  bool WatchTable::find_binding(const char *key, WatchAlarm &alarm,
+                                WatchHandler &handler, void *&data) const
+  {
+    for (size_t i = 0; i < m_bindings.size(); ++i) {
+      if (m_bindings[i].key == key) {
+        alarm = m_bindings[i].alarm;
+        handler = m_bindings[i].handler;
+        data = m_bindings[i].data;
+        return true;
+      }
+    }
+    return false;
+  }
+
+  bool WatchTable::insert(const Watch &watch, const char *name, WatchId id)
+  {
+    Window window;
+    const uint32_t slot = id & WATCH_INDEX_MASK;
+    if (WATCH_ID_INVALID == id || slot >= WATCH_INDEX_MASK ||
+        slot < m_slots.size()) {
+      LIBSITU_WARN("Watch identifier %08x out of order\n", id);
+      return false;
+    } else if ((id >> WATCH_INDEX_BITS) >=
+               (WATCH_COMPACT >> WATCH_INDEX_BITS)) {
+      /* N.B. Generations from that of WATCH_COMPACT up are reserved, as
+       * in remove(); the id would be taken for a compact or database
+       * watch */
+      LIBSITU_WARN("Watch identifier %08x reserved\n", id);
+      return false;
+    }
+
+    /* N.B. Slots skipped over are free */
+    while (m_slots.size() < slot) {
+      const Slot fresh = { 0, 0, LIBSITU_ROUTE_NONE, 0 };
+      m_free.push_back(m_slots.size());
+      m_slots.push_back(fresh);
+      m_names.push_back(NULL);
+    }
+    const Slot restored = { static_cast<uint32_t>(m_watches.size()),
+                            id >> WATCH_INDEX_BITS, LIBSITU_ROUTE_NONE, 0 };
+    m_slots.push_back(restored);
+    m_names.push_back(NULL);
+    m_watches.push_back(watch);
+    m_ids.push_back(id);
+    swap_dense(m_active, restored.dense);
+    ++m_active;
+    /* N.B. The window is applied on the next advance; a watch whose
+     * window is then open keeps its restored state */
+    if (watch.get_window(window)) {
+      m_wheel.schedule(slot, 0);
+    }
+    if (m_free.capacity() < m_slots.size()) {
+      m_free.reserve(m_slots.capacity());
+    }
+    if (m_events.capacity() < m_watches.size()) {
+      m_events.reserve(m_watches.capacity());
+    }
+    if (m_expired.capacity() < m_slots.size()) {
+      m_expired.reserve(m_slots.capacity());
+    }
+
+    if (NULL != name) {
+      const NameMap::iterator iter =
+        m_named.insert(NameMap::value_type(name, id)).first;
+      m_names[slot] = iter->first.c_str();
+    }
+
+    ++m_version;
+    return true;
+  }
+
+  void WatchTable::swap_watches(WatchTable &other)
+  {
+    /* N.B. Swapping a map does not move its keys, so the slot names
+     * remain valid */
+    m_watches.swap(other.m_watches);
+    m_ids.swap(other.m_ids);
+    m_slots.swap(other.m_slots);
+    m_free.swap(other.m_free);
+    m_named.swap(other.m_named);
+    m_names.swap(other.m_names);
+    m_events.swap(other.m_events);
+    std::swap(m_active, other.m_active);
+    m_wheel.swap(other.m_wheel);
+    m_routes.swap(other.m_routes);
+    ++m_version;
+    ++other.m_version;
+  }
+
+  bool WatchTable::set_debounce(WatchId id, const Debounce &debounce)
+  {
+    uint32_t slot = 0;
+    if (!lookup(id, slot)) {
+      return false;
+    }
+    m_watches[m_slots[slot].dense].set_debounce(debounce);
+    return true;
+  }
+
+  bool WatchTable::set_window(WatchId id, const Window &window, time_t now)
+  {
+    uint32_t slot = 0;
+    if (!lookup(id, slot)) {
+      return false;
+    }
+    if (LIBSITU_ROUTE_NONE != m_slots[slot].route) {
+      LIBSITU_WARN("Watch %08x is in a route\n", id);
+      return false;
+    }
+    if (window.start_s < 0 || window.start_s >= LIBSITU_SECONDS_PER_DAY ||
+        window.end_s < 0 || window.end_s >= LIBSITU_SECONDS_PER_DAY ||
+        window.days > 0x7f) {
+      LIBSITU_WARN("Invalid window %d-%d, days %x\n",
+                   window.start_s, window.end_s, window.days);
+      return false;
+    }
+
+    /* N.B. So that the windows expiring together are collected without
+     * allocating, on the fix path */
+    if (m_expired.capacity() < m_slots.size()) {
+      m_expired.reserve(m_slots.capacity());
+    }
+
+    /* N.B. So that the wheel is current before the watch is scheduled */
+    advance(now);
+    m_watches[m_slots[slot].dense].set_window(window);
+    apply_window(slot, now);
+    return true;
+  }
+
+  bool WatchTable::clear_window(WatchId id)
+  {
+    uint32_t slot = 0;
+    if (!lookup(id, slot)) {
+      return false;
+    }
+    m_watches[m_slots[slot].dense].clear_window();
+    m_wheel.cancel(slot);
+    /* N.B. A route watch has no window, and is active as its route
+     * dictates */
+    if (LIBSITU_ROUTE_NONE == m_slots[slot].route) {
+      activate(slot);
+    }
+    return true;
+  }
+
+  void WatchTable::advance(time_t now)
+  {
+    m_expired.clear();
+    m_wheel.advance(now, m_expired);
+    for (size_t i = 0; i < m_expired.size(); ++i) {
+      apply_window(m_expired[i], now);
+    }
+  }
+
+  time_t WatchTable::next_change() const
+  {
+    const uint64_t next = m_wheel.next_expiry();
+    return UINT64_MAX == next ? static_cast<time_t>(-1) :
+      static_cast<time_t>(next);
+  }
+
+  void WatchTable::swap_dense(uint32_t a, uint32_t b)
+  {
+    if (a != b) {
+      std::swap(m_watches[a], m_watches[b]);
+      std::swap(m_ids[a], m_ids[b]);
+      m_slots[m_ids[a] & WATCH_INDEX_MASK].dense = a;
+      m_slots[m_ids[b] & WATCH_INDEX_MASK].dense = b;
+    }
+  }
+
+  void WatchTable::activate(uint32_t slot)
+  /* N.B. The state of a watch is unknown when it becomes active, as for a
+   * new watch */
+  {
+    const uint32_t dense = m_slots[slot].dense;
+    if (dense >= m_active) {
+      m_watches[dense].set_state(Math::STATE_UNKNOWN);
+      swap_dense(dense, m_active);
+      ++m_active;
+    }
+  }
+
+  void WatchTable::deactivate(uint32_t slot)
+  {
+    const uint32_t dense = m_slots[slot].dense;
+    if (dense < m_active) {
+      m_watches[dense].set_state(Math::STATE_UNKNOWN);
+      --m_active;
+      swap_dense(dense, m_active);
+    }
+  }
+
+  void WatchTable::apply_window(uint32_t slot, time_t now)
+  /* Activate or deactivate a watch according to its window, and schedule
+   * the next change */
+  {
+    Window window;
+    if (!m_watches[m_slots[slot].dense].get_window(window)) {
+      return;
+    }
+    time_t change = 0;
+    if (window_is_open(window, now, change)) {
+      activate(slot);
+    } else {
+      deactivate(slot);
+    }
+    m_wheel.schedule(slot, change);
+  }
+
+  const WatchEvent* WatchTable::handle_fix(const Fix &fix,
+                                           const Math::Here &here,
+                                           uint32_t now_ms,
+                                           double &clearance, size_t &count)
+  {
+    m_events.clear();
+    /* N.B. Inactive watches, at the end of the array, cost nothing */
+    for (size_t i = 0; i < m_active; ++i) {
+      WatchEvent event;
+      if (m_watches[i].handle_fix(fix, here, now_ms, clearance, event)) {
+        const WatchId id = m_ids[i];
+        event.id = id;
+        event.name = m_names[id & WATCH_INDEX_MASK];
+        m_events.push_back(event);
+      }
+    }
+
+    /* N.B. Routes change the active watches only once the scan is done;
+     * the events identify their watches by slot, not dense index */
+    if (!m_routes.empty()) {
+      for (size_t i = 0; i < m_events.size(); ++i) {
+        const Slot &slot = m_slots[m_events[i].id & WATCH_INDEX_MASK];
+        /* N.B. A predicted arrival is not progress along the route */
+        if (LIBSITU_ROUTE_NONE != slot.route &&
+            EVENT_PREDICT != m_events[i].event) {
+          Route &route = m_routes[slot.route];
+          if (LIBSITU_ROUTE_NONE == route.moved || slot.stop > route.moved) {
+            route.moved = slot.stop;
+          }
         }
       }
+      for (size_t r = 0; r < m_routes.size(); ++r) {
+        if (m_routes[r].in_use) {
+          follow_route(m_routes[r], fix);
+        }
+      }
+    }
 
-      /* N.B. Don't record the unknown state */
-      if (Math::STATE_UNKNOWN != state) {
-        m_state = state;
+    count = m_events.size();
+    return m_events.empty() ? NULL : &m_events[0];
+  }
+
+  RouteId WatchTable::add_route(const WatchId *ids, size_t count,
+                                unsigned ahead)
+  {
+    if (0 == count || count > LIBSITU_ROUTE_NONE) {
+      LIBSITU_WARN("Invalid route of %zu stops\n", count);
+      return ROUTE_ID_INVALID;
+    }
+
+    uint32_t index = 0;
+    while (index < m_routes.size() && m_routes[index].in_use) {
+      ++index;
+    }
+    if (index > LIBSITU_ROUTE_INDEX_MASK) {
+      LIBSITU_WARN("Too many routes\n");
+      return ROUTE_ID_INVALID;
+    }
+    if (index == m_routes.size()) {
+      const Route fresh = {
+        std::vector<uint32_t>(), std::vector<double>(), 0, 0, 0,
+        LIBSITU_ROUTE_NONE, 0, false, false
+      };
+      m_routes.push_back(fresh);
+    }
+    Route &route = m_routes[index];
+
+    /* N.B. Claim the watches one by one, and give them back if one of
+     * them cannot be claimed */
+    route.slots.resize(count);
+    route.legs.resize(count);
+    for (size_t i = 0; i < count; ++i) {
+      uint32_t slot = 0;
+      Window window;
+      if (!lookup(ids[i], slot) ||
+          LIBSITU_ROUTE_NONE != m_slots[slot].route ||
+          m_watches[m_slots[slot].dense].get_window(window)) {
+        LIBSITU_WARN("Watch %08x is missing, in a route, or windowed\n",
+                     ids[i]);
+        for (size_t j = 0; j < i; ++j) {
+          m_slots[route.slots[j]].route = LIBSITU_ROUTE_NONE;
+        }
+        route.slots.clear();
+        route.legs.clear();
+        return ROUTE_ID_INVALID;
+      }
+      m_slots[slot].route = index;
+      m_slots[slot].stop = i;
+      route.slots[i] = slot;
+    }
+
+    /* N.B. Legs are measured between the centres of the stops */
+    const Math::DistanceFunction distance =
+      Math::distance_function(PRECISION_DOUBLE);
+    route.legs[0] = 0;
+    for (size_t i = 1; i < count; ++i) {
+      const Watch &from = m_watches[m_slots[route.slots[i - 1]].dense];
+      const Watch &to = m_watches[m_slots[route.slots[i]].dense];
+      Fix at = Fix();
+      at.latitude = from.get_lat();
+      at.longitude = from.get_lon();
+      Math::State state;
+      route.legs[i] =
+        (*distance)(at, to.get_lat(), to.get_lon(), to.get_rad(), state);
+    }
+
+    for (size_t i = 0; i < count; ++i) {
+      deactivate(route.slots[i]);
+    }
+    route.ahead = std::max(ahead, 1u);
+    route.moved = LIBSITU_ROUTE_NONE;
+    route.resync_clearance = 0;
+    route.synced = false;
+    route.in_use = true;
+    /* N.B. The first fix resynchronises the route */
+    route.cursor = 0;
+    for (uint32_t i = 0; i <= route.ahead && i < count; ++i) {
+      activate(route.slots[i]);
+    }
+
+    return (route.generation << LIBSITU_ROUTE_INDEX_BITS) | index;
+  }
+
+  bool WatchTable::remove_route(RouteId id)
+  {
+    uint32_t index = 0;
+    if (!lookup_route(id, index)) {
+      return false;
+    }
+    Route &route = m_routes[index];
+    for (size_t i = 0; i < route.slots.size(); ++i) {
+      const uint32_t slot = route.slots[i];
+      if (LIBSITU_ROUTE_NONE != slot) {
+        m_slots[slot].route = LIBSITU_ROUTE_NONE;
+        activate(slot);
+      }
+    }
+    route.slots.clear();
+    route.legs.clear();
+    route.in_use = false;
+    route.generation = (route.generation + 1) %
+      (ROUTE_ID_INVALID >> LIBSITU_ROUTE_INDEX_BITS);
+    return true;
+  }
+
+  bool WatchTable::get_route_cursor(RouteId id, size_t &cursor) const
+  {
+    uint32_t index = 0;
+    if (!lookup_route(id, index)) {
+      return false;
+    }
+    cursor = m_routes[index].cursor;
+    return true;
+  }
+
+  unsigned long WatchTable::route_resyncs() const
+  {
+    return m_resyncs;
+  }
+
+  bool WatchTable::lookup_route(RouteId id, uint32_t &route) const
+  {
+    if (ROUTE_ID_INVALID == id) {
+      return false;
+    }
+    route = id & LIBSITU_ROUTE_INDEX_MASK;
+    return route < m_routes.size() && m_routes[route].in_use &&
+      m_routes[route].generation == id >> LIBSITU_ROUTE_INDEX_BITS;
+  }
+
+  void WatchTable::move_cursor(Route &route, uint32_t cursor)
+  /* Move the cursor of a route, deactivating the stops that leave its
+   * window, and activating those that enter it */
+  {
+    const uint32_t count = route.slots.size();
+    const uint32_t end = std::min(count, route.cursor + route.ahead + 1);
+    const uint32_t new_end = std::min(count, cursor + route.ahead + 1);
+    for (uint32_t i = route.cursor; i < end; ++i) {
+      if ((i < cursor || i >= new_end) &&
+          LIBSITU_ROUTE_NONE != route.slots[i]) {
+        deactivate(route.slots[i]);
+      }
+    }
+    for (uint32_t i = cursor; i < new_end; ++i) {
+      if (LIBSITU_ROUTE_NONE != route.slots[i]) {
+        activate(route.slots[i]);
       }
     }
+    route.cursor = cursor;
+  }
+
+  void WatchTable::follow_route(Route &route, const Fix &fix)
+  /* Move the cursor of a route on from the stops that the receiver has
+   * left, and resynchronise the route if the receiver is not where its
+   * sequence says it should be */
+  {
+    const uint32_t count = route.slots.size();
+    const uint32_t end = std::min(count, route.cursor + route.ahead + 1);
+
+    /* N.B. The cursor stays at the first stop the receiver is still at,
+     * up to the furthest stop raising an event; overlapping stops are
+     * departed in turn */
+    if (LIBSITU_ROUTE_NONE != route.moved) {
+      uint32_t cursor = route.moved + 1;
+      for (uint32_t i = route.cursor; i <= route.moved; ++i) {
+        if (LIBSITU_ROUTE_NONE != route.slots[i] &&
+            Math::STATE_NEAR ==
+            m_watches[m_slots[route.slots[i]].dense].get_state()) {
+          cursor = i;
+          break;
+        }
+      }
+      move_cursor(route, std::min(cursor, count - 1));
+      route.moved = LIBSITU_ROUTE_NONE;
+      route.resync_clearance = 0;
+      return;
+    }
+    if (!route.synced) {
+      resync(route, fix);
+      return;
+    }
+
+    /* N.B. At a stop, the receiver is in sequence */
+    double clearance = INFINITY;
+    const Math::DistanceFunction distance =
+      Math::distance_function(PRECISION_DOUBLE);
+    for (uint32_t i = route.cursor; i < end; ++i) {
+      if (LIBSITU_ROUTE_NONE == route.slots[i]) {
+        continue;
+      }
+      const Watch &watch = m_watches[m_slots[route.slots[i]].dense];
+      if (Math::STATE_NEAR == watch.get_state()) {
+        return;
+      }
+      Math::State state;
+      clearance = std::min(clearance,
+                           (*distance)(fix, watch.get_lat(), watch.get_lon(),
+                                       watch.get_rad(), state) -
+                           watch.get_rad());
+    }
+
+    /* N.B. Far from the stops, once resynchronised, only resynchronise
+     * again as the receiver gets further away */
+    double tolerance = route.legs[route.cursor];
+    if (route.cursor + 1 < count) {
+      tolerance = std::max(tolerance, route.legs[route.cursor + 1]);
+    }
+    tolerance = std::max(tolerance * LIBSITU_ROUTE_SLACK,
+                         route.resync_clearance * 2);
+    if (clearance > tolerance) {
+      resync(route, fix);
+    }
+  }
+
+  void WatchTable::resync(Route &route, const Fix &fix)
+  /* Scan every stop of a route, and move the cursor to the nearest */
+  {
+    const Math::DistanceFunction distance =
+      Math::distance_function(PRECISION_DOUBLE);
+    uint32_t nearest = route.cursor;
+    double clearance = INFINITY;
+    for (uint32_t i = 0; i < route.slots.size(); ++i) {
+      if (LIBSITU_ROUTE_NONE == route.slots[i]) {
+        continue;
+      }
+      const Watch &watch = m_watches[m_slots[route.slots[i]].dense];
+      Math::State state;
+      const double stop_clearance =
+        (*distance)(fix, watch.get_lat(), watch.get_lon(), watch.get_rad(),
+                    state) - watch.get_rad();
+      if (stop_clearance < clearance) {
+        clearance = stop_clearance;
+        nearest = i;
+      }
+    }
+
+    move_cursor(route, nearest);
+    route.resync_clearance = std::max(clearance, 0.0);
+    route.synced = true;
+    ++m_resyncs;
+  }
+
+  bool WatchTable::lookup(WatchId id, uint32_t &slot) const
+  {
+    if (WATCH_ID_INVALID == id) {
+      return false;
+    }
+    slot = id & WATCH_INDEX_MASK;
+    return slot < m_slots.size() &&
+      m_slots[slot].generation == id >> WATCH_INDEX_BITS &&
+      m_slots[slot].dense < m_ids.size() &&
+      m_ids[m_slots[slot].dense] == id;
   }
 
 }
@@ -20,11 +20,18 @@
 #ifndef _LIBSITU_GPSWATCH_H_
 #define _LIBSITU_GPSWATCH_H_
 
-/* N.B. for definition of WatchAlarm */
+#include <time.h>
+
+#include <map>
+#include <string>
+#include <vector>
+
+/* N.B. for definitions of WatchAlarm, WatchHandler and WatchId */
 #include <libsitu.h>
 
 /* N.B. for definition of State */
 #include <gpsmath.h>
+#include <gpswheel.h>
 
 namespace libsitu {
 
@@ -33,18 +40,223 @@ namespace libsitu {
   class Watch {
   public:
     Watch();
-    Watch(double lat, double lon, double rad, WatchAlarm alarm, void *data);
+    Watch(double lat, double lon, double rad,
+          WatchAlarm alarm, WatchHandler handler, void *data,
+          Model model, Precision precision);
     ~Watch();
     Watch(const Watch &original);
     Watch& operator=(const Watch &rhs);
-    void handle_fix(const Fix &fix, const char *name);
+    void set_debounce(const Debounce &debounce);
+    void get_debounce(Debounce &debounce) const;
+    void set_window(const Window &window);
+    void clear_window();
+    /* N.B. False if the watch has no window */
+    bool get_window(Window &window) const;
+    double get_lat() const;
+    double get_lon() const;
+    double get_rad() const;
+    Model get_model() const;
+    Precision get_precision() const;
+    WatchAlarm get_alarm() const;
+    WatchHandler get_handler() const;
+    void* get_data() const;
+    /* N.B. For restoring a saved watch; any pending state is discarded */
+    Math::State get_state() const;
+    void set_state(Math::State state);
+    /* N.B. Returns true, having filled in the event type, distance and
+     * callback fields of the event, if the fix raises an event
+     *
+     * The clearance is lowered to the distance of the fix from the watch
+     * boundary, if that is less; a clearance of zero is left unchanged,
+     * and costs nothing to track */
+    bool handle_fix(const Fix &fix, const Math::Here &here, uint32_t now_ms,
+                    double &clearance, WatchEvent &event);
   private:
+    /* N.B. The evaluator is chosen once, on construction */
+    typedef Math::State (Watch::*Evaluator)(const Fix &fix,
+                                            const Math::Here &here,
+                                            double &distance,
+                                            double &clearance);
+
+    Math::State evaluate_spherical(const Fix &fix, const Math::Here &here,
+                                   double &distance, double &clearance);
+    Math::State evaluate_ellipsoidal(const Fix &fix, const Math::Here &here,
+                                     double &distance, double &clearance);
+    Math::State evaluate_plane(const Fix &fix, const Math::Here &here,
+                               double &distance, double &clearance);
+    Math::State evaluate_fixed(const Fix &fix, const Math::Here &here,
+                               double &distance, double &clearance);
+
+    void bound_clearance(double distance, double &clearance) const;
+    void bound_clearance_sq(double distance_sq, double &clearance) const;
+
     double m_lat;
     double m_lon;
     double m_rad;
+    Model m_model;
+    Precision m_precision;
     WatchAlarm m_alarm;
+    WatchHandler m_handler;
     void *m_data;
     Math::State m_state;
+    /* Debounce rules, and the state pending commitment */
+    uint8_t m_min_fixes;
+    uint16_t m_min_dwell_ms;
+    uint16_t m_coalesce_ms;
+    uint8_t m_pending;
+    uint8_t m_pending_fixes;
+    uint32_t m_pending_since_ms;
+    /* N.B. An arrival has been predicted on the current approach */
+    bool m_predicted;
+    bool m_windowed;
+    Window m_window;
+    Evaluator m_evaluate;
+    Math::DistanceFunction m_distance;
+    Math::Geodesic m_geodesic;
+    double m_lambda;
+    Math::Plane m_plane;
+    Math::FixedThere m_fixed;
+  };
+
+  /* A set of watches, addressed by WatchId
+   *
+   * Watches are held in a dense array, so that evaluation is a linear
+   * scan. Each identifier refers to a slot, which records the dense
+   * index of its watch and a generation count; removal moves the last
+   * watch into the vacated position, so is constant time. Names are held
+   * in a separate table, for named watches only.
+   *
+   * The active watches come first in the dense array, and only they are
+   * evaluated. A watch with an activation window moves across the
+   * boundary, by exchange with the watch at the boundary, when a timer
+   * wheel, keyed by slot, reaches its next opening or closing time.
+   */
+  class WatchTable {
+  public:
+    WatchTable();
+    ~WatchTable();
+
+    WatchId add(const Watch &watch, const char *name);
+    bool remove(WatchId id);
+    WatchId find(const char *name) const;
+    size_t size() const;
+    void reserve(size_t count);
+    /* N.B. Changes whenever a watch is added or removed */
+    uint32_t version() const;
+    /* N.B. Dense order, which changes as watches are removed */
+    WatchId id_at(size_t index) const;
+    const Watch& watch_at(size_t index) const;
+    const char* name_at(size_t index) const;
+
+    /* Callback binding keys, by which saved watches are reconnected to
+     * their callbacks. A key names a set of callbacks and data. */
+    void bind(const char *key, WatchAlarm alarm, WatchHandler handler,
+              void *data);
+    void copy_bindings(const WatchTable &other);
+    /* N.B. NULL if the callbacks of the watch are not bound */
+    const char* binding_key(const Watch &watch) const;
+    bool find_binding(const char *key, WatchAlarm &alarm,
+                      WatchHandler &handler, void *&data) const;
+
+    /* N.B. For restoring a saved table: identifiers must be added in
+     * ascending order of slot index */
+    bool insert(const Watch &watch, const char *name, WatchId id);
+    /* N.B. Exchanges the watches, but not the bindings */
+    void swap_watches(WatchTable &other);
+    bool set_debounce(WatchId id, const Debounce &debounce);
+    bool set_window(WatchId id, const Window &window, time_t now);
+    bool clear_window(WatchId id);
+    /* N.B. Opens and closes the windows due by the wall clock time */
+    void advance(time_t now);
+    /* N.B. A lower bound on the time at which a window next opens or
+     * closes, or (time_t)-1 if none will */
+    time_t next_change() const;
+
+    /* Routes: ordered watches, of which only a window from a cursor is
+     * active; see Gps::add_route() */
+    RouteId add_route(const WatchId *ids, size_t count, unsigned ahead);
+    bool remove_route(RouteId id);
+    bool get_route_cursor(RouteId id, size_t &cursor) const;
+    unsigned long route_resyncs() const;
+
+    /* N.B. The events are valid until the next call. The clearance is
+     * lowered to the least distance of the fix from a watch boundary; see
+     * Watch::handle_fix(). Routes follow the events */
+    const WatchEvent* handle_fix(const Fix &fix, const Math::Here &here,
+                                 uint32_t now_ms, double &clearance,
+                                 size_t &count);
+
+  private:
+    WatchTable(const WatchTable&);
+    WatchTable& operator=(const WatchTable&);
+
+    typedef std::map<std::string,WatchId> NameMap;
+
+    struct Binding {
+      Binding(const char *key, WatchAlarm alarm, WatchHandler handler,
+              void *data);
+      Binding(const Binding &original);
+      Binding& operator=(const Binding &rhs);
+      std::string key;
+      WatchAlarm alarm;
+      WatchHandler handler;
+      void *data;
+    };
+
+    struct Slot {
+      uint32_t dense;
+      uint32_t generation;
+      /* N.B. The route of the watch, if any, and its stop in the route */
+      uint32_t route;
+      uint32_t stop;
+    };
+
+    /* A route, whose active stops are those from the cursor to ahead
+     * stops after it */
+    struct Route {
+      /* N.B. The slot of each stop, or none where removed */
+      std::vector<uint32_t> slots;
+      /* N.B. Great circle distance from the previous stop, in meters */
+      std::vector<double> legs;
+      uint32_t cursor;
+      uint32_t ahead;
+      uint32_t generation;
+      /* N.B. The furthest stop raising an event on the current fix */
+      uint32_t moved;
+      /* N.B. The clearance found by the last resynchronisation, while the
+       * cursor has not moved since */
+      double resync_clearance;
+      bool synced;
+      bool in_use;
+    };
+
+    bool lookup(WatchId id, uint32_t &slot) const;
+    void swap_dense(uint32_t a, uint32_t b);
+    void activate(uint32_t slot);
+    void deactivate(uint32_t slot);
+    void apply_window(uint32_t slot, time_t now);
+    bool lookup_route(RouteId id, uint32_t &route) const;
+    void move_cursor(Route &route, uint32_t cursor);
+    void follow_route(Route &route, const Fix &fix);
+    void resync(Route &route, const Fix &fix);
+
+    std::vector<Watch> m_watches;
+    std::vector<WatchId> m_ids;
+    std::vector<Slot> m_slots;
+    std::vector<uint32_t> m_free;
+    /* N.B. The slot names point into the keys of the name map */
+    NameMap m_named;
+    std::vector<const char*> m_names;
+    /* N.B. At most one event per watch per fix */
+    std::vector<WatchEvent> m_events;
+    std::vector<Binding> m_bindings;
+    uint32_t m_version;
+    /* N.B. The number of active watches, at the start of the array */
+    uint32_t m_active;
+    TimerWheel m_wheel;
+    std::vector<uint32_t> m_expired;
+    std::vector<Route> m_routes;
+    unsigned long m_resyncs;
   };
 
 }
@@ -0,0 +1,233 @@
+/*
+  Copyright 2013-2014 Simon Dawson
+
+  This file is part of libsitu.
+
+  libsitu is free software: you can redistribute it and/or modify
+  it under the terms of the GNU Lesser General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  libsitu is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU Lesser General Public License for more details.
+
+  You should have received a copy of the GNU Lesser General Public License
+  along with libsitu.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <algorithm>
+
+#include <gpswheel.h>
+
+#define LIBSITU_WHEEL_NONE 0xffffffffu
+
+namespace libsitu {
+
+  TimerWheel::TimerWheel()
+    : m_timers(),
+      m_heads(WHEEL_LEVELS * WHEEL_SLOTS, LIBSITU_WHEEL_NONE),
+      m_now_s(0),
+      m_count(0)
+  {
+  }
+
+  TimerWheel::~TimerWheel()
+  {
+  }
+
+  void TimerWheel::reserve(size_t count)
+  {
+    if (m_timers.size() < count) {
+      const Timer idle = {
+        LIBSITU_WHEEL_NONE, LIBSITU_WHEEL_NONE, 0, 0, false
+      };
+      m_timers.resize(count, idle);
+    }
+  }
+
+  void TimerWheel::link(uint32_t timer, uint64_t earliest_s)
+  /* Link a timer into the slot for its expiry, relative to the current
+   * time, or for the earliest time if that is later
+   *
+   * N.B. The slot of the current time has been drained once the time is
+   * reached, so a timer scheduled then waits for the next; but a timer
+   * cascading then is drained with that slot, in the same step.
+   */
+  {
+    Timer &entry = m_timers[timer];
+    const uint64_t expiry_s = std::max(entry.expiry_s, earliest_s);
+
+    /* N.B. A timer beyond the span of the wheel waits in the top level,
+     * and is placed again when that slot cascades */
+    const uint64_t span = static_cast<uint64_t>(1) <<
+      (WHEEL_BITS * WHEEL_LEVELS);
+    const uint64_t slot_s = expiry_s - m_now_s >= span ?
+      m_now_s + span - 1 : expiry_s;
+
+    unsigned level = 0;
+    while (level + 1 < WHEEL_LEVELS &&
+           slot_s - m_now_s >=
+           static_cast<uint64_t>(1) << (WHEEL_BITS * (level + 1))) {
+      ++level;
+    }
+    const uint32_t index = level * WHEEL_SLOTS +
+      ((slot_s >> (WHEEL_BITS * level)) & (WHEEL_SLOTS - 1));
+
+    entry.index = index;
+    entry.prev = LIBSITU_WHEEL_NONE;
+    entry.next = m_heads[index];
+    if (LIBSITU_WHEEL_NONE != entry.next) {
+      m_timers[entry.next].prev = timer;
+    }
+    m_heads[index] = timer;
+  }
+
+  void TimerWheel::unlink(uint32_t timer)
+  {
+    Timer &entry = m_timers[timer];
+    if (LIBSITU_WHEEL_NONE != entry.next) {
+      m_timers[entry.next].prev = entry.prev;
+    }
+    if (LIBSITU_WHEEL_NONE != entry.prev) {
+      m_timers[entry.prev].next = entry.next;
+    } else {
+      m_heads[entry.index] = entry.next;
+    }
+    entry.next = LIBSITU_WHEEL_NONE;
+    entry.prev = LIBSITU_WHEEL_NONE;
+  }
+
+  void TimerWheel::schedule(uint32_t timer, uint64_t expiry_s)
+  {
+    reserve(timer + 1);
+    if (m_timers[timer].scheduled) {
+      unlink(timer);
+    } else {
+      m_timers[timer].scheduled = true;
+      ++m_count;
+    }
+    m_timers[timer].expiry_s = expiry_s;
+    link(timer, m_now_s + 1);
+  }
+
+  void TimerWheel::cancel(uint32_t timer)
+  {
+    if (timer < m_timers.size() && m_timers[timer].scheduled) {
+      unlink(timer);
+      m_timers[timer].scheduled = false;
+      --m_count;
+    }
+  }
+
+  size_t TimerWheel::size() const
+  {
+    return m_count;
+  }
+
+  void TimerWheel::cascade(unsigned level)
+  /* Place the timers of the current slot of a level again, now that the
+   * current time has reached it */
+  {
+    const uint32_t index = level * WHEEL_SLOTS +
+      ((m_now_s >> (WHEEL_BITS * level)) & (WHEEL_SLOTS - 1));
+    uint32_t timer = m_heads[index];
+    m_heads[index] = LIBSITU_WHEEL_NONE;
+    while (LIBSITU_WHEEL_NONE != timer) {
+      const uint32_t next = m_timers[timer].next;
+      link(timer, m_now_s);
+      timer = next;
+    }
+  }
+
+  void TimerWheel::advance(uint64_t now_s, std::vector<uint32_t> &expired)
+  {
+    /* N.B. With nothing scheduled, there is nothing to step through; and
+     * rather than step through a long gap, place every timer again */
+    if (0 == m_count && now_s > m_now_s) {
+      m_now_s = now_s;
+    } else if (now_s > m_now_s + WHEEL_SLOTS * WHEEL_SLOTS) {
+      m_heads.assign(m_heads.size(), LIBSITU_WHEEL_NONE);
+      m_now_s = now_s;
+      for (uint32_t timer = 0; timer < m_timers.size(); ++timer) {
+        Timer &entry = m_timers[timer];
+        if (!entry.scheduled) {
+          continue;
+        }
+        if (entry.expiry_s <= now_s) {
+          entry.next = LIBSITU_WHEEL_NONE;
+          entry.prev = LIBSITU_WHEEL_NONE;
+          entry.scheduled = false;
+          --m_count;
+          expired.push_back(timer);
+        } else {
+          link(timer, m_now_s + 1);
+        }
+      }
+    }
+
+    while (m_now_s < now_s && 0 != m_count) {
+      ++m_now_s;
+
+      /* Cascade each level whose slot has just turned over, from the top
+       * down, so that timers reach the lowest level in time */
+      unsigned levels = 1;
+      while (levels < WHEEL_LEVELS &&
+             0 == (m_now_s & ((static_cast<uint64_t>(1) <<
+                               (WHEEL_BITS * levels)) - 1))) {
+        ++levels;
+      }
+      for (unsigned level = levels - 1; level > 0; --level) {
+        cascade(level);
+      }
+
+      const uint32_t index = m_now_s & (WHEEL_SLOTS - 1);
+      uint32_t timer = m_heads[index];
+      m_heads[index] = LIBSITU_WHEEL_NONE;
+      while (LIBSITU_WHEEL_NONE != timer) {
+        Timer &entry = m_timers[timer];
+        const uint32_t next = entry.next;
+        entry.next = LIBSITU_WHEEL_NONE;
+        entry.prev = LIBSITU_WHEEL_NONE;
+        entry.scheduled = false;
+        --m_count;
+        expired.push_back(timer);
+        timer = next;
+      }
+    }
+    if (now_s > m_now_s) {
+      m_now_s = now_s;
+    }
+  }
+
+  uint64_t TimerWheel::next_expiry() const
+  {
+    /* N.B. A timer in a higher level may expire before one in a lower
+     * level, so take the earliest over all levels; within a level above
+     * the lowest, only the start of the slot is known */
+    uint64_t next_s = UINT64_MAX;
+    for (unsigned level = 0; level < WHEEL_LEVELS && 0 != m_count; ++level) {
+      const unsigned shift = WHEEL_BITS * level;
+      for (uint64_t i = 1; i <= WHEEL_SLOTS; ++i) {
+        const uint64_t block = (m_now_s >> shift) + i;
+        const uint32_t index = level * WHEEL_SLOTS +
+          (block & (WHEEL_SLOTS - 1));
+        if (LIBSITU_WHEEL_NONE != m_heads[index]) {
+          next_s = std::min(next_s, block << shift);
+          break;
+        }
+      }
+    }
+    return next_s;
+  }
+
+  void TimerWheel::swap(TimerWheel &other)
+  {
+    m_timers.swap(other.m_timers);
+    m_heads.swap(other.m_heads);
+    std::swap(m_now_s, other.m_now_s);
+    std::swap(m_count, other.m_count);
+  }
+
+}
@@ -0,0 +1,90 @@
+/*
+  Copyright 2013-2014 Simon Dawson
+
+  This file is part of libsitu.
+
+  libsitu is free software: you can redistribute it and/or modify
+  it under the terms of the GNU Lesser General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  libsitu is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU Lesser General Public License for more details.
+
+  You should have received a copy of the GNU Lesser General Public License
+  along with libsitu.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef _LIBSITU_GPSWHEEL_H_
+#define _LIBSITU_GPSWHEEL_H_
+
+#include <stdint.h>
+
+#include <vector>
+
+namespace libsitu {
+
+  /* A hierarchical timer wheel, with a resolution of one second
+   *
+   * Timers are identified by a dense index (for watches, the slot index),
+   * and are linked into intrusive lists, so that scheduling and
+   * cancelling a timer are constant time, and allocate nothing once the
+   * timers are reserved. Each level of the wheel has WHEEL_SLOTS slots,
+   * each spanning WHEEL_SLOTS times as long as a slot of the level below;
+   * timers cascade down a level as their time approaches, so that each
+   * timer is handled at most once per level.
+   */
+  class TimerWheel {
+  public:
+    TimerWheel();
+    ~TimerWheel();
+
+    /* N.B. Timers from 0 to count - 1 */
+    void reserve(size_t count);
+    /* N.B. Replaces any existing schedule for the timer. A time already
+     * past expires on the next advance */
+    void schedule(uint32_t timer, uint64_t expiry_s);
+    void cancel(uint32_t timer);
+    size_t size() const;
+    /* N.B. Appends the timers expired by the time to the list. The
+     * current time only moves forward, and starts at zero: advance to
+     * the current time before scheduling relative to it */
+    void advance(uint64_t now_s, std::vector<uint32_t> &expired);
+    /* N.B. A lower bound on the earliest expiry, or UINT64_MAX if none */
+    uint64_t next_expiry() const;
+    void swap(TimerWheel &other);
+
+  private:
+    TimerWheel(const TimerWheel&);
+    TimerWheel& operator=(const TimerWheel&);
+
+    enum {
+      WHEEL_BITS = 6,
+      WHEEL_SLOTS = 1 << WHEEL_BITS,
+      WHEEL_LEVELS = 4
+    };
+
+    struct Timer {
+      uint32_t next;
+      uint32_t prev;
+      uint64_t expiry_s;
+      uint16_t index; /* Slot list, while scheduled */
+      bool scheduled;
+    };
+
+    void link(uint32_t timer, uint64_t earliest_s);
+    void unlink(uint32_t timer);
+    void cascade(unsigned level);
+
+    std::vector<Timer> m_timers;
+    /* N.B. Heads of the slot lists, level by level */
+    std::vector<uint32_t> m_heads;
+    uint64_t m_now_s;
+    size_t m_count;
+  };
+
+}
+
+#endif
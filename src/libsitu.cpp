@@ -17,43 +17,146 @@
   along with libsitu.  If not, see <http://www.gnu.org/licenses/>.
 */
 
+#include <math.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
+
+#include <algorithm>
 
 #include <gpsdebug.h>
 #include <libsitu.h>
+#include <gpscompact.h>
+#include <gpsdb.h>
+#include <gpsindex.h>
+#include <gpspoller.h>
+#include <gpsqueue.h>
+#include <gpsstate.h>
+#include <gpstrace.h>
 #include <gpswatch.h>
 
 namespace libsitu {
 
   void* poller(void *arg);
 
-  Gps::Gps(const char *host, const char *port, int poll_us, int sleep_us)
-    : m_host(strdup(host)),
-      m_port(strdup(port)),
+  namespace {
+
+    double monotonic_s()
+    /* Read the monotonic clock, in seconds */
+    {
+      struct timespec now;
+      if (0 != clock_gettime(CLOCK_MONOTONIC, &now)) {
+        LIBSITU_WARN("Failed to read monotonic clock\n");
+        return 0;
+      }
+      return now.tv_sec + now.tv_nsec / 1e9;
+    }
+
+  }
+
+  Gps::Gps(const char *host, const char *port, int poll_us, int sleep_us,
+           Transport transport, Polling polling, bool start)
+    : m_host(NULL == host ? NULL : strdup(host)),
+      m_port(NULL == port ? NULL : strdup(port)),
       m_poll_us(poll_us),
       m_sleep_us(sleep_us),
+      m_transport(transport),
+      m_polling_mode(polling),
+      m_messages(MESSAGE_ALL),
+      m_model(MODEL_SPHERICAL),
+      m_precision(PRECISION_DEFAULT),
+      m_lead_s(0),
+      m_debounce(),
+      m_schedule(),
       m_poll_thread(),
       m_watch_mutex(),
-      m_watches(),
+      m_watches(new WatchTable()),
+      m_index_mutex(),
+      m_index(new WatchIndex()),
+      m_database(new Database()),
+      m_compact(new CompactTable()),
+      m_subscribers(NULL),
+      m_held(NULL),
+      m_waiters(NULL),
+      m_woken(NULL),
+      m_wake_mutex(),
+      m_deliver_mutex(),
+      m_reschedule(),
+      m_session(NULL),
       m_polling(false),
+      m_connection(CONNECTION_CONNECTING),
+      m_next_sleep_us(sleep_us),
+      m_start_s(0),
+      m_stats(),
       m_last_fix()
   {
+    /* N.B. Rather than on the first message, which may be on the fix
+     * path */
+    Log::start();
+
     if (0 != pthread_mutex_init(&m_watch_mutex, NULL)) {
       LIBSITU_WARN("Failed to initialise watch mutex\n");
     }
+    if (0 != pthread_mutex_init(&m_index_mutex, NULL)) {
+      LIBSITU_WARN("Failed to initialise index mutex\n");
+    }
+    if (0 != pthread_mutex_init(&m_wake_mutex, NULL)) {
+      LIBSITU_WARN("Failed to initialise wake mutex\n");
+    }
+    if (0 != pthread_mutex_init(&m_deliver_mutex, NULL)) {
+      LIBSITU_WARN("Failed to initialise deliver mutex\n");
+    }
+    if (0 != sem_init(&m_reschedule, 0, 0)) {
+      LIBSITU_WARN("Failed to initialise reschedule semaphore\n");
+    }
 
-    start_polling();
+    if (POLLING_EXTERNAL == m_polling_mode) {
+      /* N.B. As the poller thread would */
+      Math::warm_up();
+      m_start_s = monotonic_s();
+      m_session = new Session(this);
+    } else if (start) {
+      start_polling();
+    }
   }
 
   Gps::~Gps()
   {
-    stop_polling();
+    /* N.B. A derived class may already have stopped the poller */
+    if (m_polling) {
+      stop_polling();
+    }
+    if (NULL != m_subscribers) {
+      LIBSITU_WARN("GPS interface destroyed before its subscriptions\n");
+    }
 
     if (0 != pthread_mutex_destroy(&m_watch_mutex)) {
       LIBSITU_WARN("Failed to destroy watch mutex\n");
     }
+    if (0 != pthread_mutex_destroy(&m_index_mutex)) {
+      LIBSITU_WARN("Failed to destroy index mutex\n");
+    }
+    if (0 != pthread_mutex_destroy(&m_wake_mutex)) {
+      LIBSITU_WARN("Failed to destroy wake mutex\n");
+    }
+    if (0 != pthread_mutex_destroy(&m_deliver_mutex)) {
+      LIBSITU_WARN("Failed to destroy deliver mutex\n");
+    }
+    if (0 != sem_destroy(&m_reschedule)) {
+      LIBSITU_WARN("Failed to destroy reschedule semaphore\n");
+    }
+
+    delete m_session;
+    m_session = NULL;
+    delete m_compact;
+    m_compact = NULL;
+    delete m_database;
+    m_database = NULL;
+    delete m_index;
+    m_index = NULL;
+    delete m_watches;
+    m_watches = NULL;
 
     free(m_host);
     m_host = NULL;
@@ -61,23 +164,265 @@ namespace libsitu {
     m_port = NULL;
   }
 
-  void Gps::add_watch(const char *name,
-                      double lat, double lon, double rad, WatchAlarm alarm,
-                      void *data)
+  WatchId Gps::add_watch(const char *name,
+                         double lat, double lon, double rad,
+                         WatchAlarm alarm, void *data)
+  {
+    return add_watch(name, lat, lon, rad, alarm, data, m_model);
+  }
+
+  WatchId Gps::add_watch(const char *name,
+                         double lat, double lon, double rad,
+                         WatchAlarm alarm, void *data, Model model)
   {
-    const Watch watch(lat, lon, rad, alarm, data);
+    Watch watch(lat, lon, rad, alarm, NULL, data, model, m_precision);
+    watch.set_debounce(m_debounce);
     lock_watches();
-    m_watches[name] = watch;
+    /* N.B. A watch replaces any existing watch of the same name */
+    m_watches->remove(m_watches->find(name));
+    const WatchId id = m_watches->add(watch, name);
+    reschedule();
+    unlock_watches();
+    return id;
+  }
+
+  WatchId Gps::add_watch(double lat, double lon, double rad,
+                         WatchHandler handler, void *data)
+  {
+    return add_watch(lat, lon, rad, handler, data, m_model);
+  }
+
+  WatchId Gps::add_watch(double lat, double lon, double rad,
+                         WatchHandler handler, void *data, Model model)
+  {
+    Watch watch(lat, lon, rad, NULL, handler, data, model, m_precision);
+    watch.set_debounce(m_debounce);
+    lock_watches();
+    const WatchId id = m_watches->add(watch, NULL);
+    reschedule();
+    unlock_watches();
+    return id;
+  }
+
+  WatchId Gps::add_watch(double lat, double lon, double rad)
+  {
+    return add_watch(lat, lon, rad, NULL, NULL, m_model);
+  }
+
+  WatchId Gps::add_compact_watch(double lat, double lon, double rad,
+                                 WatchHandler handler, void *data)
+  {
+    lock_watches();
+    const WatchId id = m_compact->add(lat, lon, rad, handler, data);
+    reschedule();
+    unlock_watches();
+    return id;
+  }
+
+  void Gps::reserve_compact_watches(size_t count)
+  {
+    lock_watches();
+    m_compact->reserve(count);
     unlock_watches();
   }
 
   void Gps::remove_watch(const char *name)
   {
     lock_watches();
-    m_watches.erase(name);
+    m_watches->remove(m_watches->find(name));
+    unlock_watches();
+  }
+
+  bool Gps::remove_watch(WatchId id)
+  {
+    lock_watches();
+    const bool removed = WATCH_COMPACT == (id & ~WATCH_INDEX_MASK) ?
+      m_compact->remove(id) : m_watches->remove(id);
+    unlock_watches();
+    return removed;
+  }
+
+  bool Gps::set_debounce(WatchId id, const Debounce &debounce)
+  {
+    lock_watches();
+    const bool found = m_watches->set_debounce(id, debounce);
+    unlock_watches();
+    return found;
+  }
+
+  bool Gps::set_window(WatchId id, const Window &window)
+  {
+    lock_watches();
+    const bool found = m_watches->set_window(id, window, time(NULL));
+    reschedule();
+    unlock_watches();
+    return found;
+  }
+
+  bool Gps::clear_window(WatchId id)
+  {
+    lock_watches();
+    const bool found = m_watches->clear_window(id);
+    reschedule();
+    unlock_watches();
+    return found;
+  }
+
+  RouteId Gps::add_route(const WatchId *ids, size_t count, unsigned ahead)
+  {
+    lock_watches();
+    const RouteId id = m_watches->add_route(ids, count, ahead);
+    reschedule();
+    unlock_watches();
+    return id;
+  }
+
+  bool Gps::remove_route(RouteId id)
+  {
+    lock_watches();
+    const bool removed = m_watches->remove_route(id);
+    reschedule();
+    unlock_watches();
+    return removed;
+  }
+
+  bool Gps::get_route_cursor(RouteId id, size_t &cursor)
+  {
+    lock_watches();
+    const bool found = m_watches->get_route_cursor(id, cursor);
+    unlock_watches();
+    return found;
+  }
+
+  void Gps::reserve_watches(size_t count)
+  {
+    lock_watches();
+    m_watches->reserve(count);
+    unlock_watches();
+  }
+
+  void Gps::bind_callbacks(const char *key, WatchAlarm alarm, void *data)
+  {
+    lock_watches();
+    m_watches->bind(key, alarm, NULL, data);
     unlock_watches();
   }
 
+  void Gps::bind_callbacks(const char *key, WatchHandler handler,
+                           void *data)
+  {
+    lock_watches();
+    m_watches->bind(key, NULL, handler, data);
+    unlock_watches();
+  }
+
+  bool Gps::save_state(const char *path)
+  {
+    std::vector<char> buffer;
+    lock_watches();
+    Snapshot::save(*m_watches, m_last_fix, buffer);
+    unlock_watches();
+    return Snapshot::write(path, buffer);
+  }
+
+  bool Gps::load_state(const char *path)
+  {
+    WatchTable restored;
+    lock_watches();
+    restored.copy_bindings(*m_watches);
+    unlock_watches();
+
+    Fix fix;
+    if (!Snapshot::load(path, restored, fix)) {
+      return false;
+    }
+
+    /* N.B. The previous watches are destroyed with the local table, once
+     * the lock is released */
+    lock_watches();
+    m_watches->swap_watches(restored);
+    m_watches->advance(time(NULL));
+    m_last_fix = fix;
+    reschedule();
+    unlock_watches();
+    return true;
+  }
+
+  size_t Gps::nearest_watches(double lat, double lon, size_t k,
+                              WatchDistance *out)
+  {
+    lock_index();
+    refresh_index();
+    const size_t count = m_index->nearest(lat, lon, k, out);
+    unlock_index();
+    return count;
+  }
+
+  size_t Gps::watches_within(double lat, double lon, double radius,
+                             WatchDistance *out, size_t max)
+  {
+    lock_index();
+    refresh_index();
+    const size_t count = m_index->within(lat, lon, radius, out, max);
+    unlock_index();
+    return count;
+  }
+
+  bool Gps::open_database(const char *path, WatchAlarm alarm, void *data)
+  {
+    return open_database(path, alarm, NULL, data);
+  }
+
+  bool Gps::open_database(const char *path, WatchHandler handler,
+                          void *data)
+  {
+    return open_database(path, NULL, handler, data);
+  }
+
+  bool Gps::open_database(const char *path, WatchAlarm alarm,
+                          WatchHandler handler, void *data)
+  {
+    Database *opened = new Database();
+    if (!opened->open(path)) {
+      delete opened;
+      return false;
+    }
+    opened->set_callbacks(alarm, handler, data);
+
+    /* N.B. The previous database is closed once the lock is released */
+    lock_watches();
+    std::swap(m_database, opened);
+    reschedule();
+    unlock_watches();
+    delete opened;
+    return true;
+  }
+
+  void Gps::close_database()
+  {
+    lock_watches();
+    m_database->close();
+    unlock_watches();
+  }
+
+  uint64_t Gps::get_database_version() const
+  {
+    Gps *context = const_cast<Gps*>(this);
+    context->lock_watches();
+    const uint64_t version = m_database->version();
+    context->unlock_watches();
+    return version;
+  }
+
+  WatchId Gps::find_database_watch(const char *name) const
+  {
+    Gps *context = const_cast<Gps*>(this);
+    context->lock_watches();
+    const WatchId id = m_database->find(name);
+    context->unlock_watches();
+    return id;
+  }
+
   const char* Gps::get_host() const
   {
     return m_host;
@@ -98,6 +443,131 @@ namespace libsitu {
     return m_sleep_us;
   }
 
+  Connection Gps::get_connection() const
+  {
+    /* N.B. The connection is updated by the poller thread; it is read
+     * without the watch mutex, so that a callback may call this */
+    return __atomic_load_n(&m_connection, __ATOMIC_ACQUIRE);
+  }
+
+  Transport Gps::get_transport() const
+  {
+    return m_transport;
+  }
+
+  int Gps::get_fd()
+  {
+    if (NULL == m_session) {
+      LIBSITU_WARN("Not polling externally\n");
+      return -1;
+    }
+    return m_session->get_fd();
+  }
+
+  bool Gps::process_ready()
+  {
+    if (NULL == m_session) {
+      LIBSITU_WARN("Not polling externally\n");
+      return false;
+    }
+    ++m_stats.wakeups;
+    return m_session->process_ready();
+  }
+
+  void Gps::set_messages(unsigned messages)
+  {
+    m_messages = messages & MESSAGE_ALL;
+  }
+
+  unsigned Gps::get_messages() const
+  {
+    return m_messages;
+  }
+
+  void Gps::set_model(Model model)
+  {
+    m_model = model;
+  }
+
+  Model Gps::get_model() const
+  {
+    return m_model;
+  }
+
+  void Gps::set_debounce(const Debounce &debounce)
+  {
+    m_debounce = debounce;
+  }
+
+  void Gps::get_debounce(Debounce &debounce) const
+  {
+    debounce = m_debounce;
+  }
+
+  void Gps::set_precision(Precision precision)
+  {
+    if (!Math::has_precision(precision)) {
+      LIBSITU_WARN("Precision %d not available\n", precision);
+    }
+    m_precision = precision;
+  }
+
+  Precision Gps::get_precision() const
+  {
+    return m_precision;
+  }
+
+  void Gps::set_prediction(double lead_s)
+  {
+    if (!(lead_s >= 0) || !Math::is_finite(lead_s)) {
+      LIBSITU_WARN("Invalid prediction lead time %f\n", lead_s);
+      return;
+    }
+    lock_watches();
+    m_lead_s = lead_s;
+    reschedule();
+    unlock_watches();
+  }
+
+  double Gps::get_prediction() const
+  {
+    return m_lead_s;
+  }
+
+  void Gps::set_schedule(const Schedule &schedule)
+  {
+    lock_watches();
+    m_schedule = schedule;
+    if (m_schedule.min_sleep_us < 0) {
+      m_schedule.min_sleep_us = 0;
+    }
+    if (m_schedule.max_sleep_us > 0 &&
+        m_schedule.min_sleep_us > m_schedule.max_sleep_us) {
+      LIBSITU_WARN("Minimum sleep %dus exceeds maximum %dus\n",
+                   m_schedule.min_sleep_us, m_schedule.max_sleep_us);
+      m_schedule.min_sleep_us = m_schedule.max_sleep_us;
+    }
+    reschedule();
+    unlock_watches();
+  }
+
+  void Gps::get_schedule(Schedule &schedule) const
+  {
+    schedule = m_schedule;
+  }
+
+  void Gps::get_stats(Stats &stats) const
+  {
+    /* N.B. The statistics are updated by the poller thread */
+    Gps *context = const_cast<Gps*>(this);
+    context->lock_watches();
+    stats = m_stats;
+    stats.elapsed_s = m_polling || NULL != m_session ?
+      monotonic_s() - m_start_s : 0;
+    stats.route_resyncs = m_watches->route_resyncs();
+    context->unlock_watches();
+  }
+
   void Gps::get_last_fix(Fix &fix) const
   {
     /* \todo FIXME: Possibly dodgy copy */
@@ -106,26 +576,473 @@ namespace libsitu {
 
   void Gps::handle_poll_fix(const Fix &fix)
   {
+    LIBSITU_TRACE_BEGIN("fix");
     lock_watches();
 
+    /* N.B. Debounce times are measured with the monotonic clock, read
+     * once per fix */
+    const int64_t now_ns = Util::monotonic_ns();
+    const uint32_t now_ms = now_ns / 1000000;
+
+    /* N.B. The previous fix, for interpolating boundary crossings */
+    const Fix previous = m_last_fix;
+
     /* \todo FIXME: Possibly dodgy copy */
     m_last_fix = fix;
+    m_last_fix.eval_ns = now_ns;
+
+    ++m_stats.fixes;
 
-    handle_fix(fix);
+    handle_fix(m_last_fix);
 
-    for (WatchMap::iterator iter = m_watches.begin();
-         m_watches.end() != iter; ++iter) {
-      iter->second.handle_fix(fix, iter->first.c_str());
+    if (NULL != m_subscribers || NULL != m_waiters) {
+      Notification notification = Notification();
+      notification.type = NOTIFICATION_FIX;
+      notification.fix = m_last_fix;
+      publish(notification);
     }
 
-    unlock_watches();
+    /* N.B. Fix-side terms are shared by all of the watches */
+    Math::Here here;
+    Math::here_init(here, fix);
+    Math::motion_init(here, fix, previous, m_lead_s);
+
+    /* N.B. Watch windows follow the wall clock */
+    const time_t wall_s = time(NULL);
+    m_watches->advance(wall_s);
+
+    /* N.B. Only track the distance to the nearest watch boundary if the
+     * poll schedule needs it */
+    double clearance = m_schedule.max_sleep_us > 0 ? INFINITY : 0;
+
+    size_t count = 0;
+    LIBSITU_TRACE_BEGIN("evaluate");
+    const WatchEvent *events =
+      m_watches->handle_fix(fix, here, now_ms, clearance, count);
+    LIBSITU_TRACE_END("evaluate", count);
+    if (0 != count) {
+      LIBSITU_TRACE_BEGIN("dispatch");
+      dispatch_events(events, count);
+      publish_events(events, count);
+      LIBSITU_TRACE_END("dispatch", count);
+    }
+    LIBSITU_TRACE_BEGIN("evaluate compact");
+    events = m_compact->handle_fix(fix, here, clearance, count);
+    LIBSITU_TRACE_END("evaluate compact", count);
+    if (0 != count) {
+      LIBSITU_TRACE_BEGIN("dispatch");
+      dispatch_events(events, count);
+      publish_events(events, count);
+      LIBSITU_TRACE_END("dispatch", count);
+    }
+    LIBSITU_TRACE_BEGIN("evaluate database");
+    events = m_database->handle_fix(fix, here, clearance, count);
+    LIBSITU_TRACE_END("evaluate database", count);
+    if (0 != count) {
+      LIBSITU_TRACE_BEGIN("dispatch");
+      dispatch_events(events, count);
+      publish_events(events, count);
+      LIBSITU_TRACE_END("dispatch", count);
+    }
+
+    m_next_sleep_us = schedule_sleep_us(fix, clearance - here.err);
+
+    /* N.B. Wake for the next window to open or close */
+    const time_t change_s = m_watches->next_change();
+    if (m_schedule.max_sleep_us > 0 && static_cast<time_t>(-1) != change_s &&
+        (change_s - wall_s) * 1e6 < m_next_sleep_us) {
+      m_next_sleep_us = std::max(m_schedule.min_sleep_us,
+                                 static_cast<int>((change_s - wall_s) * 1e6));
+    }
+
+    LIBSITU_TRACE_END("fix", m_watches->size());
+    wake_waiters();
   }
 
   void Gps::handle_poll_timeout()
   {
+    lock_watches();
+    ++m_stats.timeouts;
+    unlock_watches();
+
     handle_timeout();
   }
 
+  void Gps::handle_poll_connection(Connection connection)
+  {
+    const bool changed = connection !=
+      __atomic_exchange_n(&m_connection, connection, __ATOMIC_ACQ_REL);
+    if (CONNECTION_CONNECTED == connection) {
+      lock_watches();
+      ++m_stats.connects;
+      unlock_watches();
+    }
+
+    if (changed) {
+      handle_connection(connection);
+    }
+  }
+
+  void Gps::handle_poll_messages(unsigned long messages, unsigned long bytes,
+                                 const unsigned long *dropped)
+  {
+    lock_watches();
+    m_stats.messages += messages;
+    m_stats.message_bytes += bytes;
+    for (unsigned i = 0; i < MESSAGE_CLASSES; ++i) {
+      m_stats.dropped[i] += dropped[i];
+    }
+    unlock_watches();
+  }
+
+  int Gps::handle_poll_sleep()
+  {
+    lock_watches();
+    const int sleep_us = m_next_sleep_us;
+    /* N.B. Until the next fix, assume nothing about the position */
+    m_next_sleep_us = m_schedule.max_sleep_us > 0 ?
+      m_schedule.min_sleep_us : m_sleep_us;
+    ++m_stats.wakeups;
+    m_stats.sleep_us = sleep_us;
+    /* N.B. Any change made since the fix has already shortened the
+     * sleep */
+    while (0 == sem_trywait(&m_reschedule)) {
+    }
+    unlock_watches();
+    return sleep_us;
+  }
+
+  void Gps::reschedule()
+  /* Cut short the poller's sleep, since a watch it was not allowing for
+   * may now be nearer than the schedule assumed; called with the watch
+   * lock held
+   *
+   * N.B. Removing a watch can only lengthen the time to the nearest
+   * boundary, so does not call this */
+  {
+    if (m_schedule.max_sleep_us > 0) {
+      m_next_sleep_us = m_schedule.min_sleep_us;
+    }
+    int posted = 0;
+    if (0 == sem_getvalue(&m_reschedule, &posted) && 0 == posted &&
+        0 != sem_post(&m_reschedule)) {
+      LIBSITU_WARN("Failed to post reschedule semaphore\n");
+    }
+  }
+
+  int Gps::schedule_sleep_us(const Fix &fix, double clearance) const
+  /* Choose the inter-poll sleep time, given the distance of the fix from
+   * the nearest watch boundary, less its error radius */
+  {
+    if (m_schedule.max_sleep_us <= 0) {
+      return m_sleep_us;
+    }
+    if (!fix.valid || isnan(clearance) || clearance <= 0) {
+      return m_schedule.min_sleep_us;
+    }
+
+    /* N.B. Distances in the local tangent plane, or in fixed point, may
+     * be overestimated by around 0.1% far from the watch */
+    clearance *= 0.99;
+
+    double speed = m_schedule.default_speed;
+    if (fix.has_speed && Math::is_finite(fix.speed)) {
+      speed = fabs(fix.speed);
+      if (Math::is_finite(fix.eps)) {
+        speed += fabs(fix.eps);
+      }
+    }
+
+    /* Time to cover the clearance, accelerating from the current speed:
+     * clearance = speed * t + max_accel * t^2 / 2 */
+    double time_s = INFINITY;
+    if (m_schedule.max_accel > 0) {
+      time_s = 2 * clearance /
+        (speed + sqrt(speed * speed + 2 * m_schedule.max_accel * clearance));
+    } else if (speed > 0) {
+      time_s = clearance / speed;
+    }
+
+    /* N.B. Wake by the time the nearest watch could come within the
+     * prediction lead time, so that a PREDICT event is not late */
+    time_s -= m_lead_s;
+
+    /* N.B. With no watches, the clearance (and so the time) is infinite,
+     * or NaN */
+    const double sleep_us = time_s * 1e6;
+    return
+      sleep_us < m_schedule.min_sleep_us ? m_schedule.min_sleep_us :
+      sleep_us < m_schedule.max_sleep_us ? static_cast<int>(sleep_us) :
+      m_schedule.max_sleep_us;
+  }
+
+  void Gps::dispatch_events(const WatchEvent *events, size_t count)
+  {
+    const CallbackAdapter adapter = CallbackAdapter();
+    for (size_t i = 0; i < count; ++i) {
+      LIBSITU_TRACE_BEGIN("callback");
+      adapter(events[i]);
+      LIBSITU_TRACE_END("callback", events[i].event);
+    }
+  }
+
+  void Gps::subscribe(NotificationQueue *queue)
+  {
+    lock_watches();
+    queue->set_next(m_subscribers);
+    m_subscribers = queue;
+    unlock_watches();
+  }
+
+  void Gps::unsubscribe(NotificationQueue *queue)
+  {
+    lock_watches();
+    if (queue == m_subscribers) {
+      m_subscribers = queue->get_next();
+    } else {
+      for (NotificationQueue *prev = m_subscribers; NULL != prev;
+           prev = prev->get_next()) {
+        if (queue == prev->get_next()) {
+          prev->set_next(queue->get_next());
+          break;
+        }
+      }
+    }
+    queue->set_next(NULL);
+
+    /* N.B. A subscription may be destroyed by a callback, on the poller
+     * thread, while notifications are held for it. The links of a queue
+     * not on m_held are left alone: it may be on the list that
+     * deliver_held() is walking, without the watch lock */
+    if (queue == m_held) {
+      m_held = queue->get_next_held();
+      queue->set_next_held(NULL);
+    } else {
+      for (NotificationQueue *prev = m_held; NULL != prev;
+           prev = prev->get_next_held()) {
+        if (queue == prev->get_next_held()) {
+          prev->set_next_held(queue->get_next_held());
+          queue->set_next_held(NULL);
+          break;
+        }
+      }
+    }
+    unlock_watches();
+
+    /* N.B. The poller may still be pushing to the queue, having released
+     * the watch lock */
+    if (OVERFLOW_BLOCK == queue->get_overflow()) {
+      wait_for(m_deliver_mutex);
+    }
+  }
+
+  void Gps::publish(const Notification &notification)
+  /* Publish a notification to the subscriptions, and offer it to the
+   * waiters; called with the watch lock held */
+  {
+    for (NotificationQueue *queue = m_subscribers; NULL != queue;
+         queue = queue->get_next()) {
+      if (OVERFLOW_BLOCK != queue->get_overflow()) {
+        queue->push(notification);
+      } else if (queue->hold(notification)) {
+        /* N.B. Pushed by deliver_held(), which may block */
+        queue->set_next_held(m_held);
+        m_held = queue;
+      }
+    }
+
+    Waiter **link = &m_waiters;
+    while (NULL != *link) {
+      Waiter *waiter = *link;
+      if (0 != (waiter->types & notification.type) &&
+          (NULL == waiter->notify ||
+           (*waiter->notify)(waiter, notification))) {
+        *link = waiter->next;
+        waiter->next = m_woken;
+        m_woken = waiter;
+      } else {
+        link = &waiter->next;
+      }
+    }
+  }
+
+  void Gps::publish_events(const WatchEvent *events, size_t count)
+  /* Publish watch events; called with the watch lock held */
+  {
+    if (NULL == m_subscribers && NULL == m_waiters) {
+      return;
+    }
+
+    Notification notification = Notification();
+    notification.type = NOTIFICATION_EVENT;
+    notification.fix = m_last_fix;
+    for (size_t i = 0; i < count; ++i) {
+      /* N.B. The name is copied, as the watch may be removed before the
+       * notification is read */
+      notification.event = events[i];
+      notification.event.name = NULL;
+      if (NULL == events[i].name) {
+        notification.name[0] = '\0';
+      } else {
+        strncpy(notification.name, events[i].name,
+                sizeof(notification.name) - 1);
+        notification.name[sizeof(notification.name) - 1] = '\0';
+      }
+      publish(notification);
+    }
+  }
+
+  void Gps::add_waiter(Waiter *waiter)
+  {
+    lock_watches();
+    waiter->next = m_waiters;
+    m_waiters = waiter;
+    unlock_watches();
+  }
+
+  bool Gps::remove_waiter(Waiter *waiter)
+  {
+    bool removed = false;
+    lock_watches();
+    for (Waiter **link = &m_waiters; NULL != *link; link = &(*link)->next) {
+      if (waiter == *link) {
+        *link = waiter->next;
+        removed = true;
+        break;
+      }
+    }
+    unlock_watches();
+
+    if (!removed) {
+      wait_for_wakes();
+    }
+    return removed;
+  }
+
+  bool Gps::arm(NotificationQueue *queue, Waiter *waiter)
+  {
+    lock_watches();
+    const bool armed = queue->is_empty();
+    if (armed) {
+      queue->set_armed(waiter);
+    }
+    unlock_watches();
+    return armed;
+  }
+
+  bool Gps::disarm(NotificationQueue *queue, Waiter *waiter)
+  {
+    lock_watches();
+    const bool disarmed = waiter == queue->get_armed();
+    if (disarmed) {
+      queue->set_armed(NULL);
+    }
+    unlock_watches();
+
+    if (!disarmed) {
+      wait_for_wakes();
+    }
+    return disarmed;
+  }
+
+  void Gps::deliver_held()
+  /* Push the notifications held for subscriptions with OVERFLOW_BLOCK,
+   * with the watch lock released, so that a full queue does not block
+   * with it held; called, and returns, with the watch lock held */
+  {
+    NotificationQueue *held = m_held;
+    m_held = NULL;
+    if (NULL == held) {
+      return;
+    }
+
+    /* N.B. The deliver mutex is taken before the watch lock is released,
+     * so that a queue cannot be unsubscribed and destroyed in between */
+    const bool external = POLLING_EXTERNAL == m_polling_mode;
+    if (!external && 0 != pthread_mutex_lock(&m_deliver_mutex)) {
+      LIBSITU_WARN("Failed to lock deliver mutex\n");
+    }
+    unlock_watches();
+    while (NULL != held) {
+      NotificationQueue *next = held->get_next_held();
+      held->set_next_held(NULL);
+      held->release();
+      held = next;
+    }
+    if (!external && 0 != pthread_mutex_unlock(&m_deliver_mutex)) {
+      LIBSITU_WARN("Failed to unlock deliver mutex\n");
+    }
+    lock_watches();
+  }
+
+  void Gps::wake_waiters()
+  /* Release the watch lock, then wake the waiters that have accepted a
+   * notification, or whose subscriptions have one queued */
+  {
+    deliver_held();
+
+    for (NotificationQueue *queue = m_subscribers; NULL != queue;
+         queue = queue->get_next()) {
+      Waiter *waiter = queue->get_armed();
+      if (NULL != waiter && !queue->is_empty()) {
+        queue->set_armed(NULL);
+        waiter->next = m_woken;
+        m_woken = waiter;
+      }
+    }
+
+    Waiter *woken = m_woken;
+    m_woken = NULL;
+    if (NULL == woken) {
+      unlock_watches();
+      return;
+    } else if (POLLING_EXTERNAL == m_polling_mode) {
+      while (NULL != woken) {
+        Waiter *next = woken->next;
+        (*woken->wake)(woken);
+        woken = next;
+      }
+      return;
+    }
+
+    /* N.B. The wake mutex is taken before the watch lock is released, so
+     * that a waiter cannot be removed and destroyed in between */
+    if (0 != pthread_mutex_lock(&m_wake_mutex)) {
+      LIBSITU_WARN("Failed to lock wake mutex\n");
+    }
+    unlock_watches();
+    while (NULL != woken) {
+      Waiter *next = woken->next;
+      (*woken->wake)(woken);
+      woken = next;
+    }
+    if (0 != pthread_mutex_unlock(&m_wake_mutex)) {
+      LIBSITU_WARN("Failed to unlock wake mutex\n");
+    }
+  }
+
+  void Gps::wait_for(pthread_mutex_t &mutex)
+  /* Wait for the poller to release a mutex that it holds while it works
+   * without the watch lock, unless this is the poller */
+  {
+    if (POLLING_EXTERNAL == m_polling_mode ||
+        (m_polling && pthread_equal(pthread_self(), m_poll_thread))) {
+      return;
+    }
+    if (0 != pthread_mutex_lock(&mutex)) {
+      LIBSITU_WARN("Failed to lock poller mutex\n");
+    }
+    if (0 != pthread_mutex_unlock(&mutex)) {
+      LIBSITU_WARN("Failed to unlock poller mutex\n");
+    }
+  }
+
+  void Gps::wait_for_wakes()
+  /* Wait for the poller to finish waking waiters */
+  {
+    wait_for(m_wake_mutex);
+  }
+
   void Gps::handle_fix(const Fix &UNUSED(fix))
   {
   }
@@ -133,8 +1050,16 @@ namespace libsitu {
   void Gps::handle_timeout() {
   }
 
+  void Gps::handle_connection(Connection UNUSED(connection))
+  {
+  }
+
   void Gps::lock_watches()
   {
+    /* N.B. With POLLING_EXTERNAL, there is only the application's thread */
+    if (POLLING_EXTERNAL == m_polling_mode) {
+      return;
+    }
     if (0 != pthread_mutex_lock(&m_watch_mutex)) {
       LIBSITU_WARN("Failed to lock watch mutex\n");
     }
@@ -142,17 +1067,72 @@ namespace libsitu {
 
   void Gps::unlock_watches()
   {
+    if (POLLING_EXTERNAL == m_polling_mode) {
+      return;
+    }
     if (0 != pthread_mutex_unlock(&m_watch_mutex)) {
       LIBSITU_WARN("Failed to unlock watch mutex\n");
     }
   }
 
+  void Gps::lock_index()
+  {
+    if (POLLING_EXTERNAL == m_polling_mode) {
+      return;
+    }
+    if (0 != pthread_mutex_lock(&m_index_mutex)) {
+      LIBSITU_WARN("Failed to lock index mutex\n");
+    }
+  }
+
+  void Gps::unlock_index()
+  {
+    if (POLLING_EXTERNAL == m_polling_mode) {
+      return;
+    }
+    if (0 != pthread_mutex_unlock(&m_index_mutex)) {
+      LIBSITU_WARN("Failed to unlock index mutex\n");
+    }
+  }
+
+  void Gps::refresh_index()
+  /* Rebuild the index if the watches have changed, holding the watch lock
+   * only while the positions are copied, a chunk at a time
+   *
+   * N.B. Called with the index lock held */
+  {
+    lock_watches();
+    size_t count = m_watches->size();
+    const bool stale = !m_index->is_current(*m_watches);
+    unlock_watches();
+    if (!stale) {
+      return;
+    }
+
+    /* N.B. Space for the copy is reserved without the lock, so the table
+     * may have grown by the time it is taken again; if so, reserve again
+     * and start over */
+    size_t loaded = 0;
+    bool complete = false;
+    while (!complete) {
+      m_index->reserve(count);
+      lock_watches();
+      count = m_watches->size();
+      complete = m_index->load(*m_watches, loaded);
+      unlock_watches();
+    }
+    m_index->build();
+  }
+
   void Gps::start_polling()
   {
-    if (m_polling) {
+    if (POLLING_EXTERNAL == m_polling_mode) {
+      /* N.B. Nothing to start */
+    } else if (m_polling) {
       LIBSITU_WARN("Already polling\n");
     } else {
       LIBSITU_DBGV("Starting poller thread\n");
+      m_start_s = monotonic_s();
       if (0 != pthread_create(&m_poll_thread, NULL, &poller, this)) {
         LIBSITU_WARN("Failed to start poller thread\n");
       } else {
@@ -163,7 +1143,9 @@ namespace libsitu {
 
   void Gps::stop_polling()
   {
-    if (!m_polling) {
+    if (POLLING_EXTERNAL == m_polling_mode) {
+      /* N.B. Nothing to stop */
+    } else if (!m_polling) {
       LIBSITU_WARN("Not currently polling\n");
     } else {
       void *res = NULL;
@@ -20,10 +20,10 @@
 #ifndef _LIBSITU_H_
 #define _LIBSITU_H_
 
-#include <map>
-#include <string>
-
 #include <pthread.h>
+#include <semaphore.h>
+#include <stddef.h>
+#include <stdint.h>
 
 #ifdef UNUSED
 #elif defined(__GNUC__)
@@ -43,16 +43,192 @@ namespace libsitu {
   typedef enum {
     EVENT_NONE = 0, /**< None */
     EVENT_ARRIVE = 1, /**< Arrival at a watch */
-    EVENT_DEPART = 2 /**< Departure from a watch */
+    EVENT_DEPART = 2, /**< Departure from a watch */
+    EVENT_PREDICT = 3 /**< Predicted arrival at a watch; see
+                       * Gps::set_prediction() */
   } Event;
 
+  /** @brief Earth model
+   *
+   * Enumerates the Earth models available for distance calculations
+   */
+  typedef enum {
+    MODEL_SPHERICAL = 0, /**< Sphere of equatorial radius */
+    MODEL_ELLIPSOIDAL = 1 /**< WGS-84 ellipsoid (Vincenty geodesic) */
+  } Model;
+
+  /** @brief Numeric precision
+   *
+   * Enumerates the numeric policies available for the spherical distance
+   * and RMS error calculations
+   */
+  typedef enum {
+    PRECISION_DEFAULT = 0, /**< MPFR where available, otherwise double */
+    PRECISION_MPFR = 1, /**< GNU MPFR, with a 64-bit significand */
+    PRECISION_LONG_DOUBLE = 2, /**< Native long double */
+    PRECISION_DOUBLE = 3, /**< Native double */
+    PRECISION_FLOAT = 4, /**< Native float */
+    PRECISION_FIXED = 5 /**< Integer fixed point, for FPU-less targets */
+  } Precision;
+
+  /** @brief Transport
+   *
+   * Enumerates the ways of reading fixes from gpsd
+   */
+  typedef enum {
+    TRANSPORT_SOCKET = 0, /**< JSON, over a socket connection to gpsd */
+    TRANSPORT_SHM = 1 /**< The gpsd shared memory export */
+  } Transport;
+
+  /** @brief Polling mode
+   *
+   * Enumerates the ways of driving the reading of fixes
+   */
+  typedef enum {
+    POLLING_THREAD = 0, /**< By a poller thread of the library's own */
+    /** By the application, from its own event loop (see Gps::get_fd()) */
+    POLLING_EXTERNAL = 1
+  } Polling;
+
+  /** @brief Connection state
+   *
+   * Enumerates the states of the connection to gpsd
+   */
+  typedef enum {
+    CONNECTION_CONNECTING = 0, /**< Not yet connected */
+    CONNECTION_CONNECTED = 1, /**< Connected */
+    CONNECTION_DISCONNECTED = 2 /**< Connection lost; reconnecting */
+  } Connection;
+
+  /** @brief gpsd message classes
+   *
+   * Enumerates the classes of gpsd JSON message, as bits of a mask
+   */
+  typedef enum {
+    MESSAGE_TPV = 1, /**< Time-position-velocity reports, with the fixes */
+    MESSAGE_SKY = 2, /**< Sky view reports, with the satellite counts */
+    MESSAGE_GST = 4, /**< Pseudorange noise reports */
+    MESSAGE_DEVICE = 8, /**< DEVICE and DEVICES reports */
+    MESSAGE_OTHER = 16, /**< Every other class, including VERSION */
+    MESSAGE_ALL = 31 /**< Every class */
+  } Message;
+
+  /** @brief Number of gpsd message classes */
+  const unsigned MESSAGE_CLASSES = 5;
+
+  /** @brief Log level
+   *
+   * Enumerates the levels of library log messages, in increasing
+   * verbosity
+   */
+  typedef enum {
+    LOG_LEVEL_NONE = 0, /**< No messages */
+    LOG_LEVEL_ERROR = 1, /**< Errors */
+    LOG_LEVEL_WARN = 2, /**< Warnings */
+    LOG_LEVEL_INFO = 3, /**< Information */
+    LOG_LEVEL_DEBUG = 4 /**< Debugging, where compiled in */
+  } LogLevel;
+
+  /** @brief Log sink
+   *
+   * A function pointer type for receiving library log messages. The
+   * message has no trailing newline.
+   */
+  typedef void (*LogSink)(LogLevel level, const char *message, void *data);
+
+  /** @brief Watch debounce rules
+   *
+   * Rules applied before a watch commits to a change of state, and so
+   * raises an event. All zero (the default) commits immediately.
+   */
+  struct Debounce {
+    /** Number of consecutive fixes in the new state, up to 255. Fixes in
+     * the error zone around the boundary neither count towards this nor
+     * reset it. */
+    unsigned min_fixes;
+    /** Time in the new state, in milliseconds, up to 65535 */
+    unsigned min_dwell_ms;
+    /** Additional time for which a departure is held back, in
+     * milliseconds, up to 65535. A return to the watch within this window
+     * cancels the departure, so that ARRIVE, DEPART, ARRIVE bursts are
+     * coalesced into the first ARRIVE. */
+    unsigned coalesce_ms;
+  };
+
+  /** @brief Watch activation window
+   *
+   * A daily window, in local time, outside of which a watch is inactive:
+   * it is not evaluated, and raises no events. The window opens at
+   * start_s and closes at end_s; if end_s is at or before start_s, it
+   * closes on the following day.
+   */
+  struct Window {
+    int start_s; /**< Opening time, in seconds after local midnight */
+    int end_s; /**< Closing time, in seconds after local midnight */
+    /** Days of the week on which the window opens, as a mask with bit 0
+     * for Sunday, or 0 for every day */
+    unsigned days;
+  };
+
+  /** @brief Adaptive poll schedule
+   *
+   * Bounds and assumptions used to choose each inter-poll sleep time
+   * from the speed of the last fix and its distance from the nearest
+   * watch boundary. A max_sleep_us of zero (the default) disables
+   * adaptive scheduling, so that the sleep time is fixed.
+   */
+  struct Schedule {
+    int min_sleep_us; /**< Shortest inter-poll sleep time, in microseconds */
+    int max_sleep_us; /**< Longest inter-poll sleep time, in microseconds */
+    /** Speed assumed for a fix that has none, in m/s; the speed of a fix
+     * that has one is used as it is, even if greater */
+    double default_speed;
+    double max_accel; /**< Greatest acceleration assumed, in m/s^2 */
+  };
+
+  /** @brief Poller statistics
+   *
+   * Counts since polling started. The wakeup rate is wakeups / elapsed_s.
+   */
+  struct Stats {
+    unsigned long wakeups; /**< Number of times the poller has slept */
+    unsigned long fixes; /**< Number of fixes processed */
+    unsigned long timeouts; /**< Number of poll timeouts */
+    unsigned long connects; /**< Number of connections made to gpsd */
+    double elapsed_s; /**< Time since polling started, in seconds */
+    int sleep_us; /**< Latest inter-poll sleep time, in microseconds */
+    unsigned long messages; /**< Number of gpsd messages read */
+    unsigned long message_bytes; /**< Number of bytes of gpsd messages */
+    /** Number of gpsd messages dropped by the message filter, by class:
+     * element i counts the class with bit (1 << i) */
+    unsigned long dropped[MESSAGE_CLASSES];
+    /** Number of times a route has been resynchronised by a scan of all
+     * of its stops */
+    unsigned long route_resyncs;
+  };
+
   /** @brief Fix data
    *
    * A simple structure to represent fix data
+   *
+   * The monotonic times are comparable with Util::monotonic_ns(), so that
+   * read_ns to eval_ns is the time the fix spent in the library before
+   * its watches were evaluated; Util::latency() gives the age of the fix
+   * relative to its GPS time.
    */
   struct Fix {
     bool valid;
 
+    /** GPS time of the fix, in seconds since the Unix epoch, or 0 if
+     * unknown */
+    double time;
+    /** Monotonic time at which the fix was read from gpsd, in
+     * nanoseconds, or 0 if unknown */
+    int64_t read_ns;
+    /** Monotonic time at which the evaluation of the watches against the
+     * fix started, in nanoseconds, or 0 before evaluation */
+    int64_t eval_ns;
+
     double latitude;
     double longitude;
     double eph;
@@ -67,13 +243,193 @@ namespace libsitu {
     unsigned satellites_used;
   };
 
+  /** @brief Watch identifier
+   *
+   * A compact handle for a watch. The low WATCH_INDEX_BITS bits are a
+   * dense slot index, which is stable for the life of the watch, and
+   * which callers may use to index their own per-watch data; the
+   * remaining bits are a generation count, so that a stale identifier for
+   * a removed watch is not mistaken for a later watch in the same slot.
+   */
+  typedef uint32_t WatchId;
+
+  /** @brief Number of bits of a watch identifier used for its slot index */
+  const unsigned WATCH_INDEX_BITS = 24;
+
+  /** @brief Mask for the slot index of a watch identifier */
+  const WatchId WATCH_INDEX_MASK = (1u << WATCH_INDEX_BITS) - 1;
+
+  /** @brief Invalid watch identifier */
+  const WatchId WATCH_ID_INVALID = 0xffffffffu;
+
+  /** @brief Generation of the identifiers of database watches
+   *
+   * A watch of a compiled database (see Gps::open_database()) is
+   * identified by its record index, in this generation, which is never
+   * used by the identifiers of added watches.
+   */
+  const WatchId WATCH_DATABASE = 0xff000000u;
+
+  /** @brief Generation of the identifiers of compact watches
+   *
+   * A compact watch (see Gps::add_compact_watch()) is identified by its
+   * slot index, in this generation, which is never used by the
+   * identifiers of added watches.
+   */
+  const WatchId WATCH_COMPACT = 0xfe000000u;
+
+  /** @brief Route identifier
+   *
+   * A handle for a route of watches; see Gps::add_route()
+   */
+  typedef uint32_t RouteId;
+
+  /** @brief Invalid route identifier */
+  const RouteId ROUTE_ID_INVALID = 0xffffffffu;
+
   /** @brief Watch alarm
    *
-   * A function pointer type for watch callbacks
+   * A function pointer type for named watch callbacks
    */
   typedef void (*WatchAlarm)(const char *name, double distance, Event event,
                              void *data);
 
+  /** @brief Watch handler
+   *
+   * A function pointer type for watch callbacks, identifying the watch by
+   * its identifier
+   */
+  typedef void (*WatchHandler)(WatchId id, double distance, Event event,
+                               void *data);
+
+  /** @brief Watch event
+   *
+   * A watch event, as delivered to watch handlers
+   */
+  struct WatchEvent {
+    WatchId id; /**< Identifier of the watch */
+    Event event; /**< Event type */
+    double distance; /**< Distance from the watch, in meters */
+    /** GPS time at which the boundary was crossed, or is predicted to
+     * be, in seconds since the Unix epoch, or 0 if unknown. For ARRIVE and
+     * DEPART, this is interpolated between the fix raising the event and
+     * the previous fix, where that is possible (see Gps::set_prediction()),
+     * and is otherwise the time of the fix */
+    double time;
+    double latitude; /**< Latitude of the crossing, as for the time */
+    double longitude; /**< Longitude of the crossing, as for the time */
+    const char *name; /**< Name of the watch, or NULL if anonymous */
+    WatchAlarm alarm; /**< Named watch callback function, if any */
+    WatchHandler handler; /**< Watch handler callback function, if any */
+    void *data; /**< Opaque data for the callback function */
+  };
+
+  /** @brief Watch distance
+   *
+   * A watch, and its distance from a query point
+   */
+  struct WatchDistance {
+    WatchId id; /**< Identifier of the watch */
+    double distance; /**< Great circle distance from the point to the
+                        centre of the watch, in meters */
+  };
+
+  /** @brief Watch callback adapter
+   *
+   * A watch event handler that calls the callback function pointers
+   * registered with the watch. This is the handler used by Gps.
+   */
+  struct CallbackAdapter {
+    /** @brief Handle a watch event
+     *
+     * @param[in] event The watch event
+     */
+    void operator()(const WatchEvent &event) const
+    {
+      if (NULL != event.handler) {
+        (*event.handler)(event.id, event.distance, event.event, event.data);
+      } else if (NULL != event.alarm) {
+        (*event.alarm)(event.name, event.distance, event.event, event.data);
+      }
+    }
+  };
+
+  /** @brief Notification type
+   *
+   * Enumerates the types of notification delivered to subscriptions, as
+   * bits of a mask
+   */
+  typedef enum {
+    NOTIFICATION_FIX = 1, /**< A fix */
+    NOTIFICATION_EVENT = 2 /**< A watch event */
+  } NotificationType;
+
+  /** @brief Subscription overflow policy
+   *
+   * Enumerates what happens to a notification published to a full
+   * subscription queue
+   */
+  typedef enum {
+    OVERFLOW_DROP_OLDEST = 0, /**< Drop the oldest queued notification */
+    OVERFLOW_DROP_NEWEST = 1, /**< Drop the new notification */
+    /** Wait for the subscriber to make room. The poller waits once it
+     * has processed the fix, and released the watch lock, but this still
+     * holds up the next fix, and so every other subscriber. */
+    OVERFLOW_BLOCK = 2
+  } Overflow;
+
+  /** @brief Size of the copy of a watch name in a notification,
+   * including the terminating NUL */
+  const size_t NOTIFICATION_NAME_SIZE = 32;
+
+  /** @brief Notification
+   *
+   * A fix, or a watch event, as delivered to subscriptions
+   */
+  struct Notification {
+    NotificationType type; /**< Notification type */
+    /** The fix; for a watch event, the fix that raised it */
+    Fix fix;
+    /** The watch event, for NOTIFICATION_EVENT. N.B. Its name is NULL,
+     * since the watch may be removed before the notification is read: see
+     * name. */
+    WatchEvent event;
+    /** For NOTIFICATION_EVENT, a copy of the name of the watch, truncated
+     * if need be, or empty if it is anonymous */
+    char name[NOTIFICATION_NAME_SIZE];
+  };
+
+  /** @brief Notification handler
+   *
+   * A function pointer type for subscription callbacks
+   */
+  typedef void (*NotificationHandler)(const Notification &notification,
+                                      void *data);
+
+  /** @brief Waiter
+   *
+   * A one-shot hook, for waking a consumer (for instance, a suspended
+   * coroutine; see libsitu_coro.h) from the fix processing path, without
+   * a thread of its own. Registered with Gps::add_waiter() or
+   * Subscription::arm(), and owned by the caller.
+   */
+  struct Waiter {
+    /** Mask of the NotificationType types offered to notify() */
+    unsigned types;
+    /** Called on the poller thread, with the watch lock held, for each
+     * notification offered, in order, until it returns true, whereupon
+     * the waiter is removed. It must not block, nor call the Gps. NULL
+     * accepts the first notification offered. Not called for a waiter
+     * armed on a subscription. */
+    bool (*notify)(Waiter *waiter, const Notification &notification);
+    /** Called once, on the poller thread, once the fix has been
+     * processed and the watch lock released. Once it is called, the
+     * Gps no longer refers to the waiter. */
+    void (*wake)(Waiter *waiter);
+    void *data; /**< Opaque data for the callback functions */
+    Waiter *next; /**< Used internally */
+  };
+
   /** @brief Utility functions
    */
   namespace Util {
@@ -92,6 +448,94 @@ namespace libsitu {
      */
     void dump_fix_json(const Fix &fix);
 
+    /** @brief Read the monotonic clock
+     *
+     * @return The monotonic time, in nanoseconds, as used by the fix
+     * timestamps
+     */
+    int64_t monotonic_ns();
+
+    /** @brief Get the latency of a fix
+     *
+     * Get the time since the GPS time of a fix, by the system clock. This
+     * is only as accurate as the system clock is synchronised to GPS time,
+     * as it is for instance when gpsd serves as the NTP reference clock.
+     *
+     * @param[in] fix The fix
+     * @return The latency, in seconds, or NaN if the GPS time of the fix
+     * is unknown
+     */
+    double latency(const Fix &fix);
+
+    /** @brief Dump poller statistics
+     *
+     * Dump poller statistics, including the wakeup rate, to standard
+     * output, in JSON format
+     *
+     * @param[in] stats The statistics to be dumped
+     */
+    void dump_stats_json(const Stats &stats);
+
+    /** @brief Dump trace events
+     *
+     * Write the trace events recorded by the library, from each thread's
+     * ring of recent events, to a file in Chrome trace event JSON format,
+     * for viewing in Perfetto or chrome://tracing. Trace points mark
+     * poller sleeps, waits, reads and parses, and the evaluation and
+     * dispatch of each fix. Tracing is compiled in with
+     * "configure --enable-trace"; otherwise no events are recorded, and
+     * this fails.
+     *
+     * @param[in] path Path of the file to write
+     * @return Success flag
+     */
+    bool dump_trace_json(const char *path);
+
+    /** @brief Set the log level
+     *
+     * Set the most verbose level of library log message to be written;
+     * the default is LOG_LEVEL_WARN. This may be called at any time, from
+     * any thread.
+     *
+     * @param[in] level The log level
+     */
+    void set_log_level(LogLevel level);
+
+    /** @brief Get the log level
+     *
+     * @return The log level
+     */
+    LogLevel get_log_level();
+
+    /** @brief Set the log sink
+     *
+     * Library log messages are queued without blocking, and written by a
+     * background thread: by default, to standard error. A sink installed
+     * here is instead called on that thread, for each message; it need
+     * not be thread safe, and may block without holding up the poller,
+     * but must not call set_log_sink() or flush_log().
+     * Each call site is rate limited to a burst of messages a second;
+     * the first message after a burst reports the number suppressed.
+     *
+     * @param[in] sink Callback function, or NULL for standard error
+     * @param[in] data Opaque data for the callback function
+     */
+    void set_log_sink(LogSink sink, void *data);
+
+    /** @brief Flush the log
+     *
+     * Wait until every queued log message has been written. Queued
+     * messages are also flushed at exit.
+     */
+    void flush_log();
+
+    /** @brief Get the number of dropped log messages
+     *
+     * @return The number of log messages dropped because the queue was
+     * full; messages suppressed by rate limiting are not counted
+     */
+    unsigned long get_log_dropped();
+
     /** @brief Parse string to integer
      *
      * Attempt to parse a string to an integer value
@@ -103,23 +547,82 @@ namespace libsitu {
     bool parse_string_to_integer(const char *str, int *val);
   }
 
-  /** @brief Opaque type used internally to represent a watch */
-  class Watch;
+  /** @brief Opaque type used internally to represent a set of watches */
+  class WatchTable;
+
+  /** @brief Opaque type used internally to index the watch positions */
+  class WatchIndex;
+
+  /** @brief Opaque type used internally to represent a compiled watch
+   * database */
+  class Database;
+
+  /** @brief Opaque type used internally to represent the compact watch
+   * set */
+  class CompactTable;
+
+  /** @brief Opaque type used internally to queue notifications for a
+   * subscription */
+  class NotificationQueue;
+
+  /** @brief Opaque type used internally to represent a connection to
+   * gpsd, without a poller thread */
+  class Session;
 
   /** @brief GPS interface
    *
    * Main API class, representing a GPS interface
+   *
+   * Once the set of watches is stable, processing a fix performs no heap
+   * allocation: from reading the gpsd message through to the watch
+   * alarms, with the exception of any allocation made by the callbacks
+   * themselves. Lazily allocated library state is allocated on the poller
+   * thread before the first fix. Use reserve_watches() to preallocate the
+   * watch table, so that adding anonymous watches (up to the reserved
+   * count) and removing watches also do not allocate.
+   *
+   * N.B. Where GNU MPFR is available, the temporaries it allocates are
+   * served from a pool per polling thread, through GMP memory functions
+   * installed when the first Gps is constructed; other GMP allocations are
+   * passed to the functions installed before. The application must not
+   * replace the GMP memory functions after that.
    */
   class Gps {
   public:
     /** @brief Constructor
+     *
+     * Returns immediately: the poller thread connects to gpsd, retrying
+     * with exponential backoff (from 0.25s to 30s, with random jitter)
+     * until it succeeds, and again whenever the connection is lost. The
+     * watches and their state are kept across reconnections.
+     *
+     * With TRANSPORT_SHM, the poller attaches to the shared memory segment
+     * exported by a co-located gpsd, and samples the latest fix on each
+     * wakeup, with no socket and no JSON; the host and port are ignored,
+     * and may be NULL. Both gpsd and libgps must be built with shared
+     * memory export enabled. The poll timeout then applies to the time
+     * since the segment was last updated.
+     *
+     * With POLLING_EXTERNAL, there is no poller thread: see get_fd(). The
+     * poll timeout, the sleep time and the poll schedule do not apply.
+     *
+     * A derived class whose dispatch_events() uses its own members should
+     * pass start as false, and call start_polling() last in its own
+     * constructor, so that no fix is processed before those members are
+     * constructed.
      *
      * @param[in] host Host name
      * @param[in] port Port designation
      * @param[in] poll_us GPS poll timeout, in microseconds
      * @param[in] sleep_us Inter-poll sleep time, in microseconds
+     * @param[in] transport Transport used to read fixes from gpsd
+     * @param[in] polling Polling mode
+     * @param[in] start Whether to start the poller thread now
      */
-    Gps(const char *host, const char *port, int poll_us, int sleep_us);
+    Gps(const char *host, const char *port, int poll_us, int sleep_us,
+        Transport transport = TRANSPORT_SOCKET,
+        Polling polling = POLLING_THREAD,
+        bool start = true);
 
     /** @brief Destructor */
     virtual ~Gps();
@@ -134,9 +637,106 @@ namespace libsitu {
      * @param[in] rad The watch radius, in meters
      * @param[in] alarm Watch alarm callback function
      * @param[in] data Opaque data to be passed to the watch alarm callback
+     * @return The watch identifier, or WATCH_ID_INVALID on failure
      */
-    void add_watch(const char *name, double lat, double lon, double rad,
-                   WatchAlarm alarm, void *data);
+    WatchId add_watch(const char *name, double lat, double lon, double rad,
+                      WatchAlarm alarm, void *data);
+
+    /** @brief Add a watch, using a specific Earth model
+     *
+     * Add a named GPS watch, overriding the default Earth model
+     *
+     * @param[in] name The name of the watch to be added
+     * @param[in] lat Latitude of the watch
+     * @param[in] lon Longitude of the watch
+     * @param[in] rad The watch radius, in meters
+     * @param[in] alarm Watch alarm callback function
+     * @param[in] data Opaque data to be passed to the watch alarm callback
+     * @param[in] model Earth model used for the watch distance calculations
+     * @return The watch identifier, or WATCH_ID_INVALID on failure
+     */
+    WatchId add_watch(const char *name, double lat, double lon, double rad,
+                      WatchAlarm alarm, void *data, Model model);
+
+    /** @brief Add an anonymous watch
+     *
+     * Add a GPS watch, identified only by the returned identifier
+     *
+     * @param[in] lat Latitude of the watch
+     * @param[in] lon Longitude of the watch
+     * @param[in] rad The watch radius, in meters
+     * @param[in] handler Watch handler callback function
+     * @param[in] data Opaque data to be passed to the watch handler
+     * @return The watch identifier, or WATCH_ID_INVALID on failure
+     */
+    WatchId add_watch(double lat, double lon, double rad,
+                      WatchHandler handler, void *data);
+
+    /** @brief Add an anonymous watch, using a specific Earth model
+     *
+     * @param[in] lat Latitude of the watch
+     * @param[in] lon Longitude of the watch
+     * @param[in] rad The watch radius, in meters
+     * @param[in] handler Watch handler callback function
+     * @param[in] data Opaque data to be passed to the watch handler
+     * @param[in] model Earth model used for the watch distance calculations
+     * @return The watch identifier, or WATCH_ID_INVALID on failure
+     */
+    WatchId add_watch(double lat, double lon, double rad,
+                      WatchHandler handler, void *data, Model model);
+
+    /** @brief Add an anonymous watch, without a callback
+     *
+     * Add a GPS watch whose events are delivered only to
+     * dispatch_events(); see BasicGps.
+     *
+     * @param[in] lat Latitude of the watch
+     * @param[in] lon Longitude of the watch
+     * @param[in] rad The watch radius, in meters
+     * @return The watch identifier, or WATCH_ID_INVALID on failure
+     */
+    WatchId add_watch(double lat, double lon, double rad);
+
+    /** @brief Add a compact watch
+     *
+     * Add an anonymous watch to the compact watch set, for large sets of
+     * watches on memory-constrained devices: a compact watch takes under
+     * 16 bytes, against several hundred for an added watch, and the set is
+     * scanned in the order of memory. The position is held in 1e-7 degree
+     * units, and the radius in whole meters, rounded up, of up to 65535m.
+     * The callback and data are held in a table shared by the compact
+     * watches using them, of up to 65535 entries; so a callback should
+     * distinguish watches by the slot index of their identifiers, rather
+     * than by their data.
+     *
+     * Compact watches are identified by WATCH_COMPACT, bitwise or'd with
+     * their slot index; a slot is reused once its watch is removed, so an
+     * identifier must not be used after its removal. They are evaluated
+     * with integer arithmetic only, as for PRECISION_FIXED but projected
+     * at the latitude of the fix, whatever the model and precision, and
+     * raise events without debouncing, after those of the added watches.
+     * They cannot have activation windows or be in routes, and are not
+     * included in nearest_watches(), watches_within() or save_state().
+     *
+     * @param[in] lat Latitude of the watch
+     * @param[in] lon Longitude of the watch
+     * @param[in] rad The watch radius, in meters
+     * @param[in] handler Watch handler callback function
+     * @param[in] data Opaque data to be passed to the watch handler
+     * @return The watch identifier, or WATCH_ID_INVALID on failure
+     */
+    WatchId add_compact_watch(double lat, double lon, double rad,
+                              WatchHandler handler, void *data);
+
+    /** @brief Reserve space for compact watches
+     *
+     * Preallocate the compact watch set for the specified number of
+     * watches, so that adding them does not reallocate, which briefly
+     * needs space for twice the set
+     *
+     * @param[in] count The number of compact watches
+     */
+    void reserve_compact_watches(size_t count);
 
     /** @brief Remove a watch
      *
@@ -146,6 +746,255 @@ namespace libsitu {
      */
     void remove_watch(const char *name);
 
+    /** @brief Remove a watch
+     *
+     * Remove a watch, or a compact watch, by identifier, in constant time
+     *
+     * @param[in] id The identifier of the watch to be removed
+     * @return True if the watch was found and removed
+     */
+    bool remove_watch(WatchId id);
+
+    /** @brief Set the debounce rules of a watch
+     *
+     * @param[in] id The identifier of the watch
+     * @param[in] debounce The debounce rules
+     * @return True if the watch was found
+     */
+    bool set_debounce(WatchId id, const Debounce &debounce);
+
+    /** @brief Set the activation window of a watch
+     *
+     * Outside of its window, a watch is moved out of the set of watches
+     * evaluated for each fix, so that it costs nothing; a timer wheel
+     * moves it back, in constant time, when the window opens. No watch
+     * lock is taken at the window boundaries, beyond that taken for each
+     * fix.
+     *
+     * When the window opens, the state of the watch is unknown, as for a
+     * new watch: if the receiver is already inside it, the first fix
+     * raises ARRIVE, subject to the debounce rules. When the window
+     * closes, the watch is deactivated silently: no DEPART is raised, and
+     * any pending state is discarded. An adaptive poll schedule wakes the
+     * poller when a window opens or closes.
+     *
+     * @param[in] id The identifier of the watch
+     * @param[in] window The activation window
+     * @return True if the watch was found, is not in a route, and the
+     * window is valid
+     */
+    bool set_window(WatchId id, const Window &window);
+
+    /** @brief Clear the activation window of a watch
+     *
+     * The watch is active at all times, as by default.
+     *
+     * @param[in] id The identifier of the watch
+     * @return True if the watch was found
+     */
+    bool clear_window(WatchId id);
+
+    /** @brief Add a route
+     *
+     * Order watches into a route, for a receiver that visits them in
+     * sequence, such as a train calling at stations. Only the stop at the
+     * route cursor, and up to ahead stops after it, are evaluated for
+     * each fix, so that the cost of a fix is the same whatever the length
+     * of the route. The cursor moves on to a stop on arrival, and past it
+     * on departure.
+     *
+     * If the receiver is found far from the stops being evaluated (more
+     * than twice the distance between the stops either side of the
+     * cursor), or on the first fix, the route is resynchronised: every
+     * stop is checked, once, and the cursor is moved to the nearest. A
+     * stop becoming evaluated is in an unknown state, as for a new watch,
+     * and a stop ceasing to be is dropped silently, as for a watch window
+     * closing; see set_window().
+     *
+     * A watch may belong to one route only, and may not have an
+     * activation window. Removing a watch removes it from its route.
+     * Routes are not saved by save_state(), and are removed by
+     * load_state().
+     *
+     * @param[in] ids The watches, in the order they are visited
+     * @param[in] count The number of watches
+     * @param[in] ahead The number of stops after the cursor to evaluate;
+     * at least one
+     * @return The route identifier, or ROUTE_ID_INVALID on failure
+     */
+    RouteId add_route(const WatchId *ids, size_t count, unsigned ahead = 2);
+
+    /** @brief Remove a route
+     *
+     * The watches of the route are kept, and are all evaluated for each
+     * fix again.
+     *
+     * @param[in] id The identifier of the route
+     * @return True if the route was found and removed
+     */
+    bool remove_route(RouteId id);
+
+    /** @brief Get the cursor of a route
+     *
+     * @param[in] id The identifier of the route
+     * @param[out] cursor The index, in the route, of the current stop
+     * @return True if the route was found
+     */
+    bool get_route_cursor(RouteId id, size_t &cursor);
+
+    /** @brief Reserve space for watches
+     *
+     * Preallocate the watch table for the specified number of watches
+     *
+     * @param[in] count The number of watches
+     */
+    void reserve_watches(size_t count);
+
+    /** @brief Bind a callback key
+     *
+     * Name a watch alarm callback and its data, so that saved watches
+     * using them can be reconnected to them when restored. Binding a key
+     * again replaces its callback.
+     *
+     * @param[in] key The binding key
+     * @param[in] alarm Watch alarm callback function
+     * @param[in] data Opaque data to be passed to the watch alarm callback
+     */
+    void bind_callbacks(const char *key, WatchAlarm alarm, void *data);
+
+    /** @brief Bind a callback key
+     *
+     * Name a watch handler callback and its data; see above.
+     *
+     * @param[in] key The binding key
+     * @param[in] handler Watch handler callback function
+     * @param[in] data Opaque data to be passed to the watch handler
+     */
+    void bind_callbacks(const char *key, WatchHandler handler, void *data);
+
+    /** @brief Save the watch state
+     *
+     * Save the watches, with their geometry, names, identifiers, debounce
+     * rules, binding keys and current NEAR/FAR state, and the last fix,
+     * to a compact binary file. The file is replaced atomically. Watches
+     * with callbacks that have not been bound to a key are saved without
+     * them.
+     *
+     * @param[in] path The file path
+     * @return Success flag
+     */
+    bool save_state(const char *path);
+
+    /** @brief Load the watch state
+     *
+     * Replace the watches, and the last fix, with those saved by
+     * save_state(); typically on a restart, before the first fix. Bind
+     * the callback keys first. Restored watches keep their identifiers,
+     * and their state, so a fix inside a watch that was NEAR raises no
+     * ARRIVE event. The file is mapped and used in place, and the poller
+     * is held off only while the watch sets are exchanged.
+     *
+     * The file must have been saved on a host of the same byte order.
+     *
+     * @param[in] path The file path
+     * @return Success flag; on failure, the watches are unchanged
+     */
+    bool load_state(const char *path);
+
+    /** @brief Find the nearest watches
+     *
+     * Find the watches whose centres are nearest to a point, in
+     * logarithmic time, using a spatial index of the watches. The index
+     * is rebuilt by the first query after watches are added or removed,
+     * which takes O(n log n) time; only copying the watch positions for
+     * that holds off the poller.
+     *
+     * N.B. Queries must not be made from a watch callback.
+     *
+     * @param[in] lat Latitude of the point
+     * @param[in] lon Longitude of the point
+     * @param[in] k The number of watches to find
+     * @param[out] out Array of at least k watches, filled in ascending
+     * order of distance
+     * @return The number of watches found: k, unless there are fewer
+     */
+    size_t nearest_watches(double lat, double lon, size_t k,
+                           WatchDistance *out);
+
+    /** @brief Find the watches within a radius
+     *
+     * Find the watches whose centres are within a great circle distance
+     * of a point, using the spatial index; see nearest_watches().
+     *
+     * @param[in] lat Latitude of the point
+     * @param[in] lon Longitude of the point
+     * @param[in] radius The radius, in meters
+     * @param[out] out Array of at least max watches, filled with the
+     * nearest matches in ascending order of distance; may be NULL if max
+     * is zero
+     * @param[in] max The number of watches for which there is space
+     * @return The number of watches within the radius, which may be
+     * greater than max
+     */
+    size_t watches_within(double lat, double lon, double radius,
+                          WatchDistance *out, size_t max);
+
+    /** @brief Open a compiled watch database
+     *
+     * Open a database compiled by the situdb utility, replacing any
+     * database already open. The file is mapped read-only and shared, so
+     * that processes using the same database share its pages; opening it
+     * copies nothing, but checks every record, and rejects a corrupt
+     * file. Each process holds only the set of database watches that the
+     * receiver is near. The database is immutable: to update it, compile
+     * a new one and open that.
+     *
+     * Database watches are identified by WATCH_DATABASE, bitwise or'd
+     * with their record index, and are named. They are evaluated on the
+     * sphere (in the local tangent plane, where that is accurate enough)
+     * in double precision, whatever the model and precision, and raise
+     * events without debouncing. Their events are dispatched after those
+     * of the added watches. They are not included in nearest_watches(),
+     * watches_within() or save_state().
+     *
+     * @param[in] path Path of the database
+     * @param[in] alarm Named watch callback function
+     * @param[in] data Opaque data for the callback function
+     * @return Success flag
+     */
+    bool open_database(const char *path, WatchAlarm alarm, void *data);
+
+    /** @brief Open a compiled watch database
+     *
+     * As above, but with a watch handler callback.
+     *
+     * @param[in] path Path of the database
+     * @param[in] handler Watch handler callback function
+     * @param[in] data Opaque data for the callback function
+     * @return Success flag
+     */
+    bool open_database(const char *path, WatchHandler handler, void *data);
+
+    /** @brief Close the compiled watch database, if open
+     *
+     * No departure events are raised for its watches.
+     */
+    void close_database();
+
+    /** @brief Get the version of the compiled watch database
+     *
+     * @return The version given to the compiler, or 0 if no database is
+     * open
+     */
+    uint64_t get_database_version() const;
+
+    /** @brief Find a watch of the compiled watch database by name
+     *
+     * @param[in] name Watch name
+     * @return The watch identifier, or WATCH_ID_INVALID if not found
+     */
+    WatchId find_database_watch(const char *name) const;
+
     /** @brief Get the host name
      *
      * @return The host name
@@ -170,51 +1019,532 @@ namespace libsitu {
      */
     int get_sleep_us() const;
 
+    /** @brief Get the connection state
+     *
+     * Takes no lock, so may be called from a callback.
+     *
+     * @return The state of the connection to gpsd
+     */
+    Connection get_connection() const;
+
+    /** @brief Get the transport
+     *
+     * @return The transport used to read fixes from gpsd
+     */
+    Transport get_transport() const;
+
+    /** @brief Get the gpsd socket, with POLLING_EXTERNAL
+     *
+     * Get the socket to be added to the application's poll set, watching
+     * for it to become readable, and then calling process_ready(). If not
+     * connected to gpsd, this first connects, synchronously; if that
+     * fails, the application should retry later, backing off as it sees
+     * fit.
+     *
+     * With POLLING_EXTERNAL, everything runs on the application's thread,
+     * and no locks are taken: the Gps, its subscriptions and its waiters
+     * must then be used from that thread only, and a subscription with
+     * OVERFLOW_BLOCK would block it for good.
+     *
+     * @return The socket, or -1 if not connected, or not POLLING_EXTERNAL
+     */
+    int get_fd();
+
+    /** @brief Process the messages ready on the gpsd socket, with
+     * POLLING_EXTERNAL
+     *
+     * Read the messages queued on the socket, without blocking, and
+     * process the latest fix among them, evaluating the watches and
+     * calling back, on the calling thread.
+     *
+     * @return False if the connection was lost, whereupon the socket is
+     * closed, and the application should stop polling it, and call
+     * get_fd() again to reconnect
+     */
+    bool process_ready();
+
+    /** @brief Set the message filter
+     *
+     * Set the classes of gpsd message to be decoded. Messages of other
+     * classes are dropped as they are read, on a check of their class,
+     * without being decoded, and counted in the statistics. The default is
+     * MESSAGE_ALL. Fixes need MESSAGE_TPV; Fix::satellites_used also needs
+     * MESSAGE_SKY, and is otherwise zero.
+     *
+     * N.B. gpsd sends every class to a JSON client, so this saves the
+     * decoding, not the reading. It applies to TRANSPORT_SOCKET only.
+     *
+     * @param[in] messages Mask of the Message classes to be decoded
+     */
+    void set_messages(unsigned messages);
+
+    /** @brief Get the message filter
+     *
+     * @return Mask of the Message classes to be decoded
+     */
+    unsigned get_messages() const;
+
+    /** @brief Set the default Earth model
+     *
+     * Set the Earth model used by watches subsequently added without an
+     * explicit model. The default is MODEL_SPHERICAL.
+     *
+     * @param[in] model The Earth model
+     */
+    void set_model(Model model);
+
+    /** @brief Get the default Earth model
+     *
+     * @return The default Earth model
+     */
+    Model get_model() const;
+
+    /** @brief Set the default debounce rules
+     *
+     * Set the debounce rules of watches subsequently added. The default
+     * is to commit to a change of state immediately.
+     *
+     * @param[in] debounce The debounce rules
+     */
+    void set_debounce(const Debounce &debounce);
+
+    /** @brief Get the default debounce rules
+     *
+     * @param[out] debounce The debounce rules
+     */
+    void get_debounce(Debounce &debounce) const;
+
+    /** @brief Set the numeric precision
+     *
+     * Set the numeric policy used for RMS error calculations, and for the
+     * spherical distance calculations of watches subsequently added. The
+     * default is PRECISION_DEFAULT.
+     *
+     * N.B. Spherical watches that are small enough for a local tangent
+     * plane to be accurate to 0.25m (e.g. 500m radius, below 70 degrees of
+     * latitude) are evaluated in that plane, without trig or a square
+     * root, whatever the precision.
+     *
+     * With PRECISION_FIXED, watches are evaluated with integer arithmetic
+     * only, against a local projection computed when the watch is added.
+     * Classification then matches the spherical model except within
+     * around 0.1% of the distance of a zone boundary, for watches of up to
+     * 10km radius below 70 degrees of latitude. The distances given with
+     * their events are measured in the same projection, and RMS error
+     * calculations use single precision.
+     *
+     * @param[in] precision The numeric precision
+     */
+    void set_precision(Precision precision);
+
+    /** @brief Get the numeric precision
+     *
+     * @return The numeric precision
+     */
+    Precision get_precision() const;
+
+    /** @brief Set the arrival prediction lead time
+     *
+     * Boundary crossings of watches are interpolated along the straight
+     * line between the fix raising an event and the previous fix, given
+     * the GPS times of both, up to 10s apart; the time and position of
+     * the crossing are given in the WatchEvent. With a lead time, a
+     * PREDICT event is also raised, once per approach, when the receiver,
+     * continuing along its track at its speed (both from the fix), would
+     * enter a FAR watch within the lead time; the WatchEvent then gives
+     * the predicted time and position of the arrival. The ARRIVE event
+     * follows as usual, if the receiver does arrive. The default is 0,
+     * for no prediction.
+     *
+     * N.B. This applies to added watches only: for compact and database
+     * watches, the time and position of an event are those of the fix.
+     * Debounced events are not interpolated. With a poll schedule, the
+     * poller wakes the lead time earlier than it otherwise would.
+     *
+     * @param[in] lead_s The lead time, in seconds, or 0
+     */
+    void set_prediction(double lead_s);
+
+    /** @brief Get the arrival prediction lead time
+     *
+     * @return The lead time, in seconds, or 0 for no prediction
+     */
+    double get_prediction() const;
+
+    /** @brief Set the adaptive poll schedule
+     *
+     * After each fix, the poller sleeps for the time that the receiver
+     * would take to reach the nearest watch boundary, less the error
+     * radius of the fix, if it accelerated at max_accel from its current
+     * speed (plus one standard deviation); then clamped to the schedule
+     * bounds. A receiver far from any watch, or parked, so wakes rarely,
+     * but always before it could have crossed a boundary. After a timeout
+     * or an invalid fix, it sleeps for min_sleep_us.
+     *
+     * Messages received during the sleep are read on waking, and only
+     * the most recent fix is processed. Adding a watch, opening a
+     * database, changing a window or a route, or changing the schedule
+     * or the lead time cuts the sleep short, so that the change is
+     * allowed for from the next fix.
+     *
+     * N.B. Tracking the distance to the nearest boundary may cost a
+     * square root per watch and fix for watches in the local tangent
+     * plane, which otherwise would need none.
+     *
+     * @param[in] schedule The poll schedule
+     */
+    void set_schedule(const Schedule &schedule);
+
+    /** @brief Get the adaptive poll schedule
+     *
+     * @param[out] schedule The poll schedule
+     */
+    void get_schedule(Schedule &schedule) const;
+
+    /** @brief Get the poller statistics
+     *
+     * @param[out] stats The poller statistics
+     */
+    void get_stats(Stats &stats) const;
+
     /** @brief Get the last fix
+     *
+     * Called from a watch callback, this gets the fix that raised the
+     * event, so that, for instance, Util::latency() gives the latency of
+     * the event.
      *
      * @param[out] fix The fix
      */
     void get_last_fix(Fix &fix) const;
 
+    /** @brief Add a waiter
+     *
+     * Register a one-shot waiter, to be offered the following fixes and
+     * watch events, and woken by the first it accepts.
+     *
+     * @param[in] waiter The waiter, which must remain valid until it is
+     * woken or removed
+     */
+    void add_waiter(Waiter *waiter);
+
+    /** @brief Remove a waiter
+     *
+     * Remove a waiter that has not yet accepted a notification. If it
+     * has, and is yet to be woken, this waits until it has been woken;
+     * except on the poller thread (from a wake function, for instance),
+     * where it may still be woken after this returns.
+     *
+     * @param[in] waiter The waiter
+     * @return Whether the waiter was removed before accepting a
+     * notification
+     */
+    bool remove_waiter(Waiter *waiter);
+
+  protected:
+
+    /** @brief Dispatch watch events
+     *
+     * Called once per fix, with the watch lock held, with the events
+     * raised by that fix in watch order; and once more for the events of
+     * compiled database watches, if any. The default implementation calls
+     * the registered callback functions, via CallbackAdapter.
+     *
+     * @param[in] events The watch events
+     * @param[in] count The number of watch events
+     */
+    virtual void dispatch_events(const WatchEvent *events, size_t count);
+
+    /** @brief Start the poller thread
+     *
+     * A derived class that constructed the base with start false should
+     * call this last in its constructor. Does nothing with
+     * POLLING_EXTERNAL.
+     */
+    void start_polling();
+
+    /** @brief Stop the poller thread
+     *
+     * A derived class whose dispatch_events() uses its own members should
+     * call this from its destructor, so that no fix is processed while
+     * those members are being destroyed.
+     */
+    void stop_polling();
+
   private:
 
     Gps(const Gps&);
     Gps& operator=(const Gps&);
 
-    typedef std::map<std::string,Watch> WatchMap;
-
     /*
      * This needs to be a friend, so that it can call handle_poll_fix() and
-     * handle_poll_timeout()
+     * handle_poll_timeout(), and sleep on m_reschedule
      */
     friend void* poller(void *arg);
+    friend class Subscription;
+    friend class Session;
 
     void handle_poll_fix(const Fix &fix);
     void handle_poll_timeout();
+    int handle_poll_sleep();
+    void reschedule();
+    void handle_poll_connection(Connection connection);
+    void handle_poll_messages(unsigned long messages, unsigned long bytes,
+                              const unsigned long *dropped);
+
+    int schedule_sleep_us(const Fix &fix, double clearance) const;
 
     virtual void handle_fix(const Fix &fix);
     virtual void handle_timeout();
+    virtual void handle_connection(Connection connection);
 
     void lock_watches();
     void unlock_watches();
 
-    void start_polling();
-    void stop_polling();
+    void lock_index();
+    void unlock_index();
+    void refresh_index();
+
+    bool open_database(const char *path, WatchAlarm alarm,
+                       WatchHandler handler, void *data);
+
+    void subscribe(NotificationQueue *queue);
+    void unsubscribe(NotificationQueue *queue);
+    void publish(const Notification &notification);
+    void publish_events(const WatchEvent *events, size_t count);
+    bool arm(NotificationQueue *queue, Waiter *waiter);
+    bool disarm(NotificationQueue *queue, Waiter *waiter);
+    void deliver_held();
+    void wake_waiters();
+    void wait_for(pthread_mutex_t &mutex);
+    void wait_for_wakes();
 
     char *m_host;
     char *m_port;
     int m_poll_us;
     int m_sleep_us;
+    Transport m_transport;
+    Polling m_polling_mode;
+    unsigned m_messages;
+    Model m_model;
+    Precision m_precision;
+    double m_lead_s;
+    Debounce m_debounce;
+    Schedule m_schedule;
 
     pthread_t m_poll_thread;
+    /* N.B. Also guards the schedule and the statistics */
     pthread_mutex_t m_watch_mutex;
-    WatchMap m_watches;
+    WatchTable *m_watches;
+    /* N.B. Taken before the watch mutex, where both are needed */
+    pthread_mutex_t m_index_mutex;
+    WatchIndex *m_index;
+    Database *m_database;
+    CompactTable *m_compact;
+    /* N.B. Guarded by the watch mutex */
+    NotificationQueue *m_subscribers;
+    NotificationQueue *m_held;
+    Waiter *m_waiters;
+    Waiter *m_woken;
+    /* N.B. Held by the poller while it wakes waiters; taken after the
+     * watch mutex, where both are needed */
+    pthread_mutex_t m_wake_mutex;
+    /* N.B. Held by the poller while it pushes the notifications held for
+     * subscriptions with OVERFLOW_BLOCK; taken after the watch mutex */
+    pthread_mutex_t m_deliver_mutex;
+    /* N.B. Posted when the watches or the schedule change, to wake the
+     * poller from its sleep */
+    sem_t m_reschedule;
+    /* N.B. With POLLING_EXTERNAL only */
+    Session *m_session;
 
     bool m_polling;
+    /* N.B. Read and written atomically, rather than under the watch
+     * mutex */
+    Connection m_connection;
+    int m_next_sleep_us;
+    double m_start_s;
+    Stats m_stats;
 
     Fix m_last_fix;
   };
 
+  /** @brief Subscription to the fixes and watch events of a GPS interface
+   *
+   * Any number of subscriptions may be attached to one GPS interface, so
+   * that independent consumers share its gpsd connection and poller.
+   * Each subscription has a bounded queue of its own, which the poller
+   * publishes to without taking a lock, so that a slow subscriber only
+   * overflows its own queue, according to its overflow policy.
+   *
+   * Notifications are either taken from the queue with pop() or wait(),
+   * or, if a handler is given, delivered to the handler on a thread of
+   * the subscription's own.
+   *
+   * A subscription must be destroyed before its GPS interface.
+   */
+  class Subscription {
+  public:
+    /** @brief Constructor, for a queue to be read with pop() or wait()
+     *
+     * @param[in] gps GPS interface to subscribe to
+     * @param[in] capacity Capacity of the queue, rounded up to a power of
+     * two
+     * @param[in] overflow Policy for a full queue
+     * @param[in] types Mask of the NotificationType types to be delivered
+     */
+    Subscription(Gps &gps, size_t capacity, Overflow overflow,
+                 unsigned types = NOTIFICATION_FIX | NOTIFICATION_EVENT);
+
+    /** @brief Constructor, for delivery to a handler
+     *
+     * @param[in] gps GPS interface to subscribe to
+     * @param[in] capacity Capacity of the queue, rounded up to a power of
+     * two
+     * @param[in] overflow Policy for a full queue
+     * @param[in] handler Callback function, called on the subscription's
+     * delivery thread
+     * @param[in] data Opaque data for the callback function
+     * @param[in] types Mask of the NotificationType types to be delivered
+     */
+    Subscription(Gps &gps, size_t capacity, Overflow overflow,
+                 NotificationHandler handler, void *data,
+                 unsigned types = NOTIFICATION_FIX | NOTIFICATION_EVENT);
+
+    /** @brief Destructor
+     *
+     * Detaches from the GPS interface, discarding any queued
+     * notifications
+     */
+    ~Subscription();
+
+    /** @brief Take a notification, without waiting
+     *
+     * @param[out] notification The notification
+     * @return Whether a notification was queued
+     */
+    bool pop(Notification &notification);
+
+    /** @brief Take a notification, waiting for one if need be
+     *
+     * @param[out] notification The notification
+     * @param[in] timeout_us Longest time to wait, in microseconds, or -1
+     * to wait indefinitely
+     * @return Whether a notification was taken
+     */
+    bool wait(Notification &notification, int timeout_us);
+
+    /** @brief Get the number of dropped notifications
+     *
+     * @return The number of notifications dropped on overflow
+     */
+    unsigned long get_dropped() const;
+
+    /** @brief Arm a waiter
+     *
+     * Register a one-shot waiter, to be woken once a notification is
+     * queued, unless one already is. Only the wake function is called.
+     * At most one waiter may be armed at a time.
+     *
+     * @param[in] waiter The waiter, which must remain valid until it is
+     * woken or disarmed
+     * @return Whether the waiter was armed; false if a notification is
+     * already queued
+     */
+    bool arm(Waiter *waiter);
+
+    /** @brief Disarm a waiter
+     *
+     * As Gps::remove_waiter(), for a waiter armed on the subscription.
+     *
+     * @param[in] waiter The waiter
+     * @return Whether the waiter was disarmed before being woken
+     */
+    bool disarm(Waiter *waiter);
+
+  private:
+
+    Subscription(const Subscription&);
+    Subscription& operator=(const Subscription&);
+
+    static void* deliver(void *arg);
+
+    void start();
+
+    Gps &m_gps;
+    NotificationQueue *m_queue;
+    NotificationHandler m_handler;
+    void *m_data;
+    pthread_t m_thread;
+    bool m_delivering;
+  };
+
+  /** @brief GPS interface with an inline watch handler
+   *
+   * A GPS interface that delivers every watch event to a handler object,
+   * stored by value, rather than through per-watch function pointers. The
+   * handler is called directly from the dispatch loop, so its handling of
+   * ARRIVE/DEPART events can be inlined there.
+   *
+   * Handler must be copy constructible, and callable as
+   * handler(const WatchEvent &event). Watches are typically added with
+   * add_watch(lat, lon, rad); events for watches with callback functions
+   * are delivered to the handler too, and the callback functions are not
+   * called.
+   */
+  template <typename Handler>
+  class BasicGps : public Gps {
+  public:
+    /** @brief Constructor
+     *
+     * @param[in] host Host name
+     * @param[in] port Port designation
+     * @param[in] poll_us GPS poll timeout, in microseconds
+     * @param[in] sleep_us Inter-poll sleep time, in microseconds
+     * @param[in] handler Watch event handler
+     * @param[in] transport Transport used to read fixes from gpsd
+     * @param[in] polling Polling mode
+     */
+    BasicGps(const char *host, const char *port, int poll_us, int sleep_us,
+             const Handler &handler = Handler(),
+             Transport transport = TRANSPORT_SOCKET,
+             Polling polling = POLLING_THREAD)
+      : Gps(host, port, poll_us, sleep_us, transport, polling, false),
+        m_handler(handler)
+    {
+      /* N.B. Only now can the poller call dispatch_events() */
+      start_polling();
+    }
+
+    /** @brief Destructor */
+    virtual ~BasicGps()
+    {
+      stop_polling();
+    }
+
+    /** @brief Get the watch event handler
+     *
+     * @return The watch event handler
+     */
+    Handler& get_handler()
+    {
+      return m_handler;
+    }
+
+  private:
+
+    BasicGps(const BasicGps&);
+    BasicGps& operator=(const BasicGps&);
+
+    virtual void dispatch_events(const WatchEvent *events, size_t count)
+    {
+      for (size_t i = 0; i < count; ++i) {
+        m_handler(events[i]);
+      }
+    }
+
+    Handler m_handler;
+  };
+
 }
 
 #endif
@@ -0,0 +1,408 @@
+/*
+  Copyright 2013-2014 Simon Dawson
+
+  This file is part of libsitu.
+
+  libsitu is free software: you can redistribute it and/or modify
+  it under the terms of the GNU Lesser General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  libsitu is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU Lesser General Public License for more details.
+
+  You should have received a copy of the GNU Lesser General Public License
+  along with libsitu.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef _LIBSITU_CORO_H_
+#define _LIBSITU_CORO_H_
+
+#include <libsitu.h>
+
+/*
+ * C++20 coroutine support, which is header only, so that the library
+ * itself need not be built as C++20. Without coroutine support, this
+ * header declares nothing further; the Waiter hook it is built on is
+ * available regardless.
+ */
+#if defined(__cpp_impl_coroutine) && __cpp_impl_coroutine >= 201902L
+
+#include <coroutine>
+
+namespace libsitu {
+
+  /** @brief Coroutine support
+   *
+   * Awaitable fixes and watch events, for coroutines. A suspended
+   * coroutine costs a Waiter, and no thread: it is resumed from the fix
+   * processing path, through an executor, once the watch lock has been
+   * released.
+   *
+   * An executor is any copyable type with a member function
+   * post(std::coroutine_handle<>), called on the poller thread; it should
+   * queue the coroutine to be resumed on an executor thread, so as not to
+   * hold up the poller. InlineExecutor resumes it on the poller thread
+   * directly.
+   *
+   * A coroutine suspended in one of these operations may be destroyed
+   * (cancelled) up until the notification arrives, but not while it is
+   * being resumed.
+   */
+  namespace Coro {
+
+    /** @brief Executor that resumes on the poller thread */
+    struct InlineExecutor {
+      /** @brief Resume a coroutine
+       *
+       * @param[in] handle The coroutine
+       */
+      void post(std::coroutine_handle<> handle) const
+      {
+        handle.resume();
+      }
+    };
+
+    /** @brief Awaitable for the next notification of a GPS interface */
+    template <typename Executor = InlineExecutor>
+    class NextNotification {
+    public:
+      /** @brief Constructor
+       *
+       * @param[in] gps GPS interface
+       * @param[in] types Mask of the NotificationType types awaited
+       * @param[in] id Watch whose events are awaited, or WATCH_ID_INVALID
+       * for any watch
+       * @param[in] executor Executor on which to resume
+       */
+      NextNotification(Gps &gps, unsigned types, WatchId id,
+                       const Executor &executor)
+        : m_gps(gps),
+          m_id(id),
+          m_executor(executor),
+          m_waiter(),
+          m_handle(),
+          m_notification(),
+          m_suspended(false),
+          m_resumed(false)
+      {
+        m_waiter.types = types;
+        m_waiter.notify = &notify;
+        m_waiter.wake = &wake;
+        m_waiter.data = this;
+      }
+
+      NextNotification(const NextNotification&) = delete;
+      NextNotification& operator=(const NextNotification&) = delete;
+
+      /** @brief Destructor; cancels the wait, if still suspended */
+      ~NextNotification()
+      {
+        if (m_suspended && !m_resumed) {
+          m_gps.remove_waiter(&m_waiter);
+        }
+      }
+
+      /** @brief Never ready before suspending */
+      bool await_ready() const noexcept
+      {
+        return false;
+      }
+
+      /** @brief Register the waiter
+       *
+       * @param[in] handle The suspended coroutine
+       */
+      void await_suspend(std::coroutine_handle<> handle)
+      {
+        /* N.B. The coroutine may be resumed before add_waiter() returns,
+         * so nothing is touched afterwards */
+        m_handle = handle;
+        m_suspended = true;
+        m_gps.add_waiter(&m_waiter);
+      }
+
+      /** @brief Get the notification
+       *
+       * @return The notification
+       */
+      Notification await_resume() noexcept
+      {
+        m_resumed = true;
+        return m_notification;
+      }
+
+    private:
+      static bool notify(Waiter *waiter, const Notification &notification)
+      {
+        NextNotification *self = static_cast<NextNotification*>(waiter->data);
+        if (NOTIFICATION_EVENT == notification.type &&
+            WATCH_ID_INVALID != self->m_id &&
+            self->m_id != notification.event.id) {
+          return false;
+        }
+        self->m_notification = notification;
+        return true;
+      }
+
+      static void wake(Waiter *waiter)
+      {
+        /* N.B. Resuming may destroy the awaitable */
+        NextNotification *self = static_cast<NextNotification*>(waiter->data);
+        const Executor executor = self->m_executor;
+        const std::coroutine_handle<> handle = self->m_handle;
+        executor.post(handle);
+      }
+
+      Gps &m_gps;
+      WatchId m_id;
+      Executor m_executor;
+      Waiter m_waiter;
+      std::coroutine_handle<> m_handle;
+      Notification m_notification;
+      bool m_suspended;
+      bool m_resumed;
+    };
+
+    /** @brief Awaitable for the next fix, giving the Fix */
+    template <typename Executor = InlineExecutor>
+    class NextFix : public NextNotification<Executor> {
+    public:
+      /** @brief Constructor
+       *
+       * @param[in] gps GPS interface
+       * @param[in] executor Executor on which to resume
+       */
+      NextFix(Gps &gps, const Executor &executor)
+        : NextNotification<Executor>(gps, NOTIFICATION_FIX,
+                                     WATCH_ID_INVALID, executor)
+      {
+      }
+
+      /** @brief Get the fix
+       *
+       * @return The fix
+       */
+      Fix await_resume() noexcept
+      {
+        return NextNotification<Executor>::await_resume().fix;
+      }
+    };
+
+    /** @brief Awaitable for the next watch event, giving its Notification
+     *
+     * The notification, rather than the WatchEvent, since it carries a
+     * copy of the name of the watch, which may be removed meanwhile.
+     */
+    template <typename Executor = InlineExecutor>
+    class NextEvent : public NextNotification<Executor> {
+    public:
+      /** @brief Constructor
+       *
+       * @param[in] gps GPS interface
+       * @param[in] id Watch whose events are awaited, or WATCH_ID_INVALID
+       * for any watch
+       * @param[in] executor Executor on which to resume
+       */
+      NextEvent(Gps &gps, WatchId id, const Executor &executor)
+        : NextNotification<Executor>(gps, NOTIFICATION_EVENT, id, executor)
+      {
+      }
+
+      /** @brief Get the watch event
+       *
+       * @return The notification of the watch event
+       */
+      Notification await_resume() noexcept
+      {
+        return NextNotification<Executor>::await_resume();
+      }
+    };
+
+    /** @brief Await the next fix
+     *
+     * @param[in] gps GPS interface
+     * @param[in] executor Executor on which to resume
+     * @return Awaitable, giving the fix
+     */
+    template <typename Executor = InlineExecutor>
+    NextFix<Executor> next_fix(Gps &gps,
+                               const Executor &executor = Executor())
+    {
+      return NextFix<Executor>(gps, executor);
+    }
+
+    /** @brief Await the next watch event
+     *
+     * @param[in] gps GPS interface
+     * @param[in] id Watch whose events are awaited, or WATCH_ID_INVALID
+     * for any watch
+     * @param[in] executor Executor on which to resume
+     * @return Awaitable, giving the notification of the watch event
+     */
+    template <typename Executor = InlineExecutor>
+    NextEvent<Executor> next_event(Gps &gps, WatchId id = WATCH_ID_INVALID,
+                                   const Executor &executor = Executor())
+    {
+      return NextEvent<Executor>(gps, id, executor);
+    }
+
+    /** @brief Stream of notifications
+     *
+     * An asynchronous stream over a Subscription, so that no notification
+     * is missed between awaits: those published meanwhile are queued,
+     * subject to the overflow policy. Awaiting next() completes at once
+     * while notifications are queued, and otherwise suspends until one
+     * is. One coroutine at a time may await the stream.
+     *
+     * @code
+     * Coro::NotificationStream<> stream(gps, 64, OVERFLOW_DROP_OLDEST,
+     *                                   NOTIFICATION_EVENT);
+     * for (;;) {
+     *   const Notification notification = co_await stream.next();
+     *   ...
+     * }
+     * @endcode
+     */
+    template <typename Executor = InlineExecutor>
+    class NotificationStream {
+    public:
+      /** @brief Awaitable for the next notification of the stream */
+      class Next {
+      public:
+        /** @brief Constructor
+         *
+         * @param[in] stream The stream
+         */
+        explicit Next(NotificationStream &stream)
+          : m_stream(stream),
+            m_notification(),
+            m_taken(false)
+        {
+        }
+
+        Next(const Next&) = delete;
+        Next& operator=(const Next&) = delete;
+
+        /** @brief Take a queued notification, if any */
+        bool await_ready()
+        {
+          m_taken = m_stream.m_subscription.pop(m_notification);
+          return m_taken;
+        }
+
+        /** @brief Arm the stream's waiter, unless a notification is
+         * already queued
+         *
+         * @param[in] handle The suspended coroutine
+         * @return Whether to stay suspended
+         */
+        bool await_suspend(std::coroutine_handle<> handle)
+        {
+          m_stream.m_handle = handle;
+          m_stream.m_armed = true;
+          if (!m_stream.m_subscription.arm(&m_stream.m_waiter)) {
+            m_stream.m_armed = false;
+            return false;
+          }
+          return true;
+        }
+
+        /** @brief Get the notification
+         *
+         * @return The notification
+         */
+        Notification await_resume()
+        {
+          if (!m_taken) {
+            m_stream.m_armed = false;
+            m_stream.m_subscription.wait(m_notification, -1);
+          }
+          return m_notification;
+        }
+
+      private:
+        NotificationStream &m_stream;
+        Notification m_notification;
+        bool m_taken;
+      };
+
+      /** @brief Constructor
+       *
+       * @param[in] gps GPS interface
+       * @param[in] capacity Capacity of the queue
+       * @param[in] overflow Policy for a full queue
+       * @param[in] types Mask of the NotificationType types to be
+       * delivered
+       * @param[in] executor Executor on which to resume
+       */
+      NotificationStream(Gps &gps, size_t capacity, Overflow overflow,
+                         unsigned types =
+                           NOTIFICATION_FIX | NOTIFICATION_EVENT,
+                         const Executor &executor = Executor())
+        : m_subscription(gps, capacity, overflow, types),
+          m_executor(executor),
+          m_waiter(),
+          m_handle(),
+          m_armed(false)
+      {
+        m_waiter.types = types;
+        m_waiter.wake = &wake;
+        m_waiter.data = this;
+      }
+
+      NotificationStream(const NotificationStream&) = delete;
+      NotificationStream& operator=(const NotificationStream&) = delete;
+
+      /** @brief Destructor */
+      ~NotificationStream()
+      {
+        if (m_armed) {
+          m_subscription.disarm(&m_waiter);
+        }
+      }
+
+      /** @brief Await the next notification
+       *
+       * @return Awaitable, giving the notification
+       */
+      Next next()
+      {
+        return Next(*this);
+      }
+
+      /** @brief Get the number of dropped notifications
+       *
+       * @return The number of notifications dropped on overflow
+       */
+      unsigned long get_dropped() const
+      {
+        return m_subscription.get_dropped();
+      }
+
+    private:
+      static void wake(Waiter *waiter)
+      {
+        NotificationStream *self =
+          static_cast<NotificationStream*>(waiter->data);
+        const Executor executor = self->m_executor;
+        const std::coroutine_handle<> handle = self->m_handle;
+        executor.post(handle);
+      }
+
+      Subscription m_subscription;
+      Executor m_executor;
+      Waiter m_waiter;
+      std::coroutine_handle<> m_handle;
+      bool m_armed;
+    };
+
+  }
+
+}
+
+#endif /* __cpp_impl_coroutine */
+
+#endif
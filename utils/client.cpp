@@ -25,14 +25,18 @@
 namespace libsitu {
 
   Client::Client(const char *host, const char *port, int timeout_s,
-                 bool oneshot)
-    : Gps(host, port, timeout_s * 1000000, 500000),
+                 bool oneshot, Transport transport)
+    : Gps(host, port, timeout_s * 1000000, 500000, transport,
+          POLLING_THREAD, false),
       m_oneshot(oneshot),
       m_fix_found(false)
   {
+    /* N.B. Only now can the poller call handle_fix() */
+    start_polling();
   }
 
   Client::~Client() {
+    stop_polling();
   }
 
   bool Client::fix_found() const
@@ -26,7 +26,8 @@ namespace libsitu {
 
 class Client : public Gps {
 public:
-  Client(const char *host, const char *port, int timeout_s, bool oneshot);
+  Client(const char *host, const char *port, int timeout_s, bool oneshot,
+         Transport transport);
   virtual ~Client();
 
   bool fix_found() const;
@@ -42,7 +42,9 @@ void print_help(
          "  -t, --timeout=TIMEOUT  Timeout waiting for GPS data after the\n"
          "                         specified number of seconds\n"
          "  -x, --host=HOST        Connect to gpsd on specified host\n"
-         "  -p, --port=PORT        Connect to gpsd on specified port\n",
+         "  -p, --port=PORT        Connect to gpsd on specified port\n"
+         "  -s, --shm              Read from the gpsd shared memory export,\n"
+         "                         rather than connecting to gpsd\n",
          program_name);
 }
 
@@ -56,6 +58,7 @@ int main(int argc, char *argv[])
   int timeout_s = 5;
   const char *host = "localhost";
   const char *port = "gpsd";
+  libsitu::Transport transport = libsitu::TRANSPORT_SOCKET;
   while (true) {
     int option_index = 0;
     const static struct option long_options[] = {
@@ -63,9 +66,10 @@ int main(int argc, char *argv[])
       {"loop", no_argument, 0, 'l'},
       {"timeout", required_argument, 0, 't'},
       {"host", required_argument, 0, 'x'}, /* N.B. Cannot use 'h' */
-      {"port", required_argument, 0, 'p'}
+      {"port", required_argument, 0, 'p'},
+      {"shm", no_argument, 0, 's'}
     };
-    const int c = getopt_long(argc, argv, "hlt:x:p:",
+    const int c = getopt_long(argc, argv, "hlt:x:p:s",
                               long_options, &option_index);
     if (-1 == c) {
       /* All options parsed */
@@ -93,6 +97,9 @@ int main(int argc, char *argv[])
     case 'p':
       port = optarg;
       break;
+    case 's':
+      transport = libsitu::TRANSPORT_SHM;
+      break;
     case '?':
       /* Unexpected option parsed */
       exit_code = EXIT_FAILURE;
@@ -102,7 +109,7 @@ int main(int argc, char *argv[])
     }
   }
 
-  libsitu::Client client(host, port, timeout_s, !loop);
+  libsitu::Client client(host, port, timeout_s, !loop, transport);
 
   /* N.B. Sleep here for longer than the timeout, to keep the main thread
      alive */
@@ -0,0 +1,197 @@
+/*
+  Copyright 2013-2014 Simon Dawson
+
+  This file is part of libsitu.
+
+  libsitu is free software: you can redistribute it and/or modify
+  it under the terms of the GNU Lesser General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  libsitu is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU Lesser General Public License for more details.
+
+  You should have received a copy of the GNU Lesser General Public License
+  along with libsitu.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include <getopt.h>
+
+#include <string>
+#include <vector>
+
+#include <libsitu.h>
+
+#include <gpsdb.h>
+
+void print_help(
+  const char *program_name
+)
+{
+  printf("Usage: %s [OPTION]... SOURCE DATABASE\n"
+         "\n"
+         "Compile a watch source file into a watch database, for\n"
+         "Gps::open_database()\n"
+         "\n"
+         "Each line of the source file is a watch, as\n"
+         "NAME,LATITUDE,LONGITUDE,RADIUS (in degrees and meters). Names\n"
+         "must be unique, and may contain commas. Blank lines, and lines\n"
+         "starting with '#', are ignored.\n"
+         "\n"
+         "Options:\n"
+         "  -h, --help             Print usage information\n"
+         "  -v, --version=VERSION  Version number of the database (default:\n"
+         "                         the current time, in seconds since the\n"
+         "                         epoch)\n",
+         program_name);
+}
+
+bool parse_number(const char *str, double &val)
+{
+  char *end = NULL;
+  val = strtod(str, &end);
+  return end != str && '\0' == *end;
+}
+
+bool parse_line(char *line, libsitu::Database::Source &source)
+/* Parse a source line, in place. The fields are found from the right, so
+ * that the name may contain commas */
+{
+  char *fields[3];
+  for (int i = 2; i >= 0; --i) {
+    char *comma = strrchr(line, ',');
+    if (NULL == comma) {
+      return false;
+    }
+    *comma = '\0';
+    fields[i] = comma + 1;
+  }
+  source.name = line;
+  return !source.name.empty() &&
+    parse_number(fields[0], source.lat) &&
+    parse_number(fields[1], source.lon) &&
+    parse_number(fields[2], source.rad);
+}
+
+bool read_source(const char *path,
+                 std::vector<libsitu::Database::Source> &sources)
+{
+  FILE *file = fopen(path, "r");
+  if (NULL == file) {
+    perror(path);
+    return false;
+  }
+
+  bool ok = true;
+  char line[1024];
+  unsigned long line_number = 0;
+  while (ok && NULL != fgets(line, sizeof(line), file)) {
+    ++line_number;
+    size_t length = strlen(line);
+    if (0 != length && '\n' != line[length - 1] && !feof(file)) {
+      fprintf(stderr, "%s:%lu: Line too long\n", path, line_number);
+      ok = false;
+      break;
+    }
+    while (0 != length && ('\n' == line[length - 1] ||
+                           '\r' == line[length - 1])) {
+      line[--length] = '\0';
+    }
+    if (0 == length || '#' == line[0]) {
+      continue;
+    }
+
+    libsitu::Database::Source source;
+    if (!parse_line(line, source)) {
+      fprintf(stderr, "%s:%lu: Expected NAME,LATITUDE,LONGITUDE,RADIUS\n",
+              path, line_number);
+      ok = false;
+    } else {
+      sources.push_back(source);
+    }
+  }
+  if (ok && ferror(file)) {
+    perror(path);
+    ok = false;
+  }
+
+  fclose(file);
+  return ok;
+}
+
+int main(int argc, char *argv[])
+{
+  int exit_code = EXIT_SUCCESS;
+
+  /* Process command line */
+  const char *program_name = argv[0];
+  uint64_t version = time(NULL);
+  while (true) {
+    int option_index = 0;
+    const static struct option long_options[] = {
+      {"help", no_argument, 0, 'h'},
+      {"version", required_argument, 0, 'v'},
+      {0, 0, 0, 0}
+    };
+    const int c = getopt_long(argc, argv, "hv:",
+                              long_options, &option_index);
+    if (-1 == c) {
+      /* All options parsed */
+      break;
+    }
+    switch (c) {
+    case 'h':
+      print_help(program_name);
+      exit_code = EXIT_SUCCESS;
+      return exit_code;
+    case 'v':
+      {
+        char *end = NULL;
+        version = strtoull(optarg, &end, 10);
+        if (end == optarg || '\0' != *end) {
+          fprintf(stderr, "Failed to parse --version option value\n");
+          exit_code = EXIT_FAILURE;
+          return exit_code;
+        }
+      }
+      break;
+    case '?':
+      /* Unexpected option parsed */
+      exit_code = EXIT_FAILURE;
+      return exit_code;
+    default:
+      break;
+    }
+  }
+  if (argc - optind != 2) {
+    print_help(program_name);
+    exit_code = EXIT_FAILURE;
+    return exit_code;
+  }
+  const char *source_path = argv[optind];
+  const char *database_path = argv[optind + 1];
+
+  std::vector<libsitu::Database::Source> sources;
+  if (!read_source(source_path, sources)) {
+    exit_code = EXIT_FAILURE;
+    return exit_code;
+  }
+
+  if (!libsitu::Database::compile(database_path, version, sources)) {
+    fprintf(stderr, "Failed to compile %s\n", database_path);
+    exit_code = EXIT_FAILURE;
+    return exit_code;
+  }
+
+  printf("Compiled %lu watches into %s, version %llu\n",
+         static_cast<unsigned long>(sources.size()), database_path,
+         static_cast<unsigned long long>(version));
+  return exit_code;
+}